@@ -1,29 +1,165 @@
 #include "AudioSim.h"
 #include <stdlib.h>
+#include <stdio.h>
 #include <sndfile.h>
 #include <string.h>
 #include <math.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "convolve.h"
+#include "fftplan.h"
 #include "irs.h"
+#include "scenecache.h"
+#include "threadpool.h"
+#include "ringbuffer.h"
+#include "arena.h"
+#include "ircache.h"
+#include "stats.h"
+#include "kernels.h"
+#include "alloccount.h"
+
+_Static_assert((int)AUDIOSIM_STAGE_COUNT == (int)STATS_STAGES, "stages differ from the ones timed");
+_Static_assert((int)AUDIOSIM_TRIM_ENERGY == (int)IRS_TRIM_ENERGY, "trim modes differ from the loader's");
+_Static_assert((int)AUDIOSIM_STORAGE_INT16 == (int)SAMPLE_PACK_INT16, "storage formats differ from the packing ones");
+_Static_assert(AUDIOSIM_HISTOGRAM_BUCKETS == STATS_HISTOGRAM_BUCKETS, "histograms differ");
 
 typedef struct {
   SNDFILE* sf;
   SF_INFO info;
-  ComplexNum* data;
+  Sample* data;
 } SoundFile;
 
+// Streams of one render that share a source and position, and so an impulse response
+typedef struct {
+  IRSSource* source;
+  float x;
+  float y;
+  float z;
+  int irLen;
+  // The cached response when the AudioSim has a cache, released after the render
+  IRCacheEntry* entry;
+  // Everything below lives in the group's arena
+  Arena* arena;
+  ComplexNum* spectra;
+  // Interpolated impulse response and transform scratch, for sources without precomputed spectra
+  Sample* ir;
+  Sample* scratch;
+} MixGroup;
+
 struct AudioSim_s {
   int sampleRate;
+  int partitionSize;
+  FFTPlanCache* plans;
   IRSFile* irsFile;
+  ThreadPool* pool;
+
+  // Every stream that hasn't been destroyed, in creation order
+  // Guarded by streamLock while the engine thread runs
+  AudioStream** streams;
+  int nStreams;
+  int streamCapacity;
+
+  float moveThreshold;
+  int crossfadeMoves;
+  // NULL when impulse responses aren't cached
+  IRCache* irCache;
+
+  // Scratch space for audioSim_render, reused by every stream
+  // Two sets used in turn, so the previous render's spectra are still there while streams fade from them
+  MixGroup* groups[2];
+  int groupCapacity[2];
+  int groupSet;
+  // Longest impulse response of any stream's source, the groups' buffers fit it
+  int groupDataLen;
+  // Output of every stream for the current render, nStreams blocks of scratchLen samples
+  Sample* streamOutputs;
+  int streamOutputsCapacity;
+  Sample* silence;
+  int scratchLen;
+  // Running peak of the mixed output
+  double busMax;
+
+  // Fraction of a block's duration it may take to process, 0 to not count overruns
+  double deadline;
+  BlockTimes renderTimes;
+  // Blocks of streams that have been destroyed, guarded by streamLock
+  AudioSimBlockStats destroyedStreams;
+  int sceneCacheHit;
+
+  // Real time engine, ringFrames is 0 until it was started
+  pthread_t engine;
+  atomic_bool engineRunning;
+  pthread_mutex_t streamLock;
+  int ringFrames;
+  Sample* engineInput;
+  // The streams the engine is processing, copied from streams under streamLock and used outside it
+  // While engineBusy is set nothing may change them, engineIdle is signalled when it's cleared
+  AudioStream** engineStreams;
+  bool engineBusy;
+  pthread_cond_t engineIdle;
+  // Set when there may be work for the engine, which waits on engineWake while there's none
+  // engineLock is only taken to wake it while engineSleeping is set
+  atomic_bool engineWoken;
+  atomic_bool engineSleeping;
+  pthread_mutex_t engineLock;
+  pthread_cond_t engineWake;
 };
 
+// Impulse response of one of a stream's output channels
+typedef struct {
+  // Where the channel's listener is relative to the stream
+  float dx;
+  float dy;
+  float dz;
+  // The cache entry the channel's spectra belong to, when there's a cache
+  IRCacheEntry* irEntry;
+  // Index of the channel's group in the current render
+  int group;
+} StreamChannel;
+
 struct AudioStream_s {
   AudioSim* audioSim;
   IRSSource* source;
-  double* leftovers;
+  // Holds the stream itself, its convolver, channels and scratch buffers, so processing never allocates
+  Arena* arena;
+  // One convolver output per channel
+  Convolver* convolver;
+  StreamChannel* channels;
+  int nChannels;
+  Sample* irScratch;
+  // For transforming responses that miss the cache, NULL without one
+  Sample* spectraScratch;
   double max;
+  // Position the current impulse responses were interpolated for, and whether the latest render changed them
+  float irX;
+  float irY;
+  float irZ;
+  int irChanged;
+  // Position for the next audioSim_render or engine block, set from any thread
+  // The coordinates are updated separately, which at worst mixes two consecutive positions for one block
+  _Atomic float x;
+  _Atomic float y;
+  _Atomic float z;
+  // Input for the next audioSim_render
+  Sample* input;
+  // Queues to and from the engine thread, NULL until it was started
+  // Published with release stores, since the producer and audio callback may see a stream before they exist
+  // The output queue holds interleaved frames, engineOutput a partition of them
+  _Atomic(RingBuffer*) inputRing;
+  _Atomic(RingBuffer*) outputRing;
+  Sample* engineOutput;
+  // Where the stream's frames start in the render's stream outputs
+  size_t outputOffset;
+  BlockTimes times;
 };
 
+// What the render tasks running on the pool need to know about the block
+typedef struct {
+  AudioSim* audioSim;
+  int len;
+} RenderJob;
+
 SoundFile* loadSound(char* fileName) {
   SoundFile* file = malloc(sizeof(SoundFile));
   file->info.format = 0;
@@ -33,17 +169,14 @@ SoundFile* loadSound(char* fileName) {
     exit(-1);
   }
 
-  file->data = malloc(file->info.frames*sizeof(ComplexNum));
+  file->data = malloc(file->info.frames*sizeof(Sample));
 
   int totalFrames = file->info.frames*file->info.channels;
   double* buf = malloc(totalFrames*sizeof(double));
   sf_readf_double(file->sf, buf, totalFrames);
 
   for (int i = 0; i < file->info.frames; i++) {
-    if (file->info.channels > 0) {
-      file->data[i].re = buf[i*file->info.channels];
-    }
-    file->data[i].im = 0;
+    file->data[i] = buf[i*file->info.channels];
   }
 
   free(buf);
@@ -60,113 +193,761 @@ void freeSound(SoundFile* s) {
   free(s);
 }
 
+#ifdef AUDIOSIM_COUNT_ALLOCS
+static atomic_long allocations;
+
+void allocCount_add(void) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+}
+#endif
+
+long audioSim_allocationCount(void) {
+#ifdef AUDIOSIM_COUNT_ALLOCS
+  return atomic_load(&allocations);
+#else
+  return -1;
+#endif
+}
+
+void audioSim_defaultConfig(AudioSimConfig* config) {
+  config->partitionSize = AUDIOSIM_DEFAULT_PARTITION_SIZE;
+  config->planEffort = AUDIOSIM_PLAN_ESTIMATE;
+  config->wisdomFile = NULL;
+  config->precomputeSpectra = 1;
+  config->useSceneCache = 0;
+  config->sceneCacheFile = NULL;
+  config->numThreads = 0;
+  config->loadThreads = 0;
+  config->moveThreshold = 0;
+  config->crossfadeMoves = 1;
+  config->irCacheBytes = 0;
+  config->irCacheCellSize = 0.05f;
+  config->sampleRate = 44100;
+  config->deadline = 1;
+  config->trimMode = AUDIOSIM_TRIM_NONE;
+  config->trimThreshold = 60;
+  config->irStorage = AUDIOSIM_STORAGE_FLOAT;
+}
+
 AudioSim* audioSim_init(char* irsFile) {
-  // disregard irsFile and load our own echo file
+  AudioSimConfig config;
+  audioSim_defaultConfig(&config);
+  return audioSim_initWithConfig(irsFile, &config);
+}
+
+AudioSim* audioSim_initWithConfig(char* irsFile, AudioSimConfig* config) {
   AudioSim* sim = malloc(sizeof(AudioSim));
-  sim->irsFile = loadIRSFile(irsFile);
+  sim->partitionSize = fftPlanCache_fastSize(config->partitionSize);
+  sim->streams = NULL;
+  sim->nStreams = 0;
+  sim->streamCapacity = 0;
+  sim->moveThreshold = config->moveThreshold;
+  sim->crossfadeMoves = config->crossfadeMoves;
+  for (int i = 0; i < 2; i++) {
+    sim->groups[i] = NULL;
+    sim->groupCapacity[i] = 0;
+  }
+  sim->groupSet = 0;
+  sim->groupDataLen = 0;
+  sim->streamOutputs = NULL;
+  sim->streamOutputsCapacity = 0;
+  sim->silence = NULL;
+  sim->scratchLen = 0;
+  sim->busMax = 1.0;
+  sim->sampleRate = config->sampleRate;
+  sim->deadline = config->deadline;
+  blockTimes_init(&sim->renderTimes);
+  memset(&sim->destroyedStreams, 0, sizeof(AudioSimBlockStats));
+  sim->sceneCacheHit = 0;
+  atomic_init(&sim->engineRunning, false);
+  pthread_mutex_init(&sim->streamLock, NULL);
+  sim->ringFrames = 0;
+  sim->engineInput = NULL;
+  sim->engineStreams = NULL;
+  sim->engineBusy = false;
+  pthread_cond_init(&sim->engineIdle, NULL);
+  pthread_mutex_init(&sim->engineLock, NULL);
+  pthread_cond_init(&sim->engineWake, NULL);
+  atomic_init(&sim->engineWoken, false);
+  atomic_init(&sim->engineSleeping, false);
+  sim->pool = threadPool_init(config->numThreads > 0 ? config->numThreads : threadPool_cpuCount());
+
+  unsigned plannerFlags = FFTW_ESTIMATE;
+  if (config->planEffort == AUDIOSIM_PLAN_MEASURE) {
+    plannerFlags = FFTW_MEASURE;
+  } else if (config->planEffort == AUDIOSIM_PLAN_PATIENT) {
+    plannerFlags = FFTW_PATIENT;
+  }
+  sim->plans = fftPlanCache_init(plannerFlags, config->wisdomFile);
+
+  IRSLoadOptions loadOptions;
+  getDefaultIRSLoadOptions(&loadOptions);
+  loadOptions.sampleRate = config->sampleRate;
+  loadOptions.numThreads = config->loadThreads;
+  loadOptions.trimMode = (IRSTrimMode)config->trimMode;
+  loadOptions.trimThreshold = config->trimThreshold;
+  loadOptions.storage = (SamplePackFormat)config->irStorage;
+  if (config->precomputeSpectra) {
+    loadOptions.spectrumPartitionSize = sim->partitionSize;
+    loadOptions.plans = sim->plans;
+  }
+  if (config->useSceneCache) {
+    const char* cacheFile = config->sceneCacheFile;
+    char* defaultCacheFile = NULL;
+    if (cacheFile == NULL) {
+      defaultCacheFile = malloc(strlen(irsFile) + 7);
+      sprintf(defaultCacheFile, "%s.cache", irsFile);
+      cacheFile = defaultCacheFile;
+    }
+
+    sim->irsFile = sceneCache_load(cacheFile, irsFile, &loadOptions);
+    sim->sceneCacheHit = sim->irsFile != NULL;
+    if (sim->irsFile == NULL) {
+      sim->irsFile = loadIRSFileWithOptions(irsFile, &loadOptions);
+      if (sim->irsFile != NULL && !sceneCache_save(cacheFile, irsFile, sim->irsFile, &loadOptions)) {
+        printf("Failed to write scene cache %s\n", cacheFile);
+      }
+    }
+    free(defaultCacheFile);
+  } else {
+    sim->irsFile = loadIRSFileWithOptions(irsFile, &loadOptions);
+  }
+  sim->irCache = NULL;
   if (!sim->irsFile) {
     printf("Failed to load IRS file!\n");
+    audioSim_destroy(sim);
+    return NULL;
+  }
+
+  if (config->irCacheBytes > 0 && config->irCacheCellSize > 0) {
+    sim->irCache = irCache_init(sim->plans, sim->partitionSize, config->irCacheBytes, config->irCacheCellSize,
+        getMaxDataLength(sim->irsFile));
   }
   return sim;
 }
 
+// Releases the buffers of both sets of mix groups, they're reallocated as needed on the next render
+static void freeMixGroups(AudioSim* a) {
+  for (int set = 0; set < 2; set++) {
+    for (int i = 0; i < a->groupCapacity[set]; i++) {
+      arena_destroy(a->groups[set][i].arena);
+    }
+    a->groupCapacity[set] = 0;
+  }
+}
+
 void audioSim_destroy(AudioSim* a) {
-  free(a->irsFile);
+  audioSim_stopEngine(a);
+  free(a->engineInput);
+  free(a->engineStreams);
+  pthread_cond_destroy(&a->engineIdle);
+  pthread_mutex_destroy(&a->engineLock);
+  pthread_cond_destroy(&a->engineWake);
+  pthread_mutex_destroy(&a->streamLock);
+  freeMixGroups(a);
+  for (int i = 0; i < 2; i++) {
+    free(a->groups[i]);
+  }
+  free(a->streams);
+  free(a->streamOutputs);
+  free(a->silence);
+  threadPool_destroy(a->pool);
+  if (a->irCache != NULL) {
+    irCache_destroy(a->irCache);
+  }
+  fftPlanCache_destroy(a->plans);
+  if (a->irsFile != NULL) {
+    freeIRSFile(a->irsFile);
+  }
   free(a);
 }
 
+void audioSim_getIRCacheStats(AudioSim* a, AudioSimIRCacheStats* stats) {
+  memset(stats, 0, sizeof(AudioSimIRCacheStats));
+  if (a->irCache != NULL) {
+    IRCacheStats cacheStats;
+    irCache_getStats(a->irCache, &cacheStats);
+    stats->hits = cacheStats.hits;
+    stats->misses = cacheStats.misses;
+    stats->evictions = cacheStats.evictions;
+    stats->entries = cacheStats.entries;
+    stats->bytes = cacheStats.bytes;
+  }
+}
+
+// Adds the blocks counted so far to stats
+static void addBlockTimes(AudioSimBlockStats* stats, BlockTimes* t) {
+  stats->blocks += atomic_load_explicit(&t->blocks, memory_order_relaxed);
+  stats->overruns += atomic_load_explicit(&t->overruns, memory_order_relaxed);
+  stats->totalSeconds += atomic_load_explicit(&t->totalNs, memory_order_relaxed)*1e-9;
+  double maxSeconds = atomic_load_explicit(&t->maxNs, memory_order_relaxed)*1e-9;
+  if (maxSeconds > stats->maxSeconds) {
+    stats->maxSeconds = maxSeconds;
+  }
+  for (int b = 0; b < AUDIOSIM_HISTOGRAM_BUCKETS; b++) {
+    stats->histogram[b] += atomic_load_explicit(&t->histogram[b], memory_order_relaxed);
+  }
+}
+
+// Longest a block of len samples may take, 0 when overruns aren't counted
+static long long blockDeadline(AudioSim* a, int len) {
+  return a->deadline > 0 ? (long long)(a->deadline*len*1e9/a->sampleRate) : 0;
+}
+
+void audioSim_getStats(AudioSim* a, AudioSimStats* stats) {
+  memset(stats, 0, sizeof(AudioSimStats));
+  long long ns[STATS_STAGES];
+  long count[STATS_STAGES];
+  stats_read(ns, count);
+  for (int i = 0; i < AUDIOSIM_STAGE_COUNT; i++) {
+    stats->stages[i].count = count[i];
+    stats->stages[i].seconds = ns[i]*1e-9;
+  }
+
+  pthread_mutex_lock(&a->streamLock);
+  stats->streamBlocks = a->destroyedStreams;
+  for (int i = 0; i < a->nStreams; i++) {
+    addBlockTimes(&stats->streamBlocks, &a->streams[i]->times);
+  }
+  pthread_mutex_unlock(&a->streamLock);
+  addBlockTimes(&stats->renders, &a->renderTimes);
+
+  stats->allocations = audioSim_allocationCount();
+  audioSim_getIRCacheStats(a, &stats->irCache);
+  long lookups = stats->irCache.hits + stats->irCache.misses;
+  stats->irCacheHitRate = lookups > 0 ? (double)stats->irCache.hits/lookups : 0;
+  stats->sceneCacheHit = a->sceneCacheHit;
+  if (a->irsFile != NULL) {
+    IRSStorageStats storage;
+    getIRSStorageStats(a->irsFile, &storage);
+    stats->irBytes = storage.bytes;
+    stats->irDecodedBytes = storage.decodedBytes;
+    stats->irStorageMaxError = storage.maxError;
+    stats->irStorageRmsError = storage.rmsError;
+  }
+}
+
+const char* audioSim_stageName(AudioSimStage stage) {
+  static const char* names[] = {"interpolate", "forward fft", "multiply", "inverse fft", "overlap-add", "normalise"};
+  return stage >= 0 && stage < AUDIOSIM_STAGE_COUNT ? names[stage] : "unknown";
+}
+
+// Switches a channel to a cached response, which it holds on to while its convolver output uses it
+static void useCacheEntry(AudioStream* s, int channel, IRCacheEntry* entry) {
+  IRCache* cache = s->audioSim->irCache;
+  StreamChannel* ch = &s->channels[channel];
+  // another position in the same cell is the same response
+  if (entry == ch->irEntry) {
+    return;
+  }
+  irCache_retain(cache, entry);
+  convolver_useIRSpectra(s->convolver, channel, irCacheEntry_spectra(entry), irCacheEntry_irLen(entry));
+  if (ch->irEntry != NULL) {
+    irCache_release(cache, ch->irEntry);
+  }
+  ch->irEntry = entry;
+}
+
+// Sets the impulse response of every channel for the position, from the cache or the precomputed spectra when there are any
+static void updateStreamIR(AudioStream* s, float x, float y, float z) {
+  long long t = stats_begin();
+  IRCache* cache = s->audioSim->irCache;
+  bool pending = false;
+  for (int c = 0; c < s->nChannels; c++) {
+    StreamChannel* ch = &s->channels[c];
+    float cx = x + ch->dx;
+    float cy = y + ch->dy;
+    float cz = z + ch->dz;
+    if (cache != NULL) {
+      IRCacheEntry* entry = irCache_acquire(cache, s->source, cx, cy, cz, s->irScratch, s->spectraScratch);
+      if (entry != NULL) {
+        useCacheEntry(s, c, entry);
+        irCache_release(cache, entry);
+        continue;
+      }
+      // the cell is still being interpolated elsewhere or the cache is full, a channel that has a
+      // response keeps it for now, a new one interpolates its own below
+      if (ch->irEntry != NULL) {
+        pending = true;
+        continue;
+      }
+    }
+
+    int irLen;
+    if (getSpectraLength(s->source) > 0) {
+      getInterpolatedSpectra(s->source, cx, cy, cz, convolver_irSpectraBuffer(s->convolver, c), &irLen);
+      convolver_commitIRSpectra(s->convolver, c, irLen);
+    } else {
+      getInterpolatedDataInto(s->source, cx, cy, cz, s->irScratch, &irLen);
+      convolver_setIR(s->convolver, c, s->irScratch, irLen);
+    }
+  }
+  // keeping the old position makes the next block try again
+  if (!pending) {
+    s->irX = x;
+    s->irY = y;
+    s->irZ = z;
+  }
+  stats_lap(STATS_INTERPOLATE, t);
+}
+
+// Waits with streamLock held until the engine is done with its copy of the streams
+static void waitForEngine(AudioSim* a) {
+  while (a->engineBusy) {
+    pthread_cond_wait(&a->engineIdle, &a->streamLock);
+  }
+}
+
+// Tells the engine there may be work, only locking when it's asleep and so not holding the lock
+// Both flags are sequentially consistent, so either the engine sees engineWoken before it sleeps or this sees it sleeping
+static void wakeEngine(AudioSim* a) {
+  atomic_store(&a->engineWoken, true);
+  if (atomic_load(&a->engineSleeping)) {
+    pthread_mutex_lock(&a->engineLock);
+    pthread_cond_signal(&a->engineWake);
+    pthread_mutex_unlock(&a->engineLock);
+  }
+}
+
 AudioStream* audioSim_initStream(AudioSim* a, float x, float y, float z) {
-  AudioStream* stream = malloc(sizeof(AudioStream));
+  return audioSim_initStreamChannels(a, x, y, z, 1, NULL);
+}
+
+AudioStream* audioSim_initStreamChannels(AudioSim* a, float x, float y, float z, int channels, const float* offsets) {
+  IRSSource* source = getClosestSource(a->irsFile, x, y, z);
+  int dataLen = getDataLength(source);
+  int scratchLen = a->irCache != NULL ? convolver_scratchLength(a->partitionSize, dataLen) : 0;
+  Arena* arena = arena_init(arena_pieceSize(sizeof(AudioStream))
+    + convolver_arenaSize(a->partitionSize, dataLen, channels)
+    + arena_pieceSize(channels*sizeof(StreamChannel))
+    + arena_pieceSize(dataLen*sizeof(Sample))
+    + (scratchLen > 0 ? arena_pieceSize(scratchLen*sizeof(Sample)) : 0)
+    + arena_pieceSize(a->partitionSize*channels*sizeof(Sample)));
+
+  AudioStream* stream = arena_alloc(arena, sizeof(AudioStream));
   stream->audioSim = a;
-  stream->source = getClosestSource(a->irsFile, x, y, z);
-  stream->leftovers = NULL;
+  stream->source = source;
+  stream->arena = arena;
+  stream->convolver = convolver_initInArena(a->plans, a->partitionSize, dataLen, channels, arena);
+  convolver_setCrossfade(stream->convolver, a->crossfadeMoves);
+  stream->nChannels = channels;
+  stream->channels = arena_alloc(arena, channels*sizeof(StreamChannel));
+  for (int c = 0; c < channels; c++) {
+    StreamChannel* ch = &stream->channels[c];
+    ch->dx = offsets != NULL ? offsets[3*c] : 0;
+    ch->dy = offsets != NULL ? offsets[3*c + 1] : 0;
+    ch->dz = offsets != NULL ? offsets[3*c + 2] : 0;
+    ch->irEntry = NULL;
+    ch->group = 0;
+  }
+  stream->irChanged = 0;
+  blockTimes_init(&stream->times);
+  stream->irScratch = arena_alloc(arena, dataLen*sizeof(Sample));
+  stream->spectraScratch = scratchLen > 0 ? arena_alloc(arena, scratchLen*sizeof(Sample)) : NULL;
+  stream->engineOutput = arena_alloc(arena, a->partitionSize*channels*sizeof(Sample));
+  updateStreamIR(stream, x, y, z);
+
   stream->max = 1.0;
+  stream->x = x;
+  stream->y = y;
+  stream->z = z;
+  stream->input = NULL;
+  stream->outputOffset = 0;
+  atomic_init(&stream->inputRing, NULL);
+  atomic_init(&stream->outputRing, NULL);
+
+  pthread_mutex_lock(&a->streamLock);
+  if (a->ringFrames > 0) {
+    atomic_store_explicit(&stream->outputRing, ringBuffer_init(a->ringFrames*channels), memory_order_release);
+    atomic_store_explicit(&stream->inputRing, ringBuffer_init(a->ringFrames), memory_order_release);
+  }
+
+  if (dataLen > a->groupDataLen) {
+    // the mix groups' buffers are too small for this stream's source, streams keep copies of the spectra
+    // they use and the groups are reallocated on the next render
+    waitForEngine(a);
+    for (int i = 0; i < a->nStreams; i++) {
+      convolver_keepIRSpectra(a->streams[i]->convolver);
+    }
+    freeMixGroups(a);
+    a->groupDataLen = dataLen;
+  }
+
+  if (a->nStreams == a->streamCapacity) {
+    a->streamCapacity = a->streamCapacity > 0 ? 2*a->streamCapacity : 8;
+    a->streams = realloc(a->streams, a->streamCapacity*sizeof(AudioStream*));
+    // the engine's copy is only reallocated while it isn't using it
+    waitForEngine(a);
+    a->engineStreams = realloc(a->engineStreams, a->streamCapacity*sizeof(AudioStream*));
+  }
+  a->streams[a->nStreams++] = stream;
+  pthread_mutex_unlock(&a->streamLock);
   return stream;
 }
 
 void audioSim_destroyStream(AudioStream* s) {
-  if (s->leftovers != NULL) {
-    free(s->leftovers);
+  AudioSim* a = s->audioSim;
+  pthread_mutex_lock(&a->streamLock);
+  for (int i = 0; i < a->nStreams; i++) {
+    if (a->streams[i] == s) {
+      memmove(a->streams + i, a->streams + i + 1, (a->nStreams - i - 1)*sizeof(AudioStream*));
+      a->nStreams--;
+      break;
+    }
   }
+  // the engine may still be processing it from its copy of the streams
+  waitForEngine(a);
+  addBlockTimes(&a->destroyedStreams, &s->times);
+  pthread_mutex_unlock(&a->streamLock);
 
-  free(s);
+  if (atomic_load_explicit(&s->inputRing, memory_order_relaxed) != NULL) {
+    ringBuffer_destroy(atomic_load_explicit(&s->inputRing, memory_order_relaxed));
+    ringBuffer_destroy(atomic_load_explicit(&s->outputRing, memory_order_relaxed));
+  }
+  for (int c = 0; c < s->nChannels; c++) {
+    if (s->channels[c].irEntry != NULL) {
+      irCache_release(a->irCache, s->channels[c].irEntry);
+    }
+  }
+  // the convolver and the stream itself live in the arena
+  arena_destroy(s->arena);
 }
 
 void audioSim_resetStream(AudioStream* s) {
-  if (s->leftovers != NULL) {
-    free(s->leftovers);
+  convolver_reset(s->convolver);
+}
+
+// Whether the stream moved far enough from its impulse response's position for a new one
+// While a crossfade is running the switch waits, the next call picks up the position again
+static int streamNeedsIR(AudioStream* s, float x, float y, float z) {
+  if (convolver_isCrossfading(s->convolver)) {
+    return 0;
   }
+  float dx = x - s->irX;
+  float dy = y - s->irY;
+  float dz = z - s->irZ;
+  float threshold = s->audioSim->moveThreshold;
+  return dx*dx + dy*dy + dz*dz > threshold*threshold;
+}
+
+// audioSim_processStream without the block's time
+static void convolveStream(AudioStream* s, float x, float y, float z, Sample* dst, Sample* src, int len) {
+  if (streamNeedsIR(s, x, y, z)) {
+    updateStreamIR(s, x, y, z);
+  }
+  convolver_process(s->convolver, dst, src, len);
+}
+
+void audioSim_processStream(AudioStream* s, float x, float y, float z, Sample* dst, Sample* src, int len) {
+  long long start = stats_now();
+  convolveStream(s, x, y, z, dst, src, len);
+  blockTimes_add(&s->times, stats_now() - start, blockDeadline(s->audioSim, len));
+}
+
+void audioSim_normalise(Sample* x, int n, double* peak) {
+  long long t = stats_begin();
+  const Kernels* kernels = kernels_get();
+  kernels->scale(x, 0.25, n);
+  *peak = kernels->peak(x, n, *peak);
+  kernels->scale(x, 0.99 / *peak, n);
+  stats_lap(STATS_NORMALISE, t);
+}
+
+void audioSim_modifyStream(AudioStream* s, float x, float y, float z, Sample* dst, Sample* src, int len) {
+  long long start = stats_now();
+  convolveStream(s, x, y, z, dst, src, len);
+  // one peak for all channels keeps the balance between them
+  audioSim_normalise(dst, len*s->nChannels, &s->max);
+  blockTimes_add(&s->times, stats_now() - start, blockDeadline(s->audioSim, len));
+}
+
+int audioSim_getStreamTailLength(AudioStream* s) {
+  return getDataLength(s->source) - 1;
+}
+
+void audioSim_getStreamStats(AudioStream* s, AudioSimBlockStats* stats) {
+  memset(stats, 0, sizeof(AudioSimBlockStats));
+  addBlockTimes(stats, &s->times);
+}
+
+int audioSim_getStreamChannels(AudioStream* s) {
+  return s->nChannels;
+}
+
+void audioSim_setStreamPosition(AudioStream* s, float x, float y, float z) {
+  s->x = x;
+  s->y = y;
+  s->z = z;
+}
+
+void audioSim_setStreamInput(AudioStream* s, Sample* src) {
+  s->input = src;
 }
 
-void audioSim_modifyStream(AudioStream* s, float x, float y, float z, double* dst, double* src, int len) {
-  ComplexNum* srcComplex = malloc(len*sizeof(ComplexNum));
+// Returns the index of the group for the source and impulse response position, adding a group if it's new
+static int findMixGroup(AudioSim* a, IRSSource* source, float x, float y, float z, int* nGroups) {
+  int set = a->groupSet;
+  for (int i = 0; i < *nGroups; i++) {
+    MixGroup* g = &a->groups[set][i];
+    if (g->source == source && g->x == x && g->y == y && g->z == z) {
+      return i;
+    }
+  }
 
-  for (int i = 0; i < len; i++) {
-    srcComplex[i].re = src[i];
-    srcComplex[i].im = 0;
+  if (*nGroups == a->groupCapacity[set]) {
+    int capacity = a->groupCapacity[set] > 0 ? 2*a->groupCapacity[set] : 8;
+    a->groups[set] = realloc(a->groups[set], capacity*sizeof(MixGroup));
+    int spectraLen = convolver_spectraLength(a->partitionSize, a->groupDataLen);
+    int scratchLen = convolver_scratchLength(a->partitionSize, a->groupDataLen);
+    for (int i = a->groupCapacity[set]; i < capacity; i++) {
+      MixGroup* g = &a->groups[set][i];
+      g->arena = arena_init(arena_pieceSize(spectraLen*sizeof(ComplexNum))
+        + arena_pieceSize(a->groupDataLen*sizeof(Sample))
+        + arena_pieceSize(scratchLen*sizeof(Sample)));
+      g->spectra = arena_alloc(g->arena, spectraLen*sizeof(ComplexNum));
+      g->ir = arena_alloc(g->arena, a->groupDataLen*sizeof(Sample));
+      g->scratch = arena_alloc(g->arena, scratchLen*sizeof(Sample));
+    }
+    a->groupCapacity[set] = capacity;
   }
 
-  ComplexNum* dstComplex;
-  int dstLen;
+  MixGroup* g = &a->groups[set][*nGroups];
+  g->source = source;
+  g->x = x;
+  g->y = y;
+  g->z = z;
+  return (*nGroups)++;
+}
 
-  int irLen;
-  double* irDataDoubles;
-  getInterpolatedData(s->source, x, y, z, &irDataDoubles, &irLen);
-  ComplexNum* irData = malloc(irLen*sizeof(ComplexNum));
+// Interpolates the impulse response of one group
+static void renderGroupTask(void* context, int index) {
+  RenderJob* job = context;
+  AudioSim* a = job->audioSim;
+  MixGroup* g = &a->groups[a->groupSet][index];
+  long long t = stats_begin();
+  if (a->irCache != NULL) {
+    g->entry = irCache_acquire(a->irCache, g->source, g->x, g->y, g->z, g->ir, g->scratch);
+  } else if (getSpectraLength(g->source) > 0) {
+    getInterpolatedSpectra(g->source, g->x, g->y, g->z, g->spectra, &g->irLen);
+  } else {
+    getInterpolatedDataInto(g->source, g->x, g->y, g->z, g->ir, &g->irLen);
+    convolver_computeSpectra(a->plans, a->partitionSize, g->ir, g->irLen, g->spectra, g->scratch);
+  }
+  stats_lap(STATS_INTERPOLATE, t);
+}
 
-  for (int i = 0; i < irLen; i++) {
-    irData[i].re = irDataDoubles[i];
-    irData[i].im = 0;
+// Convolves one stream into its own output block
+static void renderStreamTask(void* context, int index) {
+  RenderJob* job = context;
+  AudioSim* a = job->audioSim;
+  AudioStream* s = a->streams[index];
+  long long start = stats_now();
+  for (int c = 0; c < s->nChannels; c++) {
+    MixGroup* g = &a->groups[a->groupSet][s->channels[c].group];
+    if (a->irCache != NULL) {
+      // the stream keeps its own reference, so its spectra stay put between renders
+      // a group the cache had no entry for leaves its streams on their response until a later render
+      if (g->entry != NULL) {
+        useCacheEntry(s, c, g->entry);
+      }
+    } else if (s->irChanged) {
+      convolver_useIRSpectra(s->convolver, c, g->spectra, g->irLen);
+    } else {
+      // same position as last time, so the same spectra, just in this render's group
+      convolver_moveIRSpectra(s->convolver, c, g->spectra);
+    }
   }
 
-  CONVOLVE(
-    srcComplex,
-    len,
+  // streams without input still play out their tail
+  convolver_process(s->convolver, a->streamOutputs + s->outputOffset, s->input != NULL ? s->input : a->silence, job->len);
+  blockTimes_add(&s->times, stats_now() - start, blockDeadline(a, job->len));
+}
 
-    irData,
-    irLen,
+void audioSim_render(AudioSim* a, Sample* dst, int len) {
+  long long start = stats_now();
+  if (len > a->scratchLen) {
+    a->silence = realloc(a->silence, len*sizeof(Sample));
+    memset(a->silence, 0, len*sizeof(Sample));
+    a->scratchLen = len;
+  }
+  size_t outputLen = 0;
+  for (int i = 0; i < a->nStreams; i++) {
+    a->streams[i]->outputOffset = outputLen;
+    outputLen += (size_t)a->streams[i]->nChannels*len;
+  }
+  if (outputLen > (size_t)a->streamOutputsCapacity) {
+    a->streamOutputsCapacity = outputLen;
+    a->streamOutputs = realloc(a->streamOutputs, a->streamOutputsCapacity*sizeof(Sample));
+  }
 
-    &dstComplex,
-    &dstLen
-  );
+  a->groupSet = !a->groupSet;
+  int nGroups = 0;
+  for (int i = 0; i < a->nStreams; i++) {
+    AudioStream* s = a->streams[i];
+    s->irChanged = streamNeedsIR(s, s->x, s->y, s->z);
+    if (s->irChanged) {
+      s->irX = s->x;
+      s->irY = s->y;
+      s->irZ = s->z;
+    }
+    for (int c = 0; c < s->nChannels; c++) {
+      StreamChannel* ch = &s->channels[c];
+      ch->group = findMixGroup(a, s->source, s->irX + ch->dx, s->irY + ch->dy, s->irZ + ch->dz, &nGroups);
+    }
+  }
 
-  free(irData);
-  free(irDataDoubles);
+  // Each stream's convolution stays on one thread, and the outputs are summed in stream order below,
+  // so the result is bit identical however many threads there are
+  RenderJob job = {a, len};
+  threadPool_parallelFor(a->pool, nGroups, renderGroupTask, &job);
+  threadPool_parallelFor(a->pool, a->nStreams, renderStreamTask, &job);
+  if (a->irCache != NULL) {
+    for (int i = 0; i < nGroups; i++) {
+      if (a->groups[a->groupSet][i].entry != NULL) {
+        irCache_release(a->irCache, a->groups[a->groupSet][i].entry);
+      }
+    }
+  }
 
-  int numLeftoversUsed = len;
-  if (len > dstLen-len) {
-    numLeftoversUsed = dstLen-len;
+  long long t = stats_begin();
+  memset(dst, 0, len*sizeof(Sample));
+  for (int i = 0; i < a->nStreams; i++) {
+    AudioStream* s = a->streams[i];
+    Sample* out = a->streamOutputs + s->outputOffset;
+    if (s->nChannels == 1) {
+      for (int j = 0; j < len; j++) {
+        dst[j] += 0.25 * out[j];
+      }
+    } else {
+      // the bus is mono, so streams with more channels are mixed down
+      Sample gain = 0.25 / s->nChannels;
+      for (int j = 0; j < len; j++) {
+        for (int c = 0; c < s->nChannels; c++) {
+          dst[j] += gain * out[j*s->nChannels + c];
+        }
+      }
+    }
+    s->input = NULL;
   }
 
-  // record result
-  for (int i = 0; i < len; i++) {
-    dst[i] = dstComplex[i].re;
-    if (s->leftovers != NULL && i < numLeftoversUsed) {
-      dst[i] += s->leftovers[i];
-      s->leftovers[i] = 0;
+  const Kernels* kernels = kernels_get();
+  a->busMax = kernels->peak(dst, len, a->busMax);
+  kernels->scale(dst, 0.99 / a->busMax, len);
+  stats_lap(STATS_NORMALISE, t);
+  blockTimes_add(&a->renderTimes, stats_now() - start, blockDeadline(a, len));
+}
+
+static void* engineMain(void* arg) {
+  AudioSim* a = arg;
+  while (atomic_load(&a->engineRunning)) {
+    bool processed = false;
+
+    // streams are only convolved outside the lock, so creating and destroying them and reading stats
+    // doesn't wait for a whole pass
+    pthread_mutex_lock(&a->streamLock);
+    int nStreams = a->nStreams;
+    memcpy(a->engineStreams, a->streams, nStreams*sizeof(AudioStream*));
+    a->engineBusy = true;
+    pthread_mutex_unlock(&a->streamLock);
+
+    for (int i = 0; i < nStreams; i++) {
+      AudioStream* s = a->engineStreams[i];
+      RingBuffer* inputRing = atomic_load_explicit(&s->inputRing, memory_order_acquire);
+      RingBuffer* outputRing = atomic_load_explicit(&s->outputRing, memory_order_acquire);
+      int len = ringBuffer_readAvailable(inputRing);
+      int space = ringBuffer_writeAvailable(outputRing) / s->nChannels;
+      if (space < len) {
+        len = space;
+      }
+      if (len > a->partitionSize) {
+        len = a->partitionSize;
+      }
+      if (len > 0) {
+        ringBuffer_read(inputRing, a->engineInput, len);
+        audioSim_modifyStream(s, s->x, s->y, s->z, s->engineOutput, a->engineInput, len);
+        ringBuffer_write(outputRing, s->engineOutput, len*s->nChannels);
+        processed = true;
+      }
     }
-    if (fabs(dst[i]) > s->max) {
-      s->max = fabs(dst[i]);
+
+    pthread_mutex_lock(&a->streamLock);
+    a->engineBusy = false;
+    pthread_cond_broadcast(&a->engineIdle);
+    pthread_mutex_unlock(&a->streamLock);
+
+    // nothing queued, sleep until input is pushed or output pulled, a wake up that came since the pass
+    // started is still flagged, so it isn't missed
+    if (!atomic_exchange(&a->engineWoken, false) && !processed) {
+      pthread_mutex_lock(&a->engineLock);
+      atomic_store(&a->engineSleeping, true);
+      while (!atomic_exchange(&a->engineWoken, false) && atomic_load(&a->engineRunning)) {
+        pthread_cond_wait(&a->engineWake, &a->engineLock);
+      }
+      atomic_store(&a->engineSleeping, false);
+      pthread_mutex_unlock(&a->engineLock);
     }
   }
+  return NULL;
+}
 
-  for (int i = 0; i < len; i++) {
-    dst[i] = 0.99 * (dst[i] / s->max);
+void audioSim_startEngine(AudioSim* a, int ringFrames) {
+  if (atomic_load(&a->engineRunning)) {
+    return;
   }
 
-  // record leftovers
-  double* newLeftovers = malloc((dstLen - len)*sizeof(double));
-  memset(newLeftovers, 0, (dstLen - len)*sizeof(double));
-  if (s->leftovers != NULL && numLeftoversUsed < dstLen-len) {
-    memcpy(newLeftovers, s->leftovers+len, (dstLen-len-numLeftoversUsed)*sizeof(double));
+  pthread_mutex_lock(&a->streamLock);
+  // queues keep the size they were first created with
+  if (a->ringFrames == 0) {
+    a->ringFrames = ringFrames;
+    a->engineInput = malloc(a->partitionSize*sizeof(Sample));
   }
-  for (int i = len; i < dstLen; i++) {
-    newLeftovers[i-len] += dstComplex[i].re;
+  for (int i = 0; i < a->nStreams; i++) {
+    AudioStream* s = a->streams[i];
+    if (atomic_load_explicit(&s->inputRing, memory_order_relaxed) == NULL) {
+      // the output queue first, so a stream that takes input always has somewhere for its output
+      atomic_store_explicit(&s->outputRing, ringBuffer_init(a->ringFrames*s->nChannels), memory_order_release);
+      atomic_store_explicit(&s->inputRing, ringBuffer_init(a->ringFrames), memory_order_release);
+    }
+  }
+  pthread_mutex_unlock(&a->streamLock);
+
+  atomic_store(&a->engineRunning, true);
+  pthread_create(&a->engine, NULL, engineMain, a);
+}
+
+void audioSim_stopEngine(AudioSim* a) {
+  if (!atomic_load(&a->engineRunning)) {
+    return;
+  }
+  atomic_store(&a->engineRunning, false);
+  wakeEngine(a);
+  pthread_join(a->engine, NULL);
+}
+
+int audioSim_pushInput(AudioStream* s, const Sample* src, int len) {
+  RingBuffer* inputRing = atomic_load_explicit(&s->inputRing, memory_order_acquire);
+  if (inputRing == NULL) {
+    return 0;
+  }
+  int n = ringBuffer_write(inputRing, src, len);
+  if (n > 0) {
+    wakeEngine(s->audioSim);
+  }
+  return n;
+}
+
+int audioSim_pullOutput(AudioStream* s, Sample* dst, int len) {
+  int n = 0;
+  // the engine always queues whole frames
+  RingBuffer* outputRing = atomic_load_explicit(&s->outputRing, memory_order_acquire);
+  if (outputRing != NULL) {
+    n = ringBuffer_read(outputRing, dst, len*s->nChannels) / s->nChannels;
   }
-  if (s->leftovers != NULL) {
-    free(s->leftovers);
+  // input the engine held back for lack of room in the queue can go now
+  if (n > 0) {
+    wakeEngine(s->audioSim);
   }
-  s->leftovers = newLeftovers;
-  free(dstComplex);
-  free(srcComplex);
+  // an underrun plays silence rather than waiting for the engine
+  memset(dst + n*s->nChannels, 0, (len - n)*s->nChannels*sizeof(Sample));
+  return n;
 }
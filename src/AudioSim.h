@@ -1,11 +1,187 @@
 #ifndef AUDIOSIM_H
 #define AUDIOSIM_H
 
+#include <stddef.h>
+#include "sample.h"
+
 typedef struct AudioSim_s AudioSim;
 
+/* Number of samples per impulse response partition used by the convolution engine
+ * Smaller partitions mean cheaper calls for small blocks but more partitions to accumulate
+ */
+#define AUDIOSIM_DEFAULT_PARTITION_SIZE 512
+
+/* How much time FFTW spends finding fast plans
+ * Anything but ESTIMATE is slow the first time, so it's best combined with a wisdom file
+ */
+typedef enum {
+  AUDIOSIM_PLAN_ESTIMATE,
+  AUDIOSIM_PLAN_MEASURE,
+  AUDIOSIM_PLAN_PATIENT
+} AudioSimPlanEffort;
+
+/* How the quiet end of each impulse response is cut off at load
+ * Dry rooms decay long before the end of the recorded responses, trimming them means fewer
+ * partitions to convolve and less memory
+ */
+typedef enum {
+  AUDIOSIM_TRIM_NONE,
+  // Everything after the last sample within trimThreshold dB of the response's peak
+  AUDIOSIM_TRIM_LEVEL,
+  // Everything after the point where the energy still to come is trimThreshold dB below the response's total
+  AUDIOSIM_TRIM_ENERGY
+} AudioSimTrimMode;
+
+/* How the listeners' impulse responses are kept in memory
+ * The compact formats are expanded while blending them, so the more sources and listeners a scene
+ * has, the more they save. audioSim_getStats reports the memory and the error.
+ */
+typedef enum {
+  AUDIOSIM_STORAGE_FLOAT,
+  // Half precision floats, errors around -66 dB relative to each sample
+  AUDIOSIM_STORAGE_HALF,
+  // 16 bit integers scaled per block of 64 samples, errors around -96 dB relative to each block's peak
+  AUDIOSIM_STORAGE_INT16
+} AudioSimStorage;
+
+typedef struct {
+  // Rounded up to the next size FFTW handles quickly
+  int partitionSize;
+  AudioSimPlanEffort planEffort;
+  // FFTW wisdom is loaded from here on init and saved back on destroy, NULL to disable
+  const char* wisdomFile;
+  // Transform every listener's impulse response at load so streams only blend spectra per block
+  // Costs memory about equal to the time domain data
+  int precomputeSpectra;
+  // Load the processed scene from a cache file when it matches the .irs file, otherwise
+  // process the .irs file and write the cache for next time. Off by default, so nothing is
+  // written unless asked for
+  int useSceneCache;
+  // Where the cache lives, NULL for the .irs file name with ".cache" appended
+  const char* sceneCacheFile;
+  // Threads audioSim_render spreads streams over, counting the caller, 0 (the default) for one per processor
+  // Each stream is convolved on one thread, so there's no gain beyond one thread per stream
+  // The output doesn't depend on it, streams are always mixed in the same order
+  int numThreads;
+  // Threads that process the scene at load, 0 for one per processor
+  // The result doesn't depend on it either
+  int loadThreads;
+  // A stream keeps its impulse response until it moves further than this from where it was made
+  float moveThreshold;
+  // Fade from the old impulse response to the new one over a partition when a stream moves,
+  // instead of switching abruptly. A stream moving again during its fade switches once it's over
+  int crossfadeMoves;
+  // Share interpolated impulse responses between streams and over time, 0 to interpolate per stream
+  // Positions are snapped to a grid of irCacheCellSize, and the cache holds irCacheBytes of responses,
+  // allocated up front. While all of them are in use moving streams keep their current response, so it
+  // needs room for more than one per stream channel
+  size_t irCacheBytes;
+  float irCacheCellSize;
+  // Rate the streams play at, impulse responses are converted to it once at load
+  // The deadline is measured against it too
+  int sampleRate;
+  // A block overruns when processing it takes longer than this fraction of the time it plays for, 0 to not count
+  float deadline;
+  // Trimmed responses fade out over 5 ms after the cut
+  AudioSimTrimMode trimMode;
+  float trimThreshold;
+  AudioSimStorage irStorage;
+} AudioSimConfig;
+
+typedef struct {
+  long hits;
+  long misses;
+  long evictions;
+  // What the cache holds right now
+  int entries;
+  size_t bytes;
+} AudioSimIRCacheStats;
+
+/* Stages of the processing audioSim_getStats times
+ */
+typedef enum {
+  // Getting a new impulse response, from the cache or by interpolating the listeners
+  AUDIOSIM_STAGE_INTERPOLATE,
+  AUDIOSIM_STAGE_FORWARD_FFT,
+  // Multiplying and accumulating spectra
+  AUDIOSIM_STAGE_MULTIPLY,
+  AUDIOSIM_STAGE_INVERSE_FFT,
+  // Writing the output, fades and the output of the long partitions included
+  AUDIOSIM_STAGE_OVERLAP_ADD,
+  // Peak normalisation and mixing
+  AUDIOSIM_STAGE_NORMALISE,
+  AUDIOSIM_STAGE_COUNT
+} AudioSimStage;
+
+typedef struct {
+  long count;
+  double seconds;
+} AudioSimStageStats;
+
+#define AUDIOSIM_HISTOGRAM_BUCKETS 20
+
+/* Processing times of a series of blocks
+ */
+typedef struct {
+  long blocks;
+  // Blocks that took longer than the deadline
+  long overruns;
+  double totalSeconds;
+  double maxSeconds;
+  // histogram[b] counts the blocks that took less than 2^b microseconds and at least 2^(b-1),
+  // the last bucket everything longer
+  long histogram[AUDIOSIM_HISTOGRAM_BUCKETS];
+} AudioSimBlockStats;
+
+typedef struct {
+  // Time spent in each stage by every simulation of the process
+  AudioSimStageStats stages[AUDIOSIM_STAGE_COUNT];
+  // Every block of every stream so far, through audioSim_modifyStream, audioSim_render or the engine
+  AudioSimBlockStats streamBlocks;
+  // Calls of audioSim_render, each one block of the whole mix
+  AudioSimBlockStats renders;
+  // audioSim_allocationCount
+  long allocations;
+  AudioSimIRCacheStats irCache;
+  // Hits over lookups of the impulse response cache, 0 before the first
+  double irCacheHitRate;
+  // Whether the scene was loaded from the scene cache rather than the .irs file
+  int sceneCacheHit;
+  // Memory the listeners' impulse responses take, and what they would take as Samples
+  size_t irBytes;
+  size_t irDecodedBytes;
+  // Largest and rms error the storage format adds to them, relative to the loudest sample of the scene
+  double irStorageMaxError;
+  double irStorageRmsError;
+} AudioSimStats;
+
+/* Heap allocations made by the library so far, when built with -DAUDIOSIM_COUNT_ALLOCS (otherwise -1)
+ * Streams, renders and the engine allocate everything up front, so once running this stops changing
+ */
+long audioSim_allocationCount(void);
+
+/* Fills in the settings audioSim_init uses
+ */
+void audioSim_defaultConfig(AudioSimConfig* config);
+
+/* Returns NULL if the scene can't be loaded
+ */
 AudioSim* audioSim_init(char* irsFile);
+AudioSim* audioSim_initWithConfig(char* irsFile, AudioSimConfig* config);
 void audioSim_destroy(AudioSim* a);
 
+/* Counters of the impulse response cache, all 0 when it's disabled
+ */
+void audioSim_getIRCacheStats(AudioSim* a, AudioSimIRCacheStats* stats);
+
+/* Counters of where processing time goes, collected all the time
+ * Every thread counts into its own counters, which are summed here, so this is safe to call from
+ * any thread, also while the engine runs. Everything counts up from the start, the difference of
+ * two readings covers the time in between.
+ */
+void audioSim_getStats(AudioSim* a, AudioSimStats* stats);
+const char* audioSim_stageName(AudioSimStage stage);
+
 
 /* Defines a single stream of audio in the simulation
  */
@@ -14,13 +190,77 @@ typedef struct AudioStream_s AudioStream;
 AudioStream* audioSim_initStream(AudioSim* a, float x, float y, float z);
 void audioSim_destroyStream(AudioStream* a);
 
+/* A stream with several output channels, each with its own impulse response, eg. for binaural output
+ * Channel c hears the stream from its position plus offsets[3*c], offsets[3*c+1] and offsets[3*c+2],
+ * like the left and right ear. The input is transformed once and shared by all channels.
+ * Output is interleaved, every frame holds one sample per channel, ready for sf_writef_double.
+ */
+AudioStream* audioSim_initStreamChannels(AudioSim* a, float x, float y, float z, int channels, const float* offsets);
+int audioSim_getStreamChannels(AudioStream* a);
+
 /* Resets the playback on a stream
  */
 void audioSim_resetStream(AudioStream* a);
 
 /* Interpolates the stored data and convoludes it with the given audio samples
- * len must be a power of 2 (needed for the fft)
+ * len can be any number of samples, the tail of previous calls is carried over internally
+ * dst receives len frames of audioSim_getStreamChannels samples
+ */
+void audioSim_modifyStream(AudioStream* a, float x, float y, float z, Sample* dst, Sample* src, int len);
+
+/* audioSim_modifyStream without the normalisation, for callers that normalise several streams together
+ * with audioSim_normalise, like the channels of one file
+ */
+void audioSim_processStream(AudioStream* a, float x, float y, float z, Sample* dst, Sample* src, int len);
+
+/* Normalises n samples by the running peak, which the caller keeps and starts at 1
+ * This is what audioSim_modifyStream does to each stream's output with a peak of its own
+ */
+void audioSim_normalise(Sample* x, int n, double* peak);
+
+/* Number of samples the output still rings for after the input stops, the length of the stream's
+ * impulse response minus one
+ */
+int audioSim_getStreamTailLength(AudioStream* a);
+
+/* Processing times of the stream's blocks, safe to call from any thread
+ */
+void audioSim_getStreamStats(AudioStream* a, AudioSimBlockStats* stats);
+
+/* Mixing every stream of the simulation into one output bus
+ * Set each stream's position and input, then audioSim_render processes all streams for one block
+ * and sums them into dst, normalised by the running peak of the bus rather than of each stream.
+ * Streams at the same position of the same source share one impulse response per block.
+ * A stream used this way shouldn't also be passed to audioSim_modifyStream.
+ * The bus is mono, streams with several channels contribute the average of them.
+ * The work is spread over the threads a stream at a time, a single stream is convolved on one thread
+ * however many there are.
+ */
+void audioSim_setStreamPosition(AudioStream* s, float x, float y, float z);
+
+/* src must hold the len samples of the next render, NULL (the default after each render) plays silence
+ */
+void audioSim_setStreamInput(AudioStream* s, Sample* src);
+void audioSim_render(AudioSim* a, Sample* dst, int len);
+
+/* Real time streaming
+ * audioSim_startEngine starts a thread that convolves each stream's input as it arrives, at most a
+ * partition at a time, with the same processing as audioSim_modifyStream at the stream's last set position.
+ * A producer thread pushes input and the audio callback pulls output, in blocks of any size. Both go
+ * through lock free queues of ringFrames samples per stream, so neither waits on an FFT or allocates.
+ * The engine sleeps while there's nothing queued, and pushing or pulling only wakes it then.
+ * While the engine runs, pushing, pulling and audioSim_setStreamPosition are the only calls allowed on
+ * its streams, apart from creating and destroying them, which can wait for the engine's current pass.
+ */
+void audioSim_startEngine(AudioSim* a, int ringFrames);
+void audioSim_stopEngine(AudioSim* a);
+
+/* Queues up to len input samples and returns how many fit
+ */
+int audioSim_pushInput(AudioStream* s, const Sample* src, int len);
+
+/* Fills dst with len frames, returns how many were processed output, the rest is silence
  */
-void audioSim_modifyStream(AudioStream* a, float x, float y, float z, double* dst, double* src, int len);
+int audioSim_pullOutput(AudioStream* s, Sample* dst, int len);
 
 #endif
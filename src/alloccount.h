@@ -0,0 +1,27 @@
+#ifndef ALLOCCOUNT_H
+#define ALLOCCOUNT_H
+
+/* Debug build option to prove the processing path doesn't allocate
+ * Compiling with -DAUDIOSIM_COUNT_ALLOCS makes every malloc, calloc, realloc and FFTW allocation in the
+ * library count itself, audioSim_allocationCount reads the total. Include this after the system and FFTW headers.
+ */
+#ifdef AUDIOSIM_COUNT_ALLOCS
+
+#include <stdlib.h>
+#include <fftw3.h>
+
+void allocCount_add(void);
+
+#define malloc(n) (allocCount_add(), malloc(n))
+#define calloc(n, size) (allocCount_add(), calloc(n, size))
+#define realloc(p, n) (allocCount_add(), realloc(p, n))
+#define fftw_malloc(n) (allocCount_add(), fftw_malloc(n))
+#define fftw_alloc_real(n) (allocCount_add(), fftw_alloc_real(n))
+#define fftw_alloc_complex(n) (allocCount_add(), fftw_alloc_complex(n))
+#define fftwf_malloc(n) (allocCount_add(), fftwf_malloc(n))
+#define fftwf_alloc_real(n) (allocCount_add(), fftwf_alloc_real(n))
+#define fftwf_alloc_complex(n) (allocCount_add(), fftwf_alloc_complex(n))
+
+#endif
+
+#endif
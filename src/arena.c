@@ -0,0 +1,45 @@
+#include "arena.h"
+#include "alloccount.h"
+
+#include <stdlib.h>
+#include <fftw3.h>
+#include "sample.h"
+
+struct Arena_s {
+  unsigned char* base;
+  size_t size;
+  size_t used;
+};
+
+size_t arena_pieceSize(size_t bytes) {
+  return (bytes + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+Arena* arena_init(size_t size) {
+  Arena* arena = malloc(sizeof(Arena));
+  // FFTW's allocator is aligned on every platform, unlike aligned_alloc
+  arena->base = FFTW(malloc)(size + ARENA_ALIGNMENT);
+  arena->size = size;
+  arena->used = 0;
+  // FFTW only promises SIMD alignment, so line the start up with the piece alignment ourselves
+  size_t misalignment = (size_t)arena->base % ARENA_ALIGNMENT;
+  if (misalignment != 0) {
+    arena->used = ARENA_ALIGNMENT - misalignment;
+  }
+  return arena;
+}
+
+void arena_destroy(Arena* arena) {
+  FFTW(free)(arena->base);
+  free(arena);
+}
+
+void* arena_alloc(Arena* arena, size_t bytes) {
+  size_t piece = arena_pieceSize(bytes);
+  if (arena->used + piece > arena->size + ARENA_ALIGNMENT) {
+    return NULL;
+  }
+  void* p = arena->base + arena->used;
+  arena->used += piece;
+  return p;
+}
@@ -0,0 +1,27 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* One aligned block of memory handed out in pieces and freed all at once
+ * Everything something needs while running is sized up front and carved out of its arena,
+ * so processing never touches the heap.
+ */
+typedef struct Arena_s Arena;
+
+/* Every piece starts at a multiple of this, enough for any SIMD load
+ */
+#define ARENA_ALIGNMENT 64
+
+/* Bytes an arena needs to fit a piece of the given size, sum these to size an arena
+ */
+size_t arena_pieceSize(size_t bytes);
+
+Arena* arena_init(size_t size);
+void arena_destroy(Arena* arena);
+
+/* Returns bytes of uninitialised memory, or NULL if the arena is full
+ */
+void* arena_alloc(Arena* arena, size_t bytes);
+
+#endif
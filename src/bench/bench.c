@@ -0,0 +1,518 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <stdbool.h>
+#include "AudioSim.h"
+#include "irs.h"
+#include "convolve.h"
+#include "fftplan.h"
+#include "irsgen.h"
+#include "kernels.h"
+
+/* Benchmarks of loading, interpolation and convolution on a synthetic (or given) scene
+ * Prints a table and writes one JSON object per line to the results file, so runs can be compared
+ * by scripts. Latencies are per call, or per block of every stream for audioSim_modifyStream.
+ * rtf is processing time over audio time, below 1 is faster than real time.
+ * Allocation counts need a build with AUDIOSIM_COUNT_ALLOCS, they're null otherwise.
+ */
+
+// Rate the streams run at, impulse responses are converted to it at load
+#define OUTPUT_RATE 44100
+
+// dB of energy decay the responses are trimmed at with --trim, 0 to keep them whole
+static float trimThreshold = 0;
+// How the responses are kept in memory, --storage
+static SamplePackFormat storage = SAMPLE_PACK_NONE;
+static const char* storageNames[] = {"float", "half", "int16"};
+
+typedef struct {
+  const char* name;
+  char params[128];
+  int iterations;
+  double seconds;
+  double p50;
+  double p99;
+  // Seconds of audio processed, 0 when it doesn't apply
+  double audioSeconds;
+  long allocations;
+} BenchResult;
+
+double wallTime() {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest rank, the smallest value at least a fraction q of the n values are at or below
+static int percentileIndex(double q, int n) {
+  int i = (int)ceil(q*n) - 1;
+  return i < 0 ? 0 : i;
+}
+
+// Fills in the totals and percentiles of n per call latencies, which get sorted
+static void summarise(BenchResult* r, double* latencies, int n) {
+  r->iterations = n;
+  r->seconds = 0;
+  for (int i = 0; i < n; i++) {
+    r->seconds += latencies[i];
+  }
+  qsort(latencies, n, sizeof(double), compareDoubles);
+  r->p50 = latencies[percentileIndex(0.5, n)];
+  r->p99 = latencies[percentileIndex(0.99, n)];
+}
+
+static void report(FILE* json, BenchResult* r) {
+  double rtf = r->audioSeconds > 0 ? r->seconds/r->audioSeconds : 0;
+  printf("%-14s %-28s %6d calls  p50 %10.1fus  p99 %10.1fus", r->name, r->params, r->iterations, r->p50*1e6, r->p99*1e6);
+  if (r->audioSeconds > 0) {
+    printf("  rtf %.4f", rtf);
+  }
+  if (r->allocations >= 0) {
+    printf("  allocs %ld", r->allocations);
+  }
+  printf("\n");
+
+  if (json == NULL) {
+    return;
+  }
+  fprintf(json, "{\"name\": \"%s\", \"params\": \"%s\", \"iterations\": %d, \"total_s\": %.6f, \"p50_us\": %.3f, \"p99_us\": %.3f",
+      r->name, r->params, r->iterations, r->seconds, r->p50*1e6, r->p99*1e6);
+  if (r->audioSeconds > 0) {
+    fprintf(json, ", \"audio_s\": %.6f, \"rtf\": %.6f", r->audioSeconds, rtf);
+  } else {
+    fprintf(json, ", \"audio_s\": null, \"rtf\": null");
+  }
+  if (r->allocations >= 0) {
+    fprintf(json, ", \"allocations\": %ld}\n", r->allocations);
+  } else {
+    fprintf(json, ", \"allocations\": null}\n");
+  }
+  fflush(json);
+}
+
+// Appends the trimming and storage to a result's params
+static void addLoadParams(BenchResult* r) {
+  size_t len = strlen(r->params);
+  if (trimThreshold > 0) {
+    len += snprintf(r->params + len, sizeof(r->params) - len, " trim=%g", trimThreshold);
+  }
+  if (storage != SAMPLE_PACK_NONE) {
+    snprintf(r->params + len, sizeof(r->params) - len, " storage=%s", storageNames[storage]);
+  }
+}
+
+static void setLoadOptions(IRSLoadOptions* options) {
+  if (trimThreshold > 0) {
+    options->trimMode = IRS_TRIM_ENERGY;
+    options->trimThreshold = trimThreshold;
+  }
+  options->storage = storage;
+}
+
+// Allocations since the given count, or -1 without counting
+static long allocationsSince(long start) {
+  long now = audioSim_allocationCount();
+  return now >= 0 ? now - start : -1;
+}
+
+static void benchLoad(FILE* json, char* irsName, int partitionSize, int runs) {
+  double* latencies = malloc(runs*sizeof(double));
+  FFTPlanCache* plans = fftPlanCache_init(FFTW_ESTIMATE, NULL);
+  BenchResult r = {.name = "load"};
+  snprintf(r.params, sizeof(r.params), "spectra=%d", partitionSize);
+  addLoadParams(&r);
+  IRSStorageStats storageStats;
+  long allocs = audioSim_allocationCount();
+  for (int i = 0; i < runs; i++) {
+    IRSLoadOptions options;
+    getDefaultIRSLoadOptions(&options);
+    options.spectrumPartitionSize = partitionSize;
+    options.plans = plans;
+    options.sampleRate = OUTPUT_RATE;
+    setLoadOptions(&options);
+    double start = wallTime();
+    IRSFile* file = loadIRSFileWithOptions(irsName, &options);
+    latencies[i] = wallTime() - start;
+    getIRSStorageStats(file, &storageStats);
+    freeIRSFile(file);
+  }
+  r.allocations = allocationsSince(allocs);
+  summarise(&r, latencies, runs);
+  report(json, &r);
+  printf("%-14s %.1f MB of responses, %.1f MB as samples", "", storageStats.bytes/1048576.0, storageStats.decodedBytes/1048576.0);
+  if (storageStats.maxError > 0) {
+    printf(", error %.1f dB max, %.1f dB rms", 20*log10(storageStats.maxError), 20*log10(storageStats.rmsError));
+  }
+  printf("\n");
+  fftPlanCache_destroy(plans);
+  free(latencies);
+}
+
+// Random positions within a box of halfSize around the origin
+static void randomPosition(float halfSize, float* x, float* y, float* z) {
+  *x = halfSize*(2*(rand()/(float)RAND_MAX) - 1);
+  *y = halfSize*(2*(rand()/(float)RAND_MAX) - 1);
+  *z = 0;
+}
+
+static void benchInterpolate(FILE* json, char* irsName, float halfSize, int calls) {
+  IRSLoadOptions options;
+  getDefaultIRSLoadOptions(&options);
+  options.sampleRate = OUTPUT_RATE;
+  setLoadOptions(&options);
+  IRSFile* file = loadIRSFileWithOptions(irsName, &options);
+  double* latencies = malloc(calls*sizeof(double));
+  BenchResult r = {.name = "interpolate"};
+  snprintf(r.params, sizeof(r.params), "getInterpolatedData");
+  addLoadParams(&r);
+  // the first call for each listener decodes it, which is what load time precomputation is for
+  long allocs = audioSim_allocationCount();
+  for (int i = 0; i < calls; i++) {
+    float x, y, z;
+    randomPosition(halfSize, &x, &y, &z);
+    IRSSource* source = getClosestSource(file, x, y, z);
+    Sample* data;
+    int dataLen;
+    double start = wallTime();
+    getInterpolatedData(source, x, y, z, &data, &dataLen);
+    latencies[i] = wallTime() - start;
+    free(data);
+  }
+  r.allocations = allocationsSince(allocs);
+  summarise(&r, latencies, calls);
+  report(json, &r);
+  free(latencies);
+  freeIRSFile(file);
+}
+
+static void benchConvolve(FILE* json, int srcLen, int irLen, int calls) {
+  FFTPlanCache* plans = fftPlanCache_init(FFTW_ESTIMATE, NULL);
+  Sample* src = malloc(srcLen*sizeof(Sample));
+  Sample* ir = malloc(irLen*sizeof(Sample));
+  for (int i = 0; i < srcLen; i++) {
+    src[i] = rand()/(Sample)RAND_MAX - 0.5;
+  }
+  for (int i = 0; i < irLen; i++) {
+    ir[i] = (rand()/(Sample)RAND_MAX - 0.5)*exp(-i/(0.1*OUTPUT_RATE));
+  }
+  double* latencies = malloc(calls*sizeof(double));
+  BenchResult r = {.name = "convolve"};
+  snprintf(r.params, sizeof(r.params), "src=%d ir=%d", srcLen, irLen);
+  long allocs = audioSim_allocationCount();
+  for (int i = 0; i < calls; i++) {
+    Sample* dst;
+    int dstLen;
+    double start = wallTime();
+    CONVOLVE(plans, src, srcLen, ir, irLen, &dst, &dstLen);
+    latencies[i] = wallTime() - start;
+    free(dst);
+  }
+  r.allocations = allocationsSince(allocs);
+  r.audioSeconds = (double)calls*srcLen/OUTPUT_RATE;
+  summarise(&r, latencies, calls);
+  report(json, &r);
+  free(latencies);
+  free(src);
+  free(ir);
+  fftPlanCache_destroy(plans);
+}
+
+// Streams drifting slowly through the scene, every block processes all of them
+// With irCacheBytes they share responses through the cache, returns the allocations made while measuring
+static long benchModifyStream(FILE* json, char* irsName, float halfSize, int blockSize, int nStreams, double audioSeconds, size_t irCacheBytes) {
+  AudioSimConfig config;
+  audioSim_defaultConfig(&config);
+  config.useSceneCache = 0;
+  config.irCacheBytes = irCacheBytes;
+  config.sampleRate = OUTPUT_RATE;
+  if (trimThreshold > 0) {
+    config.trimMode = AUDIOSIM_TRIM_ENERGY;
+    config.trimThreshold = trimThreshold;
+  }
+  config.irStorage = (AudioSimStorage)storage;
+  AudioSim* sim = audioSim_initWithConfig(irsName, &config);
+
+  AudioStream** streams = malloc(nStreams*sizeof(AudioStream*));
+  float* positions = malloc(3*nStreams*sizeof(float));
+  for (int i = 0; i < nStreams; i++) {
+    randomPosition(halfSize, &positions[3*i], &positions[3*i + 1], &positions[3*i + 2]);
+    streams[i] = audioSim_initStream(sim, positions[3*i], positions[3*i + 1], positions[3*i + 2]);
+  }
+  Sample* src = malloc(blockSize*sizeof(Sample));
+  Sample* dst = malloc(blockSize*sizeof(Sample));
+  int blocks = (int)(audioSeconds*OUTPUT_RATE/blockSize);
+  if (blocks < 16) {
+    blocks = 16;
+  }
+  // a few blocks first so every stream has reached its steady state
+  int warmup = 8;
+  double* latencies = malloc(blocks*sizeof(double));
+  long allocs = 0;
+
+  for (int b = -warmup; b < blocks; b++) {
+    if (b == 0) {
+      allocs = audioSim_allocationCount();
+    }
+    for (int i = 0; i < blockSize; i++) {
+      src[i] = 0.01*(rand()/(Sample)RAND_MAX - 0.5);
+    }
+    double start = wallTime();
+    for (int i = 0; i < nStreams; i++) {
+      // about 1 m/s
+      float x = positions[3*i] + (float)(b + warmup)*blockSize/OUTPUT_RATE;
+      audioSim_modifyStream(streams[i], x, positions[3*i + 1], positions[3*i + 2], dst, src, blockSize);
+    }
+    if (b >= 0) {
+      latencies[b] = wallTime() - start;
+    }
+  }
+
+  BenchResult r = {.name = "modify_stream"};
+  int len = snprintf(r.params, sizeof(r.params), "block=%d streams=%d", blockSize, nStreams);
+  if (irCacheBytes > 0) {
+    snprintf(r.params + len, sizeof(r.params) - len, " cache=%dMB", (int)(irCacheBytes >> 20));
+  }
+  addLoadParams(&r);
+  r.allocations = allocationsSince(allocs);
+  // every stream is its own audio, so real time means all of them within a block's duration
+  r.audioSeconds = (double)blocks*blockSize/OUTPUT_RATE;
+  summarise(&r, latencies, blocks);
+  report(json, &r);
+
+  for (int i = 0; i < nStreams; i++) {
+    audioSim_destroyStream(streams[i]);
+  }
+  audioSim_destroy(sim);
+  free(latencies);
+  free(streams);
+  free(positions);
+  free(src);
+  free(dst);
+  return r.allocations;
+}
+
+#define KERNEL_CHECK_LEN 4099
+#define KERNEL_CHECK_SOURCES 8
+#define KERNEL_CHECK_KERNELS 9
+
+// Inputs of the kernels that take floats and packed samples, made from the check data
+static float kernelFloats[2][KERNEL_CHECK_LEN];
+static uint16_t kernelHalves[KERNEL_CHECK_LEN + 1];
+static int16_t kernelInt16s[KERNEL_CHECK_LEN];
+static float kernelExpanded[KERNEL_CHECK_LEN];
+
+// Runs each kernel of a level once over the check data, into out, which gets one slot per kernel
+static void runKernels(const Kernels* k, Sample* const* in, const Sample* weights, Sample** out) {
+  int n = KERNEL_CHECK_LEN;
+  k->complexMultiply((ComplexNum*)out[0], (const ComplexNum*)in[0], (const ComplexNum*)in[1], n/2);
+  memcpy(out[1], in[2], n*sizeof(Sample));
+  k->complexMultiplyAccumulate((ComplexNum*)out[1], (const ComplexNum*)in[0], (const ComplexNum*)in[1], n/2);
+  k->weightedSum(out[2], (const Sample* const*)in, weights, KERNEL_CHECK_SOURCES, n);
+  memcpy(out[3], in[0], n*sizeof(Sample));
+  k->scale(out[3], 0.37, n);
+  out[4][0] = k->peak(in[3], n, 0.5);
+  memcpy(out[5], in[2], n*sizeof(Sample));
+  k->accumulate(out[5], kernelFloats[0], NULL, 0.37, n);
+  memcpy(out[6], in[2], n*sizeof(Sample));
+  k->accumulate(out[6], kernelFloats[0], kernelFloats[1], 0.37, n);
+  k->expandHalf(kernelExpanded, kernelHalves, n);
+  for (int j = 0; j < n; j++) {
+    out[7][j] = kernelExpanded[j];
+  }
+  k->expandInt16(kernelExpanded, kernelInt16s, n);
+  for (int j = 0; j < n; j++) {
+    out[8][j] = kernelExpanded[j];
+  }
+}
+
+/* Checks every level the processor supports against the scalar kernels and times them
+ * Differences are relative to the largest value of the scalar result, returns whether all were
+ * within what rounding allows
+ */
+static bool checkKernels(void) {
+  const char* names[] = {"complexMultiply", "complexMultiplyAccumulate", "weightedSum", "scale", "peak",
+    "accumulate", "accumulate with fade", "expandHalf", "expandInt16"};
+  int outLens[] = {KERNEL_CHECK_LEN/2*2, KERNEL_CHECK_LEN/2*2, KERNEL_CHECK_LEN, KERNEL_CHECK_LEN, 1,
+    KERNEL_CHECK_LEN, KERNEL_CHECK_LEN, KERNEL_CHECK_LEN, KERNEL_CHECK_LEN};
+  // the FMA versions round once where the scalar code rounds twice
+  double tolerance = sizeof(Sample) == sizeof(float) ? 1e-5 : 1e-13;
+  Sample* in[KERNEL_CHECK_SOURCES];
+  Sample weights[KERNEL_CHECK_SOURCES];
+  Sample* expected[KERNEL_CHECK_KERNELS];
+  Sample* out[KERNEL_CHECK_KERNELS];
+  for (int i = 0; i < KERNEL_CHECK_SOURCES; i++) {
+    in[i] = malloc(KERNEL_CHECK_LEN*sizeof(Sample));
+    for (int j = 0; j < KERNEL_CHECK_LEN; j++) {
+      in[i][j] = 2.0*rand()/RAND_MAX - 1;
+    }
+    weights[i] = (Sample)rand()/RAND_MAX;
+  }
+  for (int j = 0; j < KERNEL_CHECK_LEN; j++) {
+    kernelFloats[0][j] = (float)in[4][j];
+    kernelFloats[1][j] = (float)fabs(in[5][j]);
+    kernelInt16s[j] = (int16_t)(32767*in[6][j]);
+  }
+  // every few samples tiny, so the subnormal halves are covered too
+  for (int j = 0; j < KERNEL_CHECK_LEN; j += 7) {
+    in[7][j] *= 1e-6;
+  }
+  samplePack_encode(SAMPLE_PACK_HALF, in[7], KERNEL_CHECK_LEN, kernelHalves);
+  for (int i = 0; i < KERNEL_CHECK_KERNELS; i++) {
+    expected[i] = malloc(KERNEL_CHECK_LEN*sizeof(Sample));
+    out[i] = malloc(KERNEL_CHECK_LEN*sizeof(Sample));
+  }
+  runKernels(kernels_getLevel(KERNELS_SCALAR), in, weights, expected);
+
+  printf("Kernels in use: %s\n", kernels_levelName(kernels_level()));
+  bool ok = true;
+  for (int level = KERNELS_SCALAR; level < KERNELS_LEVELS; level++) {
+    const Kernels* k = kernels_getLevel(level);
+    if (k == NULL) {
+      printf("%-8s not supported\n", kernels_levelName(level));
+      continue;
+    }
+    runKernels(k, in, weights, out);
+    int repeats = 2000;
+    double start = wallTime();
+    for (int r = 0; r < repeats; r++) {
+      runKernels(k, in, weights, out);
+    }
+    double ns = (wallTime() - start)*1e9/repeats/KERNEL_CHECK_LEN;
+    printf("%-8s %6.2fns per sample for all of them", kernels_levelName(level), ns);
+    for (int i = 0; i < KERNEL_CHECK_KERNELS; i++) {
+      double scale = 0;
+      double diff = 0;
+      for (int j = 0; j < outLens[i]; j++) {
+        scale = fmax(scale, fabs(expected[i][j]));
+        diff = fmax(diff, fabs(out[i][j] - expected[i][j]));
+      }
+      double relative = scale > 0 ? diff/scale : diff;
+      if (relative > tolerance) {
+        printf("\n  %s differs by %g", names[i], relative);
+        ok = false;
+      }
+    }
+    printf("\n");
+  }
+  for (int i = 0; i < KERNEL_CHECK_SOURCES; i++) {
+    free(in[i]);
+  }
+  for (int i = 0; i < KERNEL_CHECK_KERNELS; i++) {
+    free(expected[i]);
+    free(out[i]);
+  }
+  return ok;
+}
+
+static void usage(char* program) {
+  printf("Usage: %s [--quick] [--irs scene.irs] [--json results.jsonl] [--trim dB] [--storage float|half|int16]\n", program);
+  printf("       %s --generate out.irs [gridX gridY gridZ sources irLen]\n", program);
+  printf("       %s --kernels\n", program);
+  printf("Without --irs a synthetic scene is generated as bench_scene.irs\n");
+  printf("--trim cuts the responses where their remaining energy is dB below the total\n");
+  printf("--kernels checks the vector kernels against the scalar ones, AUDIOSIM_KERNELS picks the ones used\n");
+}
+
+int main(int argc, char** argv) {
+  IRSGenOptions gen;
+  irsGen_defaultOptions(&gen);
+
+  if (argc > 2 && strcmp(argv[1], "--generate") == 0) {
+    int* fields[] = {&gen.gridX, &gen.gridY, &gen.gridZ, &gen.nSources, &gen.irLen};
+    for (int i = 0; i < 5 && 3 + i < argc; i++) {
+      *fields[i] = atoi(argv[3 + i]);
+    }
+    if (!irsGen_write(argv[2], &gen)) {
+      printf("Failed to write %s\n", argv[2]);
+      return -1;
+    }
+    printf("Wrote %s: %dx%dx%d listeners, %d sources, %d samples per response\n", argv[2], gen.gridX, gen.gridY, gen.gridZ, gen.nSources, gen.irLen);
+    return 0;
+  }
+
+  if (argc == 2 && strcmp(argv[1], "--kernels") == 0) {
+    return checkKernels() ? 0 : -1;
+  }
+
+  bool quick = false;
+  char* irsName = NULL;
+  char* jsonName = "bench_results.jsonl";
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0) {
+      quick = true;
+    } else if (strcmp(argv[i], "--irs") == 0 && i + 1 < argc) {
+      irsName = argv[++i];
+    } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      jsonName = argv[++i];
+    } else if (strcmp(argv[i], "--trim") == 0 && i + 1 < argc) {
+      trimThreshold = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc) {
+      i++;
+      int format = 0;
+      while (format < 3 && strcmp(argv[i], storageNames[format]) != 0) {
+        format++;
+      }
+      if (format == 3) {
+        usage(argv[0]);
+        return -1;
+      }
+      storage = (SamplePackFormat)format;
+    } else {
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (irsName == NULL) {
+    irsName = "bench_scene.irs";
+    if (!irsGen_write(irsName, &gen)) {
+      printf("Failed to write %s\n", irsName);
+      return -1;
+    }
+  }
+  // streams stay inside the listener grid of the generated scene
+  float halfSize = 0.5f*(gen.gridX - 1)*gen.spacing/gen.scale;
+
+  FILE* json = fopen(jsonName, "w");
+  if (json == NULL) {
+    printf("Failed to open %s, results only go to the console\n", jsonName);
+  }
+  srand(1);
+  printf("Kernels: %s\n", kernels_levelName(kernels_level()));
+
+  benchLoad(json, irsName, 0, quick ? 2 : 5);
+  benchLoad(json, irsName, AUDIOSIM_DEFAULT_PARTITION_SIZE, quick ? 2 : 5);
+  benchInterpolate(json, irsName, halfSize, quick ? 50 : 500);
+  benchConvolve(json, OUTPUT_RATE, 2*gen.irLen, quick ? 3 : 10);
+
+  int blockSizes[] = {64, 256, 1024, 4096};
+  int streamCounts[] = {1, 8, 32};
+  for (int b = 0; b < 4; b++) {
+    for (int s = 0; s < 3; s++) {
+      if (quick && streamCounts[s] > 8) {
+        continue;
+      }
+      benchModifyStream(json, irsName, halfSize, blockSizes[b], streamCounts[s], quick ? 0.5 : 2.0, 0);
+    }
+  }
+  // misses fill preallocated entries, so processing with the cache must not allocate either
+  long cacheAllocs = benchModifyStream(json, irsName, halfSize, 256, 8, quick ? 0.5 : 2.0, (size_t)64 << 20);
+  bool ok = cacheAllocs <= 0;
+  if (!ok) {
+    printf("modify_stream with the impulse response cache allocated %ld times while running\n", cacheAllocs);
+  }
+
+  if (json != NULL) {
+    fclose(json);
+    printf("Results written to %s\n", jsonName);
+  }
+  return ok ? 0 : -1;
+}
@@ -0,0 +1,126 @@
+#include "irsgen.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "irs_internal.h"
+
+void irsGen_defaultOptions(IRSGenOptions* options) {
+  options->gridX = 8;
+  options->gridY = 8;
+  options->gridZ = 1;
+  options->spacing = 10;
+  options->scale = 10;
+  options->nSources = 2;
+  options->irLen = 22050;
+  options->sampleRate = 22050;
+  options->rt60 = 0.6f;
+  options->seed = 1;
+}
+
+// xorshift, so the same seed gives the same scene everywhere
+static float randomUniform(unsigned* state) {
+  unsigned x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return (float)x/4294967296.0f*2 - 1;
+}
+
+// Voxel coordinate of grid point i of n, centred on 0
+static int gridCoordinate(int i, int n, int spacing) {
+  return (2*i - (n - 1))*spacing/2;
+}
+
+bool irsGen_write(const char* filename, const IRSGenOptions* options) {
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL) {
+    return false;
+  }
+
+  int nListeners = options->gridX*options->gridY*options->gridZ;
+  float speedOfSound = 343.0f*options->scale/options->sampleRate;
+
+  IRSHeader header;
+  memcpy(header.format, "iSim", 4);
+  header.version = 1;
+  header.headerSize = sizeof(IRSHeader);
+  header.sizeX = options->gridX*options->spacing;
+  header.sizeY = options->gridY*options->spacing;
+  header.sizeZ = options->gridZ*options->spacing;
+  header.samplingRate = options->sampleRate;
+  header.speedOfSound = speedOfSound;
+  header.scale = options->scale;
+  header.nSources = options->nSources;
+  header.nListeners = nListeners;
+  fwrite(&header, sizeof(header), 1, f);
+
+  IRSSourceHeaderChunk sourceHeader;
+  sourceHeader.size = sizeof(IRSSourceHeaderChunk) + options->nSources*sizeof(IRSSourceDataChunk);
+  sourceHeader.nEntries = options->nSources;
+  fwrite(&sourceHeader, sizeof(sourceHeader), 1, f);
+  IRSSourceDataChunk* sources = malloc(options->nSources*sizeof(IRSSourceDataChunk));
+  for (int i = 0; i < options->nSources; i++) {
+    sources[i].id = 100 + i;
+    sources[i].xPos = gridCoordinate(i, options->nSources, options->spacing);
+    sources[i].yPos = 0;
+    sources[i].zPos = 0;
+    sources[i].type = 0;
+    sources[i].nSamples = options->irLen;
+  }
+  fwrite(sources, sizeof(IRSSourceDataChunk), options->nSources, f);
+
+  IRSListenerHeaderChunk listenerHeader;
+  listenerHeader.size = sizeof(IRSListenerHeaderChunk) + nListeners*sizeof(IRSListenerDataChunk);
+  listenerHeader.nEntries = nListeners;
+  fwrite(&listenerHeader, sizeof(listenerHeader), 1, f);
+  IRSListenerDataChunk* listeners = malloc(nListeners*sizeof(IRSListenerDataChunk));
+  int n = 0;
+  for (int x = 0; x < options->gridX; x++) {
+    for (int y = 0; y < options->gridY; y++) {
+      for (int z = 0; z < options->gridZ; z++) {
+        listeners[n].id = 1000 + n;
+        listeners[n].xPos = gridCoordinate(x, options->gridX, options->spacing);
+        listeners[n].yPos = gridCoordinate(y, options->gridY, options->spacing);
+        listeners[n].zPos = gridCoordinate(z, options->gridZ, options->spacing);
+        n++;
+      }
+    }
+  }
+  fwrite(listeners, sizeof(IRSListenerDataChunk), nListeners, f);
+
+  // decays by 60 dB (a factor of 1000) over rt60 seconds
+  float decay = logf(1000.0f)/(options->rt60*options->sampleRate);
+  float* ir = malloc(options->irLen*sizeof(float));
+  unsigned state = options->seed != 0 ? options->seed : 1;
+  for (int s = 0; s < options->nSources; s++) {
+    for (int l = 0; l < nListeners; l++) {
+      IRSDataHeaderChunk dataHeader;
+      dataHeader.size = sizeof(IRSDataHeaderChunk) + options->irLen*sizeof(float);
+      dataHeader.sourceId = sources[s].id;
+      dataHeader.listenerId = listeners[l].id;
+      fwrite(&dataHeader, sizeof(dataHeader), 1, f);
+
+      float dx = listeners[l].xPos - sources[s].xPos;
+      float dy = listeners[l].yPos - sources[s].yPos;
+      float dz = listeners[l].zPos - sources[s].zPos;
+      int delay = (int)(sqrtf(dx*dx + dy*dy + dz*dz)/speedOfSound);
+      for (int i = 0; i < options->irLen; i++) {
+        ir[i] = 0;
+        if (i == delay) {
+          ir[i] = 0.5f;
+        } else if (i > delay) {
+          ir[i] = 0.3f*randomUniform(&state)*expf(-(i - delay)*decay);
+        }
+      }
+      fwrite(ir, sizeof(float), options->irLen, f);
+    }
+  }
+
+  free(ir);
+  free(listeners);
+  free(sources);
+  bool ok = !ferror(f);
+  return fclose(f) == 0 && ok;
+}
@@ -0,0 +1,35 @@
+#ifndef IRSGEN_H
+#define IRSGEN_H
+
+#include <stdbool.h>
+
+/* Synthetic .irs scenes, written in the layout loadIRSFile parses, so benchmarks don't need a real scene
+ * Listeners sit on a regular grid centred on the origin and sources on a line along x through it.
+ * Each impulse response is an impulse delayed by the distance from its source, followed by
+ * exponentially decaying noise.
+ */
+typedef struct {
+  // Listeners along each axis
+  int gridX;
+  int gridY;
+  int gridZ;
+  // Voxels between neighbouring listeners
+  int spacing;
+  // Voxels per metre
+  float scale;
+  int nSources;
+  // Samples per impulse response, at sampleRate
+  int irLen;
+  int sampleRate;
+  // Seconds for the noise tail to decay by 60 dB
+  float rt60;
+  unsigned seed;
+} IRSGenOptions;
+
+void irsGen_defaultOptions(IRSGenOptions* options);
+
+/* Returns false if the file couldn't be written
+ */
+bool irsGen_write(const char* filename, const IRSGenOptions* options);
+
+#endif
@@ -5,69 +5,791 @@
 #include "stdbool.h"
 #include "string.h"
 #include <fftw3.h>
+#include "stats.h"
+#include "kernels.h"
+#include "alloccount.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Spectra are stored at a multiple of 4 bins so every one starts SIMD aligned like the first
+static int spectrumStride(int fftLen) {
+  return ((fftLen/2 + 1) + 3) & ~3;
+}
 
 short CONVOLVE(
+    FFTPlanCache* plans,
     // Source
-    ComplexNum *srcSignal,
+    Sample *srcSignal,
     int srcLen,
     // Impulse Response
-    ComplexNum *irSignal,
+    Sample *irSignal,
     int irLen,
     // Destination
-    ComplexNum **dstSignal,
+    Sample **dstSignal,
     int* dstLen) {
   int maxLen = srcLen+irLen-1;
+  // any length >= maxLen gives the same linear convolution, so use one FFTW is fast at
+  int fftLen = fftPlanCache_fastSize(maxLen);
+  int specLen = fftLen/2 + 1;
+
+  //printf("(%d, %d) -> %d\n", srcLen, irLen, fftLen);
+
+  Sample* buf = FFTW(alloc_real)(fftLen);
+  ComplexNum* src = FFTW(malloc)(specLen*sizeof(ComplexNum));
+  ComplexNum* ir = FFTW(malloc)(specLen*sizeof(ComplexNum));
 
-  //printf("(%d, %d) -> %d\n", srcLen, irLen, maxLen);
+  FFTW(plan) forward = fftPlanCache_get(plans, fftLen, FFT_R2C, buf, src);
+  FFTW(plan) backward = fftPlanCache_get(plans, fftLen, FFT_C2R, src, buf);
 
-  ComplexNum* dst = malloc(maxLen*sizeof(ComplexNum));
-  ComplexNum* ir = malloc(maxLen*sizeof(ComplexNum));
+  // transform the src, 0-padded
+  memcpy(buf, srcSignal, srcLen*sizeof(Sample));
+  memset(buf+srcLen, 0, (fftLen-srcLen)*sizeof(Sample));
+  FFTW(execute_dft_r2c)(forward, buf, (FFTW(complex)*)src);
 
-  fftw_plan dstFFT;
-  dstFFT = fftw_plan_dft_1d(maxLen, (double(*)[2])dst, (double(*)[2])dst, FFTW_FORWARD, FFTW_ESTIMATE);
+  // transform the ir signal, 0-padded
+  memcpy(buf, irSignal, irLen*sizeof(Sample));
+  memset(buf+irLen, 0, (fftLen-irLen)*sizeof(Sample));
+  FFTW(execute_dft_r2c)(forward, buf, (FFTW(complex)*)ir);
 
-  fftw_plan irFFT;
-  irFFT = fftw_plan_dft_1d(maxLen, (double(*)[2])ir, (double(*)[2])ir, FFTW_FORWARD, FFTW_ESTIMATE);
+  // pairwise multiply
+  kernels_get()->complexMultiply(src, src, ir, specLen);
 
-  fftw_plan dstIFFT;
-  dstIFFT = fftw_plan_dft_1d(maxLen, (double(*)[2])dst, (double(*)[2])dst, FFTW_BACKWARD, FFTW_ESTIMATE);
+  FFTW(execute_dft_c2r)(backward, (FFTW(complex)*)src, buf);
 
-  // set up the dst array as a copy of the src, 0-padded
-  memcpy(dst, srcSignal, srcLen*sizeof(ComplexNum));
-  memset(dst+srcLen, 0, (maxLen-srcLen)*sizeof(ComplexNum));
+  Sample* dst = malloc(maxLen*sizeof(Sample));
+  kernels_get()->scale(buf, 0.25/fftLen, maxLen);
+  memcpy(dst, buf, maxLen*sizeof(Sample));
 
-  // copy the ir signal
-  memcpy(ir, irSignal, irLen*sizeof(ComplexNum));
+  FFTW(free)(buf);
+  FFTW(free)(src);
+  FFTW(free)(ir);
 
-  // zero pad the ir signal
-  memset(ir+irLen, 0, (maxLen-irLen)*sizeof(ComplexNum));
+  *dstSignal = dst;
+  *dstLen = maxLen;
+  return true;
+}
 
-  {
-    fftw_execute(dstFFT);
-    fftw_execute(irFFT);
+/* Non-uniform partition layout
+ * The head is split into partitions of partitionSize samples and runs without latency. After it come
+ * levels of partitions LEVEL_GROWTH times larger than the previous ones, starting at twice their own size
+ * into the response. A level's block of input is complete one block before its output is needed, so its
+ * transforms and products are spread over the head blocks in between. The first level whose partitions
+ * would exceed MAX_LEVEL_BLOCK (or the head, if that's the first level) covers the rest of the response.
+ * The layout only depends on partitionSize, so a shorter response's spectra are a prefix of a longer one's.
+ */
+#define LEVEL_GROWTH 4
+#define MAX_LEVEL_BLOCK 16384
+#define MAX_LEVELS 8
 
-    // pairwise multiply
-    for (int i = 0; i < maxLen; i++) {
-      double re = dst[i].re * ir[i].re - dst[i].im * ir[i].im;
-      double im = dst[i].im * ir[i].re + dst[i].re * ir[i].im;
-      dst[i].re = re;
-      dst[i].im = im;
+typedef struct {
+  int blockSize;
+  int start;
+  // Past the last level there is no end, it takes every partition left
+  int end;
+  bool last;
+} LevelRange;
+
+static int levelRanges(int partitionSize, LevelRange* ranges) {
+  int n = 0;
+  int blockSize = partitionSize;
+  int start = 0;
+  while (true) {
+    int next = blockSize*LEVEL_GROWTH;
+    ranges[n].blockSize = blockSize;
+    ranges[n].start = start;
+    ranges[n].end = 2*next;
+    ranges[n].last = next > MAX_LEVEL_BLOCK || n + 1 == MAX_LEVELS;
+    if (ranges[n].last) {
+      return n + 1;
     }
+    start = 2*next;
+    blockSize = next;
+    n++;
+  }
+}
 
-    fftw_execute(dstIFFT);
+// Partitions of a level covered by an irLen sample response
+static int levelParts(const LevelRange* range, int irLen) {
+  int end = irLen;
+  if (!range->last && end > range->end) {
+    end = range->end;
+  }
+  if (end <= range->start) {
+    return 0;
+  }
+  return (end - range->start + range->blockSize - 1) / range->blockSize;
+}
 
-    for (int i = 0; i < maxLen; i++) {
-      dst[i].re = 0.25 * dst[i].re / maxLen;
-      dst[i].im = 0.25 * dst[i].im / maxLen;
+int convolver_spectraLength(int partitionSize, int irLen) {
+  LevelRange ranges[MAX_LEVELS];
+  int nRanges = levelRanges(partitionSize, ranges);
+  int len = 0;
+  for (int l = 0; l < nRanges; l++) {
+    len += levelParts(&ranges[l], irLen)*spectrumStride(2*ranges[l].blockSize);
+  }
+  return len;
+}
+
+int convolver_scratchLength(int partitionSize, int irLen) {
+  LevelRange ranges[MAX_LEVELS];
+  int nRanges = levelRanges(partitionSize, ranges);
+  int blockSize = partitionSize;
+  for (int l = 1; l < nRanges; l++) {
+    if (levelParts(&ranges[l], irLen) > 0) {
+      blockSize = ranges[l].blockSize;
     }
   }
+  return 2*blockSize;
+}
 
-  free(ir);
-  fftw_destroy_plan(dstFFT);
-  fftw_destroy_plan(irFFT);
-  fftw_destroy_plan(dstIFFT);
+// What a level keeps for each output
+typedef struct {
+  int activeParts;
+  ComplexNum* accum;
+  // Two blocks of output, the one playing and the one being computed, indexed by time
+  Sample* out;
+  // Set when the next output block fades from the old response, which is kept as its first
+  // partition and the contribution of the input blocks before
+  bool pendingFade;
+  ComplexNum* oldH0;
+  ComplexNum* oldTail;
+} LevelOutput;
 
-  *dstSignal = dst;
-  *dstLen = srcLen + irLen - 1;
-  return true;
+// A level after the head, computed one of its blocks behind
+typedef struct {
+  int blockSize;
+  // Head blocks per block of this level
+  int headBlocks;
+  int start;
+  int specStride;
+  // Where the level's spectra begin in the response's spectra
+  int spectraOffset;
+  int maxParts;
+  // Spectra of the level's most recent input blocks, a ring of maxParts entries shared by all outputs
+  ComplexNum* fdl;
+  int fdlHead;
+  LevelOutput* outputs;
+  // Progress of the block being computed: the input transform (stepOutput -1), then for each output
+  // one product per partition followed by the inverse transform. stepsPerBlock are taken per head block
+  bool busy;
+  int stepOutput;
+  int stepPart;
+  int stepsPerBlock;
+  int outOffset;
+  FFTW(plan) forward;
+  FFTW(plan) backward;
+} TailLevel;
+
+// The impulse response of one output and what's needed to fade away from it
+typedef struct {
+  // Partition spectra of the impulse response in use, head first and then each level
+  // Either one of ownSpectra or spectra shared by the caller. There are two own buffers so the
+  // previous response is still intact while a new one is written and committed
+  const ComplexNum* irSpectra;
+  ComplexNum* ownSpectra[2];
+  int irSpectraLen;
+  // Number of head partitions covered by the response
+  int activeParts;
+  // Sum of the delay line multiplied with partitions 1..activeParts-1
+  ComplexNum* accum;
+
+  bool fading;
+  int fadePos;
+  // The old response's first two partitions, its accumulator for the current block and
+  // its contribution to the next block from blocks that are already complete
+  ComplexNum* oldH0;
+  ComplexNum* oldH1;
+  ComplexNum* oldAccum;
+  ComplexNum* oldTail;
+} ConvolverOutput;
+
+struct Convolver_s {
+  // Samples per partition (and per input block)
+  int partitionSize;
+  // FFT length, twice the partition size
+  int fftLen;
+  // Distance between consecutive spectra, at least fftLen/2+1 bins
+  int specStride;
+  // Number of head partitions allocated
+  int maxParts;
+  // Length of each output's spectra buffers
+  int spectraLen;
+  ConvolverOutput* outputs;
+  int nOutputs;
+  // Spectra of the most recent input blocks, used as a ring of maxParts entries
+  ComplexNum* fdl;
+  int fdlHead;
+  ComplexNum* spectrum;
+  // The previous input block followed by the block currently being filled
+  Sample* window;
+  // Time domain result of the inverse transform
+  Sample* out;
+  int pos;
+  // Owned by the plan cache, window/out -> delay line slot and spectrum -> out
+  FFTW(plan) forward;
+  FFTW(plan) backward;
+
+  // Levels after the head, if the response is long enough to need them
+  FFTPlanCache* plans;
+  TailLevel* levels;
+  int nLevels;
+  // Input blocks completed since the last reset
+  long blocks;
+  // The last historyBlocks input blocks, enough to transform the largest level's input
+  Sample* history;
+  int historyBlocks;
+  // Two scratch buffers of the largest level's FFT length
+  Sample* scratch;
+  Sample* oldScratch;
+
+  // Crossfade from the previous impulse response over partitionSize samples after it changed
+  bool crossfade;
+  // Set once anything was processed since the last reset, before that there's nothing to fade from
+  bool started;
+  // Rising gain of the new response, partitionSize samples
+  Sample* fadeCurve;
+  Sample* oldOut;
+  // Set when the convolver allocated the arena it lives in
+  Arena* ownArena;
+};
+
+size_t convolver_arenaSize(int partitionSize, int maxIrLen, int outputs) {
+  int fftLen = 2*partitionSize;
+  size_t specBytes = spectrumStride(fftLen)*sizeof(ComplexNum);
+  size_t spectraBytes = (size_t)convolver_spectraLength(partitionSize, maxIrLen)*sizeof(ComplexNum);
+  LevelRange ranges[MAX_LEVELS];
+  int nRanges = levelRanges(partitionSize, ranges);
+  int headParts = levelParts(&ranges[0], maxIrLen);
+  size_t size = arena_pieceSize(sizeof(Convolver))
+    + arena_pieceSize(outputs*sizeof(ConvolverOutput))
+    + outputs*(2*arena_pieceSize(spectraBytes) + 5*arena_pieceSize(specBytes))
+    + arena_pieceSize((headParts > 1 ? headParts : 1)*specBytes)
+    + arena_pieceSize(specBytes)
+    + 3*arena_pieceSize(fftLen*sizeof(Sample))
+    + arena_pieceSize(partitionSize*sizeof(Sample));
+
+  int scratchLen = convolver_scratchLength(partitionSize, maxIrLen);
+  size += arena_pieceSize(MAX_LEVELS*sizeof(TailLevel)) + 3*arena_pieceSize(scratchLen*sizeof(Sample));
+  for (int l = 1; l < nRanges; l++) {
+    int parts = levelParts(&ranges[l], maxIrLen);
+    if (parts > 0) {
+      size_t levelSpecBytes = spectrumStride(2*ranges[l].blockSize)*sizeof(ComplexNum);
+      size += arena_pieceSize(parts*levelSpecBytes)
+        + arena_pieceSize(outputs*sizeof(LevelOutput))
+        + outputs*(3*arena_pieceSize(levelSpecBytes) + arena_pieceSize(2*ranges[l].blockSize*sizeof(Sample)));
+    }
+  }
+  return size;
+}
+
+Convolver* convolver_init(FFTPlanCache* plans, int partitionSize, int maxIrLen, int outputs) {
+  Arena* arena = arena_init(convolver_arenaSize(partitionSize, maxIrLen, outputs));
+  Convolver* c = convolver_initInArena(plans, partitionSize, maxIrLen, outputs, arena);
+  c->ownArena = arena;
+  return c;
+}
+
+Convolver* convolver_initInArena(FFTPlanCache* plans, int partitionSize, int maxIrLen, int outputs, Arena* arena) {
+  LevelRange ranges[MAX_LEVELS];
+  int nRanges = levelRanges(partitionSize, ranges);
+
+  Convolver* c = arena_alloc(arena, sizeof(Convolver));
+  c->ownArena = NULL;
+  c->plans = plans;
+  c->partitionSize = partitionSize;
+  c->fftLen = 2*partitionSize;
+  c->specStride = spectrumStride(c->fftLen);
+  c->maxParts = levelParts(&ranges[0], maxIrLen);
+  if (c->maxParts < 1) {
+    c->maxParts = 1;
+  }
+
+  // the arena keeps every buffer SIMD aligned so they all share the same cached plans
+  c->spectraLen = convolver_spectraLength(partitionSize, maxIrLen);
+  c->nOutputs = outputs;
+  c->outputs = arena_alloc(arena, outputs*sizeof(ConvolverOutput));
+  for (int o = 0; o < outputs; o++) {
+    ConvolverOutput* out = &c->outputs[o];
+    for (int i = 0; i < 2; i++) {
+      out->ownSpectra[i] = arena_alloc(arena, c->spectraLen*sizeof(ComplexNum));
+      memset(out->ownSpectra[i], 0, c->spectraLen*sizeof(ComplexNum));
+    }
+    out->irSpectra = out->ownSpectra[0];
+    out->irSpectraLen = 0;
+    out->activeParts = 0;
+    out->accum = arena_alloc(arena, c->specStride*sizeof(ComplexNum));
+    out->oldH0 = arena_alloc(arena, c->specStride*sizeof(ComplexNum));
+    out->oldH1 = arena_alloc(arena, c->specStride*sizeof(ComplexNum));
+    out->oldAccum = arena_alloc(arena, c->specStride*sizeof(ComplexNum));
+    out->oldTail = arena_alloc(arena, c->specStride*sizeof(ComplexNum));
+  }
+  c->fdl = arena_alloc(arena, c->maxParts*c->specStride*sizeof(ComplexNum));
+  c->spectrum = arena_alloc(arena, c->specStride*sizeof(ComplexNum));
+  c->window = arena_alloc(arena, c->fftLen*sizeof(Sample));
+  c->out = arena_alloc(arena, c->fftLen*sizeof(Sample));
+
+  c->crossfade = false;
+  c->fadeCurve = arena_alloc(arena, partitionSize*sizeof(Sample));
+  for (int i = 0; i < partitionSize; i++) {
+    // raised cosine, the old and new gains always sum to 1
+    c->fadeCurve[i] = 0.5 - 0.5*cos(M_PI*(i + 0.5)/partitionSize);
+  }
+  c->oldOut = arena_alloc(arena, c->fftLen*sizeof(Sample));
+
+  c->forward = fftPlanCache_get(plans, c->fftLen, FFT_R2C, c->window, c->fdl);
+  c->backward = fftPlanCache_get(plans, c->fftLen, FFT_C2R, c->spectrum, c->out);
+
+  int scratchLen = convolver_scratchLength(partitionSize, maxIrLen);
+  c->scratch = arena_alloc(arena, scratchLen*sizeof(Sample));
+  c->oldScratch = arena_alloc(arena, scratchLen*sizeof(Sample));
+  c->historyBlocks = scratchLen/partitionSize;
+  c->history = arena_alloc(arena, scratchLen*sizeof(Sample));
+  c->levels = arena_alloc(arena, MAX_LEVELS*sizeof(TailLevel));
+  c->nLevels = 0;
+  int offset = levelParts(&ranges[0], maxIrLen)*c->specStride;
+  for (int l = 1; l < nRanges; l++) {
+    int parts = levelParts(&ranges[l], maxIrLen);
+    if (parts == 0) {
+      break;
+    }
+    TailLevel* level = &c->levels[c->nLevels++];
+    level->blockSize = ranges[l].blockSize;
+    level->headBlocks = level->blockSize/partitionSize;
+    level->start = ranges[l].start;
+    level->specStride = spectrumStride(2*level->blockSize);
+    level->spectraOffset = offset;
+    level->maxParts = parts;
+    level->fdl = arena_alloc(arena, parts*level->specStride*sizeof(ComplexNum));
+    level->outputs = arena_alloc(arena, outputs*sizeof(LevelOutput));
+    for (int o = 0; o < outputs; o++) {
+      LevelOutput* lo = &level->outputs[o];
+      lo->activeParts = 0;
+      lo->accum = arena_alloc(arena, level->specStride*sizeof(ComplexNum));
+      lo->oldH0 = arena_alloc(arena, level->specStride*sizeof(ComplexNum));
+      lo->oldTail = arena_alloc(arena, level->specStride*sizeof(ComplexNum));
+      lo->out = arena_alloc(arena, 2*level->blockSize*sizeof(Sample));
+    }
+    level->forward = fftPlanCache_get(plans, 2*level->blockSize, FFT_R2C, c->scratch, level->fdl);
+    level->backward = fftPlanCache_get(plans, 2*level->blockSize, FFT_C2R, level->outputs[0].accum, c->scratch);
+    offset += parts*level->specStride;
+  }
+
+  convolver_reset(c);
+  return c;
+}
+
+void convolver_destroy(Convolver* c) {
+  // a convolver in someone else's arena goes away with it
+  if (c->ownArena != NULL) {
+    arena_destroy(c->ownArena);
+  }
+}
+
+int convolver_outputCount(Convolver* c) {
+  return c->nOutputs;
+}
+
+void convolver_reset(Convolver* c) {
+  memset(c->fdl, 0, c->maxParts*c->specStride*sizeof(ComplexNum));
+  memset(c->window, 0, c->fftLen*sizeof(Sample));
+  for (int o = 0; o < c->nOutputs; o++) {
+    memset(c->outputs[o].accum, 0, c->specStride*sizeof(ComplexNum));
+    c->outputs[o].fading = false;
+  }
+  c->fdlHead = 0;
+  c->pos = 0;
+  c->started = false;
+
+  c->blocks = 0;
+  memset(c->history, 0, c->historyBlocks*c->partitionSize*sizeof(Sample));
+  for (int l = 0; l < c->nLevels; l++) {
+    TailLevel* level = &c->levels[l];
+    memset(level->fdl, 0, level->maxParts*level->specStride*sizeof(ComplexNum));
+    for (int o = 0; o < c->nOutputs; o++) {
+      memset(level->outputs[o].out, 0, 2*level->blockSize*sizeof(Sample));
+      level->outputs[o].pendingFade = false;
+    }
+    level->fdlHead = 0;
+    level->busy = false;
+  }
+}
+
+// dst += x*h over the first bins bins
+static void multiplyAccumulate(ComplexNum* dst, const ComplexNum* x, const ComplexNum* h, int bins) {
+  kernels_get()->complexMultiplyAccumulate(dst, x, h, bins);
+}
+
+// Spectrum of the delay line slot blocksAgo blocks before the current one
+static ComplexNum* fdlSlot(Convolver* c, int blocksAgo) {
+  return c->fdl + ((c->fdlHead - blocksAgo + c->maxParts) % c->maxParts)*c->specStride;
+}
+
+static ComplexNum* levelSlot(TailLevel* level, int blocksAgo) {
+  return level->fdl + ((level->fdlHead - blocksAgo + level->maxParts) % level->maxParts)*level->specStride;
+}
+
+// Recomputes the contribution of all completed input blocks to the current block
+static void updateAccum(Convolver* c, ConvolverOutput* out) {
+  int bins = c->fftLen/2 + 1;
+  memset(out->accum, 0, c->specStride*sizeof(ComplexNum));
+  for (int k = 1; k < out->activeParts; k++) {
+    multiplyAccumulate(out->accum, fdlSlot(c, k), out->irSpectra + k*c->specStride, bins);
+  }
+}
+
+// Keeps what the response in use needs to go on producing output for one more partition
+static void startCrossfade(Convolver* c, ConvolverOutput* out) {
+  int bins = c->fftLen/2 + 1;
+  const ComplexNum* h = out->irSpectra;
+  memcpy(out->oldH0, h, c->specStride*sizeof(ComplexNum));
+  if (out->activeParts > 1) {
+    memcpy(out->oldH1, h + c->specStride, c->specStride*sizeof(ComplexNum));
+  } else {
+    memset(out->oldH1, 0, c->specStride*sizeof(ComplexNum));
+  }
+  memcpy(out->oldAccum, out->accum, c->specStride*sizeof(ComplexNum));
+
+  // the next block's accumulator minus the block being filled, which oldH1 adds once it's complete
+  memset(out->oldTail, 0, c->specStride*sizeof(ComplexNum));
+  for (int k = 2; k < out->activeParts; k++) {
+    multiplyAccumulate(out->oldTail, fdlSlot(c, k - 1), h + k*c->specStride, bins);
+  }
+
+  out->fading = true;
+  out->fadePos = 0;
+}
+
+// Takes one step of the level block being computed
+static void levelStep(Convolver* c, TailLevel* level) {
+  int b = level->blockSize;
+  int bins = b + 1;
+  long long t = stats_begin();
+  if (level->stepOutput < 0) {
+    // the last two level blocks of input, which may wrap around the history
+    int p = c->partitionSize;
+    int first = (int)((c->blocks - 2*level->headBlocks + c->historyBlocks) % c->historyBlocks);
+    for (int i = 0; i < 2*level->headBlocks; i++) {
+      memcpy(c->scratch + i*p, c->history + ((first + i) % c->historyBlocks)*p, p*sizeof(Sample));
+    }
+    level->fdlHead = (level->fdlHead + 1) % level->maxParts;
+    FFTW(execute_dft_r2c)(level->forward, c->scratch, (FFTW(complex)*)levelSlot(level, 0));
+    for (int o = 0; o < c->nOutputs; o++) {
+      memset(level->outputs[o].accum, 0, level->specStride*sizeof(ComplexNum));
+    }
+    level->stepOutput = 0;
+    level->stepPart = 0;
+    stats_lap(STATS_FORWARD_FFT, t);
+    return;
+  }
+
+  LevelOutput* lo = &level->outputs[level->stepOutput];
+  const ComplexNum* h = c->outputs[level->stepOutput].irSpectra + level->spectraOffset;
+  if (level->stepPart < lo->activeParts) {
+    int k = level->stepPart++;
+    multiplyAccumulate(lo->accum, levelSlot(level, k), h + k*level->specStride, bins);
+    stats_lap(STATS_MULTIPLY, t);
+    return;
+  }
+
+  FFTW(execute_dft_c2r)(level->backward, (FFTW(complex)*)lo->accum, c->scratch);
+  t = stats_lap(STATS_INVERSE_FFT, t);
+  Sample* dst = lo->out + level->outOffset;
+  Sample scale = 1.0/(2*b);
+  if (lo->pendingFade) {
+    multiplyAccumulate(lo->oldTail, levelSlot(level, 0), lo->oldH0, bins);
+    t = stats_lap(STATS_MULTIPLY, t);
+    FFTW(execute_dft_c2r)(level->backward, (FFTW(complex)*)lo->oldTail, c->oldScratch);
+    t = stats_lap(STATS_INVERSE_FFT, t);
+    for (int i = 0; i < b; i++) {
+      Sample g = 0.5 - 0.5*cos(M_PI*(i + 0.5)/b);
+      dst[i] = (g*c->scratch[b + i] + (1 - g)*c->oldScratch[b + i])*scale;
+    }
+    lo->pendingFade = false;
+  } else {
+    for (int i = 0; i < b; i++) {
+      dst[i] = c->scratch[b + i]*scale;
+    }
+  }
+  stats_lap(STATS_OVERLAP_ADD, t);
+  level->stepPart = 0;
+  level->stepOutput++;
+  level->busy = level->stepOutput < c->nOutputs;
+}
+
+static void finishLevel(Convolver* c, TailLevel* level) {
+  while (level->busy) {
+    levelStep(c, level);
+  }
+}
+
+// Called after every complete head block, starts a level block when its input is complete and
+// spreads the work so it's done by the time the output is needed a level block later
+static void scheduleLevels(Convolver* c) {
+  for (int l = 0; l < c->nLevels; l++) {
+    TailLevel* level = &c->levels[l];
+    if (c->blocks % level->headBlocks == 0) {
+      finishLevel(c, level);
+      level->busy = true;
+      level->stepOutput = -1;
+      // the output of input block j plays during block j+2, which is the slot after the one playing now
+      level->outOffset = (int)((c->blocks/level->headBlocks + 1) % 2)*level->blockSize;
+      int steps = 1;
+      for (int o = 0; o < c->nOutputs; o++) {
+        steps += level->outputs[o].activeParts + 1;
+      }
+      level->stepsPerBlock = (steps + level->headBlocks - 1) / level->headBlocks;
+    }
+    for (int i = 0; i < level->stepsPerBlock && level->busy; i++) {
+      levelStep(c, level);
+    }
+  }
+}
+
+// Keeps the old response's contribution to the next level block so it can be faded out
+static void startLevelCrossfade(Convolver* c, TailLevel* level, int output) {
+  int bins = level->blockSize + 1;
+  LevelOutput* lo = &level->outputs[output];
+  const ComplexNum* h = c->outputs[output].irSpectra + level->spectraOffset;
+  memcpy(lo->oldH0, h, level->specStride*sizeof(ComplexNum));
+  // the next input block goes to the slot after the head, so the head is 1 block ago by then
+  memset(lo->oldTail, 0, level->specStride*sizeof(ComplexNum));
+  for (int k = 1; k < lo->activeParts; k++) {
+    multiplyAccumulate(lo->oldTail, levelSlot(level, k - 1), h + k*level->specStride, bins);
+  }
+  lo->pendingFade = true;
+}
+
+// Transforms each zero padded partition of ir into consecutive spectra of dst, in the layout above
+static void partitionSpectra(FFTPlanCache* plans, Sample* scratch, int partitionSize, Sample* ir, int irLen, ComplexNum* dst) {
+  LevelRange ranges[MAX_LEVELS];
+  int nRanges = levelRanges(partitionSize, ranges);
+  for (int l = 0; l < nRanges; l++) {
+    int nParts = levelParts(&ranges[l], irLen);
+    if (nParts == 0) {
+      break;
+    }
+    int blockSize = ranges[l].blockSize;
+    int fftLen = 2*blockSize;
+    int stride = spectrumStride(fftLen);
+    FFTW(plan) forward = fftPlanCache_get(plans, fftLen, FFT_R2C, scratch, dst);
+    for (int k = 0; k < nParts; k++) {
+      int offset = ranges[l].start + k*blockSize;
+      int n = blockSize;
+      if (offset + n > irLen) {
+        n = irLen - offset;
+      }
+      // zero padded to the FFT length so the circular convolution doesn't wrap
+      memcpy(scratch, ir + offset, n*sizeof(Sample));
+      memset(scratch + n, 0, (fftLen - n)*sizeof(Sample));
+      FFTW(execute_dft_r2c)(forward, scratch, (FFTW(complex)*)(dst + k*stride));
+      // the padding bins too, so the same response always gives the same bytes
+      memset(dst + k*stride + blockSize + 1, 0, (stride - blockSize - 1)*sizeof(ComplexNum));
+    }
+    dst += nParts*stride;
+  }
+}
+
+void convolver_computeSpectra(FFTPlanCache* plans, int partitionSize, Sample* ir, int irLen, ComplexNum* dst, Sample* scratch) {
+  partitionSpectra(plans, scratch, partitionSize, ir, irLen, dst);
+}
+
+void convolver_setIR(Convolver* c, int output, Sample* ir, int irLen) {
+  int maxIrLen = c->maxParts*c->partitionSize;
+  if (c->nLevels > 0) {
+    TailLevel* last = &c->levels[c->nLevels - 1];
+    maxIrLen = last->start + last->maxParts*last->blockSize;
+  }
+  if (irLen > maxIrLen) {
+    irLen = maxIrLen;
+  }
+  partitionSpectra(c->plans, c->scratch, c->partitionSize, ir, irLen, convolver_irSpectraBuffer(c, output));
+  convolver_commitIRSpectra(c, output, irLen);
+}
+
+ComplexNum* convolver_irSpectraBuffer(Convolver* c, int output) {
+  ConvolverOutput* out = &c->outputs[output];
+  return out->irSpectra == out->ownSpectra[0] ? out->ownSpectra[1] : out->ownSpectra[0];
+}
+
+void convolver_commitIRSpectra(Convolver* c, int output, int irLen) {
+  convolver_useIRSpectra(c, output, convolver_irSpectraBuffer(c, output), irLen);
+}
+
+void convolver_useIRSpectra(Convolver* c, int output, const ComplexNum* spectra, int irLen) {
+  LevelRange ranges[MAX_LEVELS];
+  levelRanges(c->partitionSize, ranges);
+  ConvolverOutput* out = &c->outputs[output];
+
+  // level blocks in progress finish with the old response, which is still intact
+  for (int l = 0; l < c->nLevels; l++) {
+    TailLevel* level = &c->levels[l];
+    LevelOutput* lo = &level->outputs[output];
+    finishLevel(c, level);
+    if (c->crossfade && c->started && lo->activeParts > 0 && !lo->pendingFade) {
+      startLevelCrossfade(c, level, output);
+    }
+  }
+  if (c->crossfade && c->started && out->activeParts > 0) {
+    startCrossfade(c, out);
+  }
+  out->irSpectra = spectra;
+  out->irSpectraLen = convolver_spectraLength(c->partitionSize, irLen);
+  if (out->irSpectraLen > c->spectraLen) {
+    out->irSpectraLen = c->spectraLen;
+  }
+  out->activeParts = levelParts(&ranges[0], irLen);
+  if (out->activeParts > c->maxParts) {
+    out->activeParts = c->maxParts;
+  }
+  for (int l = 0; l < c->nLevels; l++) {
+    TailLevel* level = &c->levels[l];
+    LevelOutput* lo = &level->outputs[output];
+    lo->activeParts = levelParts(&ranges[l + 1], irLen);
+    if (lo->activeParts > level->maxParts) {
+      lo->activeParts = level->maxParts;
+    }
+  }
+  updateAccum(c, out);
+}
+
+void convolver_moveIRSpectra(Convolver* c, int output, const ComplexNum* spectra) {
+  c->outputs[output].irSpectra = spectra;
+}
+
+void convolver_keepIRSpectra(Convolver* c) {
+  for (int o = 0; o < c->nOutputs; o++) {
+    ConvolverOutput* out = &c->outputs[o];
+    if (out->irSpectra != out->ownSpectra[0] && out->irSpectra != out->ownSpectra[1]) {
+      ComplexNum* copy = convolver_irSpectraBuffer(c, o);
+      memcpy(copy, out->irSpectra, out->irSpectraLen*sizeof(ComplexNum));
+      out->irSpectra = copy;
+    }
+  }
+}
+
+void convolver_setCrossfade(Convolver* c, bool enabled) {
+  c->crossfade = enabled;
+  for (int o = 0; o < c->nOutputs; o++) {
+    c->outputs[o].fading = c->outputs[o].fading && enabled;
+  }
+  for (int l = 0; l < c->nLevels; l++) {
+    for (int o = 0; o < c->nOutputs; o++) {
+      LevelOutput* lo = &c->levels[l].outputs[o];
+      lo->pendingFade = lo->pendingFade && enabled;
+    }
+  }
+}
+
+bool convolver_isCrossfading(Convolver* c) {
+  for (int o = 0; o < c->nOutputs; o++) {
+    if (c->outputs[o].fading) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// spectrum = accum + x*h0, or silence without a response
+static void blockSpectrum(Convolver* c, ConvolverOutput* out, const ComplexNum* accum, const ComplexNum* x, const ComplexNum* h) {
+  int bins = c->fftLen/2 + 1;
+  if (out->activeParts > 0) {
+    memcpy(c->spectrum, accum, bins*sizeof(ComplexNum));
+    multiplyAccumulate(c->spectrum, x, h, bins);
+  } else {
+    memset(c->spectrum, 0, bins*sizeof(ComplexNum));
+  }
+}
+
+void convolver_process(Convolver* c, Sample* dst, Sample* src, int len) {
+  int p = c->partitionSize;
+  int bins = c->fftLen/2 + 1;
+  int nOutputs = c->nOutputs;
+  if (len > 0) {
+    c->started = true;
+  }
+  while (len > 0) {
+    int n = p - c->pos;
+    if (n > len) {
+      n = len;
+    }
+    for (int o = 0; o < nOutputs; o++) {
+      if (c->outputs[o].fading && n > p - c->outputs[o].fadePos) {
+        n = p - c->outputs[o].fadePos;
+      }
+    }
+    long long t = stats_begin();
+    memcpy(c->window + p + c->pos, src, n*sizeof(Sample));
+
+    // the spectrum of the (partial) current block always lives at the head of the delay line,
+    // and every output multiplies the same one
+    ComplexNum* x = c->fdl + c->fdlHead*c->specStride;
+    FFTW(execute_dft_r2c)(c->forward, c->window, (FFTW(complex)*)x);
+    t = stats_lap(STATS_FORWARD_FFT, t);
+
+    for (int o = 0; o < nOutputs; o++) {
+      ConvolverOutput* out = &c->outputs[o];
+      blockSpectrum(c, out, out->accum, x, out->irSpectra);
+      t = stats_lap(STATS_MULTIPLY, t);
+      FFTW(execute_dft_c2r)(c->backward, (FFTW(complex)*)c->spectrum, c->out);
+      t = stats_lap(STATS_INVERSE_FFT, t);
+
+      // overlap-save: only the second half of the result is free of wrap-around
+      if (out->fading) {
+        blockSpectrum(c, out, out->oldAccum, x, out->oldH0);
+        t = stats_lap(STATS_MULTIPLY, t);
+        FFTW(execute_dft_c2r)(c->backward, (FFTW(complex)*)c->spectrum, c->oldOut);
+        t = stats_lap(STATS_INVERSE_FFT, t);
+        for (int i = 0; i < n; i++) {
+          Sample g = c->fadeCurve[out->fadePos + i];
+          dst[i*nOutputs + o] = (g*c->out[p + c->pos + i] + (1 - g)*c->oldOut[p + c->pos + i]) / c->fftLen;
+        }
+        out->fadePos += n;
+        out->fading = out->fadePos < p;
+      } else {
+        for (int i = 0; i < n; i++) {
+          dst[i*nOutputs + o] = c->out[p + c->pos + i] / c->fftLen;
+        }
+      }
+
+      // the levels' output was computed ahead of time
+      for (int l = 0; l < c->nLevels; l++) {
+        TailLevel* level = &c->levels[l];
+        const Sample* levelOut = level->outputs[o].out + (int)(c->blocks % (2*level->headBlocks))*p + c->pos;
+        for (int i = 0; i < n; i++) {
+          dst[i*nOutputs + o] += levelOut[i];
+        }
+      }
+      t = stats_lap(STATS_OVERLAP_ADD, t);
+    }
+
+    c->pos += n;
+    src += n;
+    dst += n*nOutputs;
+    len -= n;
+
+    if (c->pos == p) {
+      if (c->nLevels > 0) {
+        memcpy(c->history + (c->blocks % c->historyBlocks)*p, c->window + p, p*sizeof(Sample));
+      }
+      memcpy(c->window, c->window + p, p*sizeof(Sample));
+      memset(c->window + p, 0, p*sizeof(Sample));
+      c->fdlHead = (c->fdlHead + 1) % c->maxParts;
+      c->pos = 0;
+      c->blocks++;
+      t = stats_lap(STATS_OVERLAP_ADD, t);
+      for (int o = 0; o < nOutputs; o++) {
+        ConvolverOutput* out = &c->outputs[o];
+        updateAccum(c, out);
+        if (out->fading) {
+          memcpy(out->oldAccum, out->oldTail, c->specStride*sizeof(ComplexNum));
+          multiplyAccumulate(out->oldAccum, fdlSlot(c, 1), out->oldH1, bins);
+        }
+      }
+      stats_lap(STATS_MULTIPLY, t);
+      // the level steps time themselves
+      scheduleLevels(c);
+    }
+  }
 }
@@ -1,25 +1,117 @@
 #ifndef CONVOLVE_H
 #define CONVOLVE_H
 
+#include "sample.h"
+#include "fftplan.h"
+#include "arena.h"
+#include <stdbool.h>
+
+/* Layout compatible with fftw_complex (or fftwf_complex), used for spectra
+ * Real transforms only store the first n/2+1 bins since the rest are conjugates
+ */
 typedef struct {
-  double re;
-  double im;
+  Sample re;
+  Sample im;
 } ComplexNum;
-//#include "fft.h"
 
-/* Convolves a signal in-place with a given impulse response
- * If there's not enough room, allocates a new float array. It's the caller's responsibility to free this array
- * If there was enough space, srcSignalL == dstSignalL and srcSignalR == dstSignalR
+/* Convolves a real signal with a real impulse response
+ * Allocates a new array of srcLen+irLen-1 samples for the result, it's the caller's responsibility to free it
  */
 short CONVOLVE(
+    FFTPlanCache* plans,
     // Source
-    ComplexNum *srcSignal,
+    Sample *srcSignal,
     int srcLen,
     // Impulse Response
-    ComplexNum *irSignal,
+    Sample *irSignal,
     int irLen,
     // Destination
-    ComplexNum **dstSignal,
+    Sample **dstSignal,
     int* dstLen);
 
+/* Partitioned overlap-save convolution engine
+ * The start of the impulse response is split into partitions of partitionSize samples. Their spectra
+ * are multiplied against a frequency-domain delay line of past input blocks, so every call costs
+ * FFTs of 2*partitionSize points. Long responses continue in progressively larger partitions, whose
+ * work is spread over the input blocks it has time for, so the cost per block grows slowly with length.
+ * The layout is chosen from partitionSize and the response length.
+ * Any number of samples can be processed per call and no latency is added.
+ *
+ * A convolver can have several outputs, each with its own impulse response, eg. one per ear. The input is
+ * transformed once and multiplied against every output's spectra, and the outputs are interleaved in dst.
+ */
+typedef struct Convolver_s Convolver;
+
+/* Plans are taken from the given cache, which has to outlive the convolver
+ */
+Convolver* convolver_init(FFTPlanCache* plans, int partitionSize, int maxIrLen, int outputs);
+void convolver_destroy(Convolver* c);
+
+/* Places the convolver and all its buffers in an arena with at least convolver_arenaSize bytes free
+ * Destroying it is optional then, the memory is released with the arena
+ */
+size_t convolver_arenaSize(int partitionSize, int maxIrLen, int outputs);
+Convolver* convolver_initInArena(FFTPlanCache* plans, int partitionSize, int maxIrLen, int outputs, Arena* arena);
+
+int convolver_outputCount(Convolver* c);
+
+/* Clears the input history (the impulse response is kept)
+ */
+void convolver_reset(Convolver* c);
+
+/* Replaces the impulse response of an output, irLen must not exceed the maxIrLen given at init
+ * Input history is kept, so the new response applies to already processed samples too
+ */
+void convolver_setIR(Convolver* c, int output, Sample* ir, int irLen);
+
+/* Updating the impulse response from precomputed spectra (see convolver_computeSpectra)
+ * Write convolver_spectraLength(partitionSize, irLen) bins to the returned buffer, then commit
+ * them with the length of the impulse response they were computed from
+ * The buffer is never the one in use, so the response can be updated while it's being crossfaded
+ */
+ComplexNum* convolver_irSpectraBuffer(Convolver* c, int output);
+void convolver_commitIRSpectra(Convolver* c, int output, int irLen);
+
+/* Like convolver_commitIRSpectra, but uses spectra owned by the caller, which can share them between convolvers
+ * They have to stay unchanged until the next impulse response update, and the previous ones have to be
+ * intact during it
+ */
+void convolver_useIRSpectra(Convolver* c, int output, const ComplexNum* spectra, int irLen);
+
+/* Points the convolver to a copy of the spectra in use at a new address, the response doesn't change
+ */
+void convolver_moveIRSpectra(Convolver* c, int output, const ComplexNum* spectra);
+
+/* Copies spectra shared by the caller into the convolver for every output, after which the caller may free them
+ */
+void convolver_keepIRSpectra(Convolver* c);
+
+/* With crossfading on, every impulse response update fades from the old response's output to
+ * the new one's over partitionSize samples instead of switching at once. Until the fade is done
+ * the convolver does two inverse transforms per call, and another update cuts it short.
+ * Larger partitions switch at the start of their next block and fade over its length, an update
+ * before then fades them from the response they started with.
+ * convolver_isCrossfading is true while any output is fading.
+ */
+void convolver_setCrossfade(Convolver* c, bool enabled);
+bool convolver_isCrossfading(Convolver* c);
+
+/* Number of ComplexNum needed to hold the partition spectra of an irLen sample impulse response
+ */
+int convolver_spectraLength(int partitionSize, int irLen);
+
+/* Number of samples of scratch convolver_computeSpectra needs for an irLen sample impulse response
+ */
+int convolver_scratchLength(int partitionSize, int irLen);
+
+/* Computes the partition spectra of an impulse response in the layout the convolver uses
+ * Because the transform is linear, weighted sums of these give the spectra of weighted sums of the
+ * impulse responses. dst must come from FFTW(malloc) or an arena, scratch holds convolver_scratchLength samples
+ */
+void convolver_computeSpectra(FFTPlanCache* plans, int partitionSize, Sample* ir, int irLen, ComplexNum* dst, Sample* scratch);
+
+/* Convolves len samples of src with the impulse responses and writes len frames of one sample per output to dst
+ */
+void convolver_process(Convolver* c, Sample* dst, Sample* src, int len);
+
 #endif
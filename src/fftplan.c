@@ -0,0 +1,133 @@
+#include "fftplan.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "alloccount.h"
+
+typedef struct {
+  int n;
+  FFTKind kind;
+  bool inPlace;
+  bool aligned;
+  FFTW(plan) plan;
+} FFTPlanEntry;
+
+struct FFTPlanCache_s {
+  // the FFTW planner isn't thread safe, so lookups and planning happen under this lock
+  pthread_mutex_t lock;
+  unsigned plannerFlags;
+  char* wisdomFile;
+  // set once a plan was created that might have produced new wisdom
+  bool wisdomChanged;
+  int nEntries;
+  int capacity;
+  FFTPlanEntry* entries;
+};
+
+FFTPlanCache* fftPlanCache_init(unsigned plannerFlags, const char* wisdomFile) {
+  FFTPlanCache* cache = malloc(sizeof(FFTPlanCache));
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->plannerFlags = plannerFlags;
+  cache->wisdomFile = NULL;
+  cache->wisdomChanged = false;
+  cache->nEntries = 0;
+  cache->capacity = 8;
+  cache->entries = malloc(cache->capacity*sizeof(FFTPlanEntry));
+
+  if (wisdomFile != NULL) {
+    cache->wisdomFile = malloc(strlen(wisdomFile) + 1);
+    strcpy(cache->wisdomFile, wisdomFile);
+    // a missing file just means we start without wisdom
+    FFTW(import_wisdom_from_filename)(wisdomFile);
+  }
+
+  return cache;
+}
+
+void fftPlanCache_destroy(FFTPlanCache* cache) {
+  if (cache->wisdomFile != NULL) {
+    if (cache->wisdomChanged && !FFTW(export_wisdom_to_filename)(cache->wisdomFile)) {
+      printf("Failed to save FFTW wisdom to %s\n", cache->wisdomFile);
+    }
+    free(cache->wisdomFile);
+  }
+
+  for (int i = 0; i < cache->nEntries; i++) {
+    FFTW(destroy_plan)(cache->entries[i].plan);
+  }
+  free(cache->entries);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+FFTW(plan) fftPlanCache_get(FFTPlanCache* cache, int n, FFTKind kind, void* in, void* out) {
+  bool inPlace = in == out;
+  bool aligned = FFTW(alignment_of)(in) == 0 && FFTW(alignment_of)(out) == 0;
+
+  pthread_mutex_lock(&cache->lock);
+  for (int i = 0; i < cache->nEntries; i++) {
+    FFTPlanEntry* e = &cache->entries[i];
+    if (e->n == n && e->kind == kind && e->inPlace == inPlace && e->aligned == aligned) {
+      pthread_mutex_unlock(&cache->lock);
+      return e->plan;
+    }
+  }
+
+  // measuring planners overwrite their arrays, so plan on scratch buffers instead of the caller's
+  unsigned flags = cache->plannerFlags;
+  if (!aligned) {
+    flags |= FFTW_UNALIGNED;
+  }
+  // n complex is always enough room for either side of a real transform, including in-place ones
+  FFTW(complex)* scratchIn = FFTW(alloc_complex)(n);
+  FFTW(complex)* scratchOut = inPlace ? scratchIn : FFTW(alloc_complex)(n);
+  FFTW(plan) plan;
+  if (kind == FFT_R2C) {
+    plan = FFTW(plan_dft_r2c_1d)(n, (Sample*)scratchIn, scratchOut, flags);
+  } else if (kind == FFT_C2R) {
+    plan = FFTW(plan_dft_c2r_1d)(n, scratchIn, (Sample*)scratchOut, flags);
+  } else {
+    int sign = kind == FFT_FORWARD ? FFTW_FORWARD : FFTW_BACKWARD;
+    plan = FFTW(plan_dft_1d)(n, scratchIn, scratchOut, sign, flags);
+  }
+  if (!inPlace) {
+    FFTW(free)(scratchOut);
+  }
+  FFTW(free)(scratchIn);
+
+  if (cache->nEntries == cache->capacity) {
+    cache->capacity *= 2;
+    cache->entries = realloc(cache->entries, cache->capacity*sizeof(FFTPlanEntry));
+  }
+  FFTPlanEntry* e = &cache->entries[cache->nEntries++];
+  e->n = n;
+  e->kind = kind;
+  e->inPlace = inPlace;
+  e->aligned = aligned;
+  e->plan = plan;
+
+  if (!(cache->plannerFlags & FFTW_ESTIMATE)) {
+    cache->wisdomChanged = true;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return plan;
+}
+
+int fftPlanCache_fastSize(int n) {
+  if (n <= 1) {
+    return 1;
+  }
+  for (;; n++) {
+    int m = n;
+    while (m % 2 == 0) m /= 2;
+    while (m % 3 == 0) m /= 3;
+    while (m % 5 == 0) m /= 5;
+    if (m == 1) {
+      return n;
+    }
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef FFTPLAN_H
+#define FFTPLAN_H
+
+#include <fftw3.h>
+#include "sample.h"
+
+typedef enum {
+  // complex to complex
+  FFT_FORWARD,
+  FFT_BACKWARD,
+  // n reals to n/2+1 complex bins and back
+  FFT_R2C,
+  FFT_C2R
+} FFTKind;
+
+/* Registry of FFTW plans shared by everything in an AudioSim
+ * Plans are keyed by size, direction and the in-place/alignment properties of the buffers,
+ * and are executed with the new-array interface (fftw_execute_dft and friends) on any matching buffers.
+ */
+typedef struct FFTPlanCache_s FFTPlanCache;
+
+/* plannerFlags are the FFTW rigor flags (FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT)
+ * If wisdomFile is not NULL, wisdom is imported from it now and exported to it on destroy
+ */
+FFTPlanCache* fftPlanCache_init(unsigned plannerFlags, const char* wisdomFile);
+void fftPlanCache_destroy(FFTPlanCache* cache);
+
+/* Returns a plan for an n point transform usable with these buffers, creating it if needed
+ * Planning never touches in/out, they're only used to determine the key
+ * The plan is owned by the cache. Safe to call from several threads, and executing the returned plan
+ * on different buffers concurrently is too
+ */
+FFTW(plan) fftPlanCache_get(FFTPlanCache* cache, int n, FFTKind kind, void* in, void* out);
+
+/* Rounds n up to the next size of the form 2^a*3^b*5^c, which FFTW handles fastest
+ */
+int fftPlanCache_fastSize(int n);
+
+#endif
@@ -0,0 +1,250 @@
+#include "ircache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <fftw3.h>
+#include "alloccount.h"
+
+struct IRCacheEntry_s {
+  IRSSource* source;
+  int cx;
+  int cy;
+  int cz;
+  int irLen;
+  ComplexNum* spectra;
+  size_t bytes;
+  // Only goes from 0 to 1 under the lock, holders retain and release without it
+  atomic_int refs;
+  // Cleared while the thread that missed is still interpolating, others get no entry meanwhile
+  atomic_bool ready;
+  // Next in the bucket, or in the free list while unused
+  IRCacheEntry* hashNext;
+  // Most recently used first
+  IRCacheEntry* lruPrev;
+  IRCacheEntry* lruNext;
+};
+
+struct IRCache_s {
+  pthread_mutex_t lock;
+  FFTPlanCache* plans;
+  int partitionSize;
+  float cellSize;
+  // Every entry, each with spectra for the longest response, the ones not in the hash table are in the free list
+  IRCacheEntry* entries;
+  int nEntries;
+  IRCacheEntry* freeList;
+  // Chained hash table of every entry in use, nBuckets is a power of 2
+  IRCacheEntry** buckets;
+  int nBuckets;
+  IRCacheEntry* lruHead;
+  IRCacheEntry* lruTail;
+  IRCacheStats stats;
+};
+
+IRCache* irCache_init(FFTPlanCache* plans, int partitionSize, size_t maxBytes, float cellSize, int maxIrLen) {
+  IRCache* cache = malloc(sizeof(IRCache));
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->plans = plans;
+  cache->partitionSize = partitionSize;
+  cache->cellSize = cellSize;
+  size_t entryBytes = convolver_spectraLength(partitionSize, maxIrLen)*sizeof(ComplexNum);
+  cache->nEntries = maxBytes/entryBytes > 0 ? (int)(maxBytes/entryBytes) : 1;
+  cache->entries = malloc(cache->nEntries*sizeof(IRCacheEntry));
+  cache->freeList = NULL;
+  for (int i = cache->nEntries - 1; i >= 0; i--) {
+    cache->entries[i].spectra = FFTW(malloc)(entryBytes);
+    cache->entries[i].hashNext = cache->freeList;
+    cache->freeList = &cache->entries[i];
+  }
+  // chains stay around 2 entries long with the cache full
+  cache->nBuckets = 64;
+  while (2*cache->nBuckets < cache->nEntries) {
+    cache->nBuckets *= 2;
+  }
+  cache->buckets = calloc(cache->nBuckets, sizeof(IRCacheEntry*));
+  cache->lruHead = NULL;
+  cache->lruTail = NULL;
+  memset(&cache->stats, 0, sizeof(IRCacheStats));
+  return cache;
+}
+
+void irCache_destroy(IRCache* cache) {
+  for (int i = 0; i < cache->nEntries; i++) {
+    FFTW(free)(cache->entries[i].spectra);
+  }
+  free(cache->entries);
+  free(cache->buckets);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+static unsigned hashKey(IRSSource* source, int cx, int cy, int cz) {
+  unsigned h = (unsigned)((uintptr_t)source >> 4) * 2654435761u;
+  h ^= (unsigned)cx * 73856093u;
+  h ^= (unsigned)cy * 19349663u;
+  h ^= (unsigned)cz * 83492791u;
+  return h;
+}
+
+static void lruUnlink(IRCache* cache, IRCacheEntry* e) {
+  if (e->lruPrev != NULL) {
+    e->lruPrev->lruNext = e->lruNext;
+  } else {
+    cache->lruHead = e->lruNext;
+  }
+  if (e->lruNext != NULL) {
+    e->lruNext->lruPrev = e->lruPrev;
+  } else {
+    cache->lruTail = e->lruPrev;
+  }
+}
+
+static void lruPushFront(IRCache* cache, IRCacheEntry* e) {
+  e->lruPrev = NULL;
+  e->lruNext = cache->lruHead;
+  if (cache->lruHead != NULL) {
+    cache->lruHead->lruPrev = e;
+  } else {
+    cache->lruTail = e;
+  }
+  cache->lruHead = e;
+}
+
+static void hashRemove(IRCache* cache, IRCacheEntry* e) {
+  IRCacheEntry** link = &cache->buckets[hashKey(e->source, e->cx, e->cy, e->cz) & (cache->nBuckets - 1)];
+  while (*link != e) {
+    link = &(*link)->hashNext;
+  }
+  *link = e->hashNext;
+}
+
+static void hashInsert(IRCache* cache, IRCacheEntry* e) {
+  IRCacheEntry** bucket = &cache->buckets[hashKey(e->source, e->cx, e->cy, e->cz) & (cache->nBuckets - 1)];
+  e->hashNext = *bucket;
+  *bucket = e;
+}
+
+// An unused entry, from the free list or else the least recently used entry nothing holds, NULL if there's none
+static IRCacheEntry* takeEntry(IRCache* cache) {
+  IRCacheEntry* e = cache->freeList;
+  if (e != NULL) {
+    cache->freeList = e->hashNext;
+    return e;
+  }
+  for (e = cache->lruTail; e != NULL; e = e->lruPrev) {
+    if (atomic_load_explicit(&e->refs, memory_order_acquire) == 0 && atomic_load_explicit(&e->ready, memory_order_acquire)) {
+      lruUnlink(cache, e);
+      hashRemove(cache, e);
+      cache->stats.bytes -= e->bytes;
+      cache->stats.entries--;
+      cache->stats.evictions++;
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// Interpolates the spectra at the centre of the entry's cell
+static void fillEntry(IRCache* cache, IRCacheEntry* e, Sample* ir, Sample* scratch) {
+  float x = e->cx*cache->cellSize;
+  float y = e->cy*cache->cellSize;
+  float z = e->cz*cache->cellSize;
+  if (getSpectraLength(e->source) > 0) {
+    getInterpolatedSpectra(e->source, x, y, z, e->spectra, &e->irLen);
+  } else {
+    getInterpolatedDataInto(e->source, x, y, z, ir, &e->irLen);
+    convolver_computeSpectra(cache->plans, cache->partitionSize, ir, e->irLen, e->spectra, scratch);
+  }
+}
+
+IRCacheEntry* irCache_acquire(IRCache* cache, IRSSource* source, float x, float y, float z, Sample* ir, Sample* scratch) {
+  int cx = (int)floorf(x/cache->cellSize + 0.5f);
+  int cy = (int)floorf(y/cache->cellSize + 0.5f);
+  int cz = (int)floorf(z/cache->cellSize + 0.5f);
+
+  // another thread holding the lock is one looking up or evicting, either way an audio thread doesn't wait for it
+  if (pthread_mutex_trylock(&cache->lock) != 0) {
+    return NULL;
+  }
+  IRCacheEntry* e = cache->buckets[hashKey(source, cx, cy, cz) & (cache->nBuckets - 1)];
+  for (; e != NULL; e = e->hashNext) {
+    if (e->source == source && e->cx == cx && e->cy == cy && e->cz == cz) {
+      break;
+    }
+  }
+
+  if (e != NULL && !atomic_load_explicit(&e->ready, memory_order_acquire)) {
+    // waiting for the thread interpolating it could hold up an audio thread for as long as that takes
+    cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+  }
+  if (e != NULL) {
+    cache->stats.hits++;
+    atomic_fetch_add_explicit(&e->refs, 1, memory_order_relaxed);
+    lruUnlink(cache, e);
+    lruPushFront(cache, e);
+    pthread_mutex_unlock(&cache->lock);
+    return e;
+  }
+
+  cache->stats.misses++;
+  int spectraLen = getSpectraLength(source);
+  if (spectraLen == 0) {
+    spectraLen = convolver_spectraLength(cache->partitionSize, getDataLength(source));
+  }
+  e = takeEntry(cache);
+  if (e == NULL) {
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+  }
+  e->source = source;
+  e->cx = cx;
+  e->cy = cy;
+  e->cz = cz;
+  e->bytes = spectraLen*sizeof(ComplexNum);
+  atomic_store_explicit(&e->refs, 1, memory_order_relaxed);
+  atomic_store_explicit(&e->ready, false, memory_order_relaxed);
+  hashInsert(cache, e);
+  lruPushFront(cache, e);
+  cache->stats.bytes += e->bytes;
+  cache->stats.entries++;
+  pthread_mutex_unlock(&cache->lock);
+
+  // other threads can look up other cells meanwhile
+  fillEntry(cache, e, ir, scratch);
+
+  // publishes the spectra to the threads that find it from now on
+  atomic_store_explicit(&e->ready, true, memory_order_release);
+  return e;
+}
+
+void irCache_retain(IRCache* cache, IRCacheEntry* entry) {
+  (void)cache;
+  atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+}
+
+void irCache_release(IRCache* cache, IRCacheEntry* entry) {
+  (void)cache;
+  // pairs with the acquire load in takeEntry, so the spectra are only reused once this holder is done with them
+  atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_release);
+}
+
+const ComplexNum* irCacheEntry_spectra(IRCacheEntry* entry) {
+  return entry->spectra;
+}
+
+int irCacheEntry_irLen(IRCacheEntry* entry) {
+  return entry->irLen;
+}
+
+void irCache_getStats(IRCache* cache, IRCacheStats* stats) {
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,46 @@
+#ifndef IRCACHE_H
+#define IRCACHE_H
+
+#include <stddef.h>
+#include "convolve.h"
+#include "irs.h"
+
+/* Cache of interpolated impulse response spectra shared by all streams of an AudioSim
+ * Positions are snapped to a grid of cellSize and every stream in a cell uses the same read only spectra.
+ * Entries are reference counted, unused ones are evicted least recently used first once the cache
+ * is full. Every entry is allocated at init, so nothing allocates after it. Lookups only try the lock and
+ * retain/release don't take it, so audio threads never wait on each other. Safe to use from several threads.
+ */
+typedef struct IRCache_s IRCache;
+typedef struct IRCacheEntry_s IRCacheEntry;
+
+typedef struct {
+  long hits;
+  long misses;
+  long evictions;
+  int entries;
+  size_t bytes;
+} IRCacheStats;
+
+/* Spectra are in the convolver layout for partitionSize, transformed with plans when the source has none precomputed
+ * maxBytes is divided into entries with room for the spectra of a maxIrLen sample response
+ */
+IRCache* irCache_init(FFTPlanCache* plans, int partitionSize, size_t maxBytes, float cellSize, int maxIrLen);
+void irCache_destroy(IRCache* cache);
+
+/* Returns the entry for the cell around the position, interpolating it if it isn't cached
+ * The caller holds a reference until irCache_release
+ * Sources without precomputed spectra are interpolated into ir, getDataLength(source) samples, and
+ * transformed with scratch, convolver_scratchLength samples. Returns NULL when another thread holds the cache,
+ * is still interpolating the cell, or every entry is in use, the caller keeps the response it has and asks again later.
+ */
+IRCacheEntry* irCache_acquire(IRCache* cache, IRSSource* source, float x, float y, float z, Sample* ir, Sample* scratch);
+void irCache_retain(IRCache* cache, IRCacheEntry* entry);
+void irCache_release(IRCache* cache, IRCacheEntry* entry);
+
+const ComplexNum* irCacheEntry_spectra(IRCacheEntry* entry);
+int irCacheEntry_irLen(IRCacheEntry* entry);
+
+void irCache_getStats(IRCache* cache, IRCacheStats* stats);
+
+#endif
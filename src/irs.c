@@ -1,4 +1,5 @@
 #include "irs.h"
+#include "irs_internal.h"
 
 #include "stdlib.h"
 #include "stdint.h"
@@ -6,350 +7,797 @@
 #include <string.h>
 #include <stdbool.h>
 #include <math.h>
+#include <fftw3.h>
+#include "resample.h"
+#include "kernels.h"
+#include "threadpool.h"
+#include "alloccount.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Files that don't give their rate hold responses sampled at this rate
+#define IRS_DEFAULT_FILE_RATE 22050
+// Trimmed responses fade out over this many seconds after the cut, so they don't end in a click
+#define IRS_TRIM_FADE_SECONDS 0.005
+
+// Adds scale times the listener's raw samples to dst, up to its length and faded out at the end
+static void accumulateRaw(IRSListener* listener, Sample scale, Sample* dst) {
+  const Kernels* kernels = kernels_get();
+  const float* raw = listener->raw;
+  kernels->accumulate(dst, raw, NULL, scale, listener->fadeStart);
+  kernels->accumulate(dst + listener->fadeStart, raw + listener->fadeStart, listener->source->file->fade, scale,
+    listener->length - listener->fadeStart);
+}
 
-#pragma pack(push,1)
-typedef struct {
-  // Should always contain the text "iSim"
-  char format[4];
-  // File format version
-  int32_t version;
-  // Total size of the header in bytes
-  int32_t headerSize;
-  // The length of the scene in voxels
-  int32_t sizeX;
-  // The height of the scene in voxels
-  int32_t sizeY;
-  // The depth of the scene in voxels
-  int32_t sizeZ;
-  // Number of samples per second
-  int32_t samplingRate;
-  // Speed of sound (voxels/sample)
-  float speedOfSound;
-  // Voxels per metre
-  float scale;
-  // The number of sources in the file
-  int32_t nSources;
-  // The number of listeners in the file
-  int32_t nListeners;
-} IRSHeader;
-#pragma pack(pop)
-
-#pragma pack(push,1)
-typedef struct {
-  int32_t id;
-  int32_t xPos;
-  int32_t yPos;
-  int32_t zPos;
-} IRSListenerDataChunk;
-#pragma pack(pop)
-
-#pragma pack(push,1)
-typedef struct {
-  int32_t size;
-  int32_t nEntries;
-} IRSListenerHeaderChunk;
-#pragma pack(pop)
+void decodeListenerData(IRSListener* listener, Sample* dst) {
+  IRSFile* irsFile = listener->source->file;
+  memset(dst, 0, listener->source->dataLen*sizeof(Sample));
+  if (listener->packed != NULL) {
+    samplePack_accumulate(irsFile->storage, listener->packed, listener->length, 1, dst);
+  } else {
+    accumulateRaw(listener, 1.0/irsFile->maxSample, dst);
+  }
+}
 
-#pragma pack(push,1)
-typedef struct {
-  int32_t id;
-  int32_t xPos;
-  int32_t yPos;
-  int32_t zPos;
-  int32_t type;
-  int32_t nSamples;
-} IRSSourceDataChunk;
-#pragma pack(pop)
-
-#pragma pack(push,1)
-typedef struct {
-  int32_t size;
-  int32_t nEntries;
-} IRSSourceHeaderChunk;
-#pragma pack(pop)
+static unsigned hashListenerId(int id) {
+  return (unsigned)id * 2654435761u;
+}
+
+// Returns the index of the listener with the given id, or -1
+static int findListenerIndex(IRSFile* irsFile, int id) {
+  unsigned mask = irsFile->idTableSize - 1;
+  for (unsigned slot = hashListenerId(id) & mask; irsFile->idTable[slot] != 0; slot = (slot + 1) & mask) {
+    int index = irsFile->idTable[slot] - 1;
+    if (irsFile->listeners[index].id == id) {
+      return index;
+    }
+  }
+  return -1;
+}
+
+// Adds listener index to the id table, returns false if its id is already taken
+static bool addListenerIndex(IRSFile* irsFile, int index) {
+  if (findListenerIndex(irsFile, irsFile->listeners[index].id) >= 0) {
+    return false;
+  }
+  unsigned mask = irsFile->idTableSize - 1;
+  unsigned slot = hashListenerId(irsFile->listeners[index].id) & mask;
+  while (irsFile->idTable[slot] != 0) {
+    slot = (slot + 1) & mask;
+  }
+  irsFile->idTable[slot] = index + 1;
+  return true;
+}
+
+// Whether n records of size bytes fit in the mapped file from offset
+static bool fitsInMap(MappedFile* map, size_t offset, int64_t n, int64_t size) {
+  return n >= 0 && size >= 0 && offset <= map->size && (size == 0 || (uint64_t)n <= (map->size - offset)/(uint64_t)size);
+}
+
+// Copies size bytes at *offset out of the mapped file and advances offset, false if the file is too short
+static bool readChunk(MappedFile* map, size_t* offset, void* dst, size_t size) {
+  if (*offset > map->size || map->size - *offset < size) {
+    return false;
+  }
+  memcpy(dst, map->data + *offset, size);
+  *offset += size;
+  return true;
+}
 
-#pragma pack(push,1)
+void buildSourceIndexes(IRSFile* irsFile) {
+  float* positions = malloc(3*irsFile->nListeners*sizeof(float));
+  for (int i = 0; i < irsFile->nSources; i++) {
+    IRSSource* source = &irsFile->sources[i];
+    for (int j = 0; j < source->nListeners; j++) {
+      positions[3*j] = source->listeners[j]->x;
+      positions[3*j + 1] = source->listeners[j]->y;
+      positions[3*j + 2] = source->listeners[j]->z;
+    }
+    source->index = spatialIndex_build(positions, source->nListeners);
+  }
+  free(positions);
+}
+
+int getIRSOutputRate(const IRSHeader* header, const IRSLoadOptions* options) {
+  if (options->sampleRate > 0) {
+    return options->sampleRate;
+  }
+  return header->samplingRate > 0 ? header->samplingRate : IRS_DEFAULT_FILE_RATE;
+}
+
+void getDefaultIRSLoadOptions(IRSLoadOptions* options) {
+  options->spectrumPartitionSize = 0;
+  options->plans = NULL;
+  options->sampleRate = 44100;
+  options->numThreads = 0;
+  options->trimMode = IRS_TRIM_NONE;
+  options->trimThreshold = 60;
+  options->storage = SAMPLE_PACK_NONE;
+}
+
+IRSFile* loadIRSFile(char* filename) {
+  IRSLoadOptions options;
+  getDefaultIRSLoadOptions(&options);
+  return loadIRSFileWithOptions(filename, &options);
+}
+
+// Processing of the impulse responses at load, split into chunks of records that the load threads
+// work through, each with its own scratch
 typedef struct {
-  int32_t size;
-  int32_t sourceId;
-  int32_t listenerId;
-} IRSDataHeaderChunk;
-#pragma pack(pop)
-
-struct IRSListener_s {
-  int id;
-  IRSSource* source;
-  float x;
-  float y;
-  float z;
-  double* data;
-};
-
-struct IRSSource_s {
-  int id;
-  float x;
-  float y;
-  float z;
-  int nListeners;
-  int listenerAxisSize;
+  IRSFile* irsFile;
+  IRSLoadOptions* options;
+  // NULL when the file is already at the output rate
+  Resampler* resampler;
   int dataLen;
-  IRSListener** listeners;
-  IRSFile* file;
-};
+  int nRecords;
+  int nChunks;
+  // Peak of every record, reduced into the normalisation once all are known
+  double* peaks;
+  // Where each record's packed samples start in irsFile->packed, and the error packing made to it
+  size_t* packOffsets;
+  double* packMaxErrors;
+  double* packSquaredErrors;
+} LoadJob;
+
+// Samples of the response up to where trimming cuts it, len if nothing is cut
+static int trimPoint(const float* raw, int len, double peak, IRSLoadOptions* options) {
+  if (options->trimMode == IRS_TRIM_LEVEL) {
+    double threshold = peak*pow(10, -options->trimThreshold/20);
+    while (len > 0 && fabs(raw[len - 1]) <= threshold) {
+      len--;
+    }
+  } else if (options->trimMode == IRS_TRIM_ENERGY) {
+    // the backward integral of the squared response is its energy decay curve
+    double total = 0;
+    for (int k = 0; k < len; k++) {
+      total += (double)raw[k]*raw[k];
+    }
+    double threshold = total*pow(10, -options->trimThreshold/10);
+    double remaining = 0;
+    while (len > 0 && remaining + (double)raw[len - 1]*raw[len - 1] <= threshold) {
+      remaining += (double)raw[len - 1]*raw[len - 1];
+      len--;
+    }
+  }
+  return len;
+}
 
-struct IRSFile_s {
-  IRSHeader header;
-  int nSources;
-  int nListeners;
-  IRSSource* sources;
-  IRSListener* listeners;
-};
-
-// Resamples a 22050 Hz input to 44100 Hz using linear interpolation
-float* resample_22050_to_44100(float* input, int n) {
-  float* resampled = (float*)malloc(sizeof(float) * n * 2);
-  for (int i = 0; i < n-1; i++) {
-    resampled[2 * i] = input[i];
-    resampled[2 * i + 1] = (input[i] + input[i+1])/2.0f;
-  }
-  resampled[2*n - 1] = resampled[2*n - 2] / 2.0f;
-  return resampled;
+static void chunkRecords(LoadJob* job, int chunk, int* first, int* end) {
+  *first = (int)((long long)chunk*job->nRecords/job->nChunks);
+  *end = (int)((long long)(chunk + 1)*job->nRecords/job->nChunks);
 }
 
-IRSFile* loadIRSFile(char* filename) {
-  IRSFile* irsFile = malloc(sizeof(IRSFile));
-
-  FILE* file;
-  if (file = fopen(filename, "rb")) {
-    IRSHeader header;
-    fread(&header, sizeof(IRSHeader), 1, file);
-
-    irsFile->header = header;
-    irsFile->nSources = header.nSources;
-
-    double maxSample;
-
-    {
-      IRSSourceHeaderChunk sourceHeaderChunk;
-      fread(&sourceHeaderChunk, sizeof(IRSSourceHeaderChunk), 1, file);
-
-      irsFile->sources = malloc(sourceHeaderChunk.nEntries*sizeof(IRSSource));
-      for (int i = 0; i < sourceHeaderChunk.nEntries; i++) {
-        IRSSourceDataChunk sourceDataChunk;
-        fread(&sourceDataChunk, sizeof(IRSSourceDataChunk), 1, file);
-        irsFile->sources[i].id = sourceDataChunk.id;
-        irsFile->sources[i].x = (float)sourceDataChunk.xPos/header.scale;
-        irsFile->sources[i].y = (float)sourceDataChunk.yPos/header.scale;
-        irsFile->sources[i].z = (float)sourceDataChunk.zPos/header.scale;
-        irsFile->sources[i].dataLen = 22050;
-        irsFile->sources[i].nListeners = header.nListeners;
-        irsFile->sources[i].listenerAxisSize = sqrt(header.nListeners);
-        irsFile->sources[i].file = irsFile;
+// Converts the records of a chunk to the output rate and finds their peaks
+static void resampleTask(void* context, int chunk) {
+  LoadJob* job = context;
+  IRSFile* irsFile = job->irsFile;
+  int first, end;
+  chunkRecords(job, chunk, &first, &end);
+  for (int i = first; i < end; i++) {
+    IRSListener* listener = &irsFile->sourceListeners[i];
+    if (job->resampler != NULL) {
+      float* dst = irsFile->resampled + (size_t)i*job->dataLen;
+      resampler_process(job->resampler, listener->raw, irsFile->rawLen, dst, job->dataLen);
+      listener->raw = dst;
+    }
+    // the filter can overshoot, so the peak is taken after resampling
+    double peak = 0;
+    for (int k = 0; k < job->dataLen; k++) {
+      if (fabs(listener->raw[k]) > peak) {
+        peak = fabs(listener->raw[k]);
+      }
+    }
+    job->peaks[i] = peak;
+
+    // the fade out covers samples below the threshold, so everything above it is kept as is
+    int cut = trimPoint(listener->raw, job->dataLen, peak, job->options);
+    listener->fadeStart = cut;
+    listener->length = cut + irsFile->fadeLen < job->dataLen ? cut + irsFile->fadeLen : job->dataLen;
+  }
+}
+
+// Normalises and packs the records of a chunk, and measures what packing changed
+static void packTask(void* context, int chunk) {
+  LoadJob* job = context;
+  IRSFile* irsFile = job->irsFile;
+  int first, end;
+  chunkRecords(job, chunk, &first, &end);
+  Sample* scratch = malloc(job->dataLen*sizeof(Sample));
+  for (int i = first; i < end; i++) {
+    IRSListener* listener = &irsFile->sourceListeners[i];
+    unsigned char* packed = irsFile->packed + job->packOffsets[i];
+    decodeListenerData(listener, scratch);
+    samplePack_encode(irsFile->storage, scratch, listener->length, packed);
+    // taking the packed samples back out of the decoded ones leaves the error
+    samplePack_accumulate(irsFile->storage, packed, listener->length, -1, scratch);
+    double maxError = 0;
+    double squares = 0;
+    for (int k = 0; k < listener->length; k++) {
+      if (fabs(scratch[k]) > maxError) {
+        maxError = fabs(scratch[k]);
+      }
+      squares += (double)scratch[k]*scratch[k];
+    }
+    job->packMaxErrors[i] = maxError;
+    job->packSquaredErrors[i] = squares;
+    listener->packed = packed;
+  }
+  free(scratch);
+}
+
+// Normalises the records of a chunk and transforms them into partition spectra
+static void spectraTask(void* context, int chunk) {
+  LoadJob* job = context;
+  IRSFile* irsFile = job->irsFile;
+  int partitionSize = job->options->spectrumPartitionSize;
+  int first, end;
+  chunkRecords(job, chunk, &first, &end);
+  Sample* scratch = malloc(job->dataLen*sizeof(Sample));
+  Sample* fftScratch = FFTW(alloc_real)(convolver_scratchLength(partitionSize, job->dataLen));
+  for (int i = first; i < end; i++) {
+    // streams only use the spectra, so the time domain data stays undecoded
+    IRSListener* listener = &irsFile->sourceListeners[i];
+    listener->spectraLen = convolver_spectraLength(partitionSize, listener->length);
+    decodeListenerData(listener, scratch);
+    listener->spectra = FFTW(malloc)(listener->spectraLen*sizeof(ComplexNum));
+    convolver_computeSpectra(job->options->plans, partitionSize, scratch, listener->length, listener->spectra, fftScratch);
+  }
+  FFTW(free)(fftScratch);
+  free(scratch);
+}
+
+// Parses the mapped file into irsFile, returns an error message or NULL on success
+static const char* parseIRSFile(IRSFile* irsFile, IRSLoadOptions* options) {
+  MappedFile* map = irsFile->map;
+  size_t offset = 0;
+
+  IRSHeader header;
+  if (!readChunk(map, &offset, &header, sizeof(IRSHeader))) {
+    return "file too short for the header";
+  }
+  if (memcmp(header.format, "iSim", 4) != 0) {
+    return "not an iSim file";
+  }
+  if (header.nSources < 1 || header.nListeners < 1 || header.scale <= 0) {
+    return "invalid header";
+  }
+
+  irsFile->header = header;
+  irsFile->nSources = header.nSources;
+  irsFile->nListeners = header.nListeners;
+  // files that don't give the length in their source chunks hold 22050 samples per response
+  irsFile->rawLen = 22050;
+
+  {
+    IRSSourceHeaderChunk sourceHeaderChunk;
+    size_t sectionStart = offset;
+    if (!readChunk(map, &offset, &sourceHeaderChunk, sizeof(IRSSourceHeaderChunk)) || sourceHeaderChunk.nEntries != header.nSources
+        || sourceHeaderChunk.size % 4 != 0
+        || sourceHeaderChunk.size < (int64_t)sizeof(IRSSourceHeaderChunk) + header.nSources*(int64_t)sizeof(IRSSourceDataChunk)) {
+      return "invalid source chunk";
+    }
+    if (!fitsInMap(map, sectionStart, 1, sourceHeaderChunk.size)) {
+      return "file too short for the sources";
+    }
+
+    irsFile->sources = calloc(header.nSources, sizeof(IRSSource));
+    if (irsFile->sources == NULL) {
+      return "out of memory";
+    }
+    for (int i = 0; i < header.nSources; i++) {
+      IRSSourceDataChunk sourceDataChunk;
+      readChunk(map, &offset, &sourceDataChunk, sizeof(IRSSourceDataChunk));
+      if (sourceDataChunk.nSamples > 0) {
+        if (i > 0 && sourceDataChunk.nSamples != irsFile->rawLen) {
+          return "sources with different impulse response lengths";
+        }
+        irsFile->rawLen = sourceDataChunk.nSamples;
+      }
+      for (int k = 0; k < i; k++) {
+        if (irsFile->sources[k].id == sourceDataChunk.id) {
+          return "duplicate source id";
+        }
+      }
+      irsFile->sources[i].id = sourceDataChunk.id;
+      irsFile->sources[i].x = (float)sourceDataChunk.xPos/header.scale;
+      irsFile->sources[i].y = (float)sourceDataChunk.yPos/header.scale;
+      irsFile->sources[i].z = (float)sourceDataChunk.zPos/header.scale;
+      irsFile->sources[i].spectraLen = 0;
+      irsFile->sources[i].nListeners = header.nListeners;
+      irsFile->sources[i].listeners = NULL;
+      irsFile->sources[i].file = irsFile;
+    }
+    // anything after the entries up to the declared size is padding
+    offset = sectionStart + sourceHeaderChunk.size;
+  }
+  {
+    IRSListenerHeaderChunk listenerHeaderChunk;
+    size_t sectionStart = offset;
+    if (!readChunk(map, &offset, &listenerHeaderChunk, sizeof(IRSListenerHeaderChunk)) || listenerHeaderChunk.nEntries != header.nListeners
+        || listenerHeaderChunk.size % 4 != 0
+        || listenerHeaderChunk.size < (int64_t)sizeof(IRSListenerHeaderChunk) + header.nListeners*(int64_t)sizeof(IRSListenerDataChunk)) {
+      return "invalid listener chunk";
+    }
+    if (!fitsInMap(map, sectionStart, 1, listenerHeaderChunk.size)) {
+      return "file too short for the listeners";
+    }
+
+    // the listeners fit in the file, which bounds the table well below overflowing
+    irsFile->idTableSize = 1;
+    while (irsFile->idTableSize < 2*(int64_t)header.nListeners) {
+      irsFile->idTableSize *= 2;
+    }
+    irsFile->idTable = calloc(irsFile->idTableSize, sizeof(int));
+    irsFile->listeners = malloc((size_t)header.nListeners*sizeof(IRSListener));
+    if (irsFile->idTable == NULL || irsFile->listeners == NULL) {
+      return "out of memory";
+    }
+    for (int i = 0; i < header.nListeners; i++) {
+      IRSListenerDataChunk listenerDataChunk;
+      readChunk(map, &offset, &listenerDataChunk, sizeof(IRSListenerDataChunk));
+      irsFile->listeners[i].id = listenerDataChunk.id;
+      irsFile->listeners[i].source = NULL;
+      irsFile->listeners[i].x = (float)listenerDataChunk.xPos/header.scale;
+      irsFile->listeners[i].y = (float)listenerDataChunk.yPos/header.scale;
+      irsFile->listeners[i].z = (float)listenerDataChunk.zPos/header.scale;
+      irsFile->listeners[i].raw = NULL;
+      irsFile->listeners[i].packed = NULL;
+      irsFile->listeners[i].data = NULL;
+      irsFile->listeners[i].spectra = NULL;
+      irsFile->listeners[i].length = 0;
+      irsFile->listeners[i].fadeStart = 0;
+      irsFile->listeners[i].spectraLen = 0;
+      if (!addListenerIndex(irsFile, i)) {
+        return "duplicate listener id";
+      }
+    }
+    offset = sectionStart + listenerHeaderChunk.size;
+  }
+  {
+    int64_t nRecords = (int64_t)header.nSources*header.nListeners;
+    size_t rawBytes = (size_t)irsFile->rawLen*sizeof(float);
+    // every record is at least its header and samples, so a file that can't hold that many is rejected
+    // before anything is sized from the counts
+    if (irsFile->rawLen < 1 || nRecords > INT32_MAX || !fitsInMap(map, offset, nRecords, sizeof(IRSDataHeaderChunk) + rawBytes)) {
+      return "file too short for the impulse responses";
+    }
+    // every source gets its own copy of the listeners so the impulse responses don't collide
+    irsFile->sourceListeners = calloc(nRecords, sizeof(IRSListener));
+    // which listeners each source has a response for, and how many
+    bool* seen = calloc(nRecords, sizeof(bool));
+    int* filled = calloc(header.nSources, sizeof(int));
+    const char* error = irsFile->sourceListeners == NULL || seen == NULL || filled == NULL ? "out of memory" : NULL;
+    for (int i = 0; i < header.nSources && error == NULL; i++) {
+      irsFile->sources[i].listeners = malloc(header.nListeners*sizeof(IRSListener*));
+      if (irsFile->sources[i].listeners == NULL) {
+        error = "out of memory";
+      }
+    }
+
+    // responses at another rate than the output are converted below, until then they point into the file
+    int sourceIndex = 0;
+    for (int64_t r = 0; r < nRecords && error == NULL; r++) {
+      size_t chunkStart = offset;
+      IRSDataHeaderChunk dataHeaderChunk;
+      if (!readChunk(map, &offset, &dataHeaderChunk, sizeof(IRSDataHeaderChunk))) {
+        error = "file too short for the impulse responses";
+        break;
+      }
+      // records are normally grouped by source, so the last one's source is checked first
+      if (irsFile->sources[sourceIndex].id != dataHeaderChunk.sourceId) {
+        sourceIndex = 0;
+        while (sourceIndex < header.nSources && irsFile->sources[sourceIndex].id != dataHeaderChunk.sourceId) {
+          sourceIndex++;
+        }
+        if (sourceIndex == header.nSources) {
+          sourceIndex = 0;
+          error = "impulse response for an unknown source";
+          break;
+        }
+      }
+      // chunks can be padded, but only to multiples of 4 bytes, so the samples stay float aligned
+      if (dataHeaderChunk.size < (int64_t)(sizeof(IRSDataHeaderChunk) + rawBytes) || dataHeaderChunk.size % 4 != 0
+          || !fitsInMap(map, chunkStart, 1, dataHeaderChunk.size)) {
+        error = "invalid impulse response chunk";
+        break;
+      }
+      int index = findListenerIndex(irsFile, dataHeaderChunk.listenerId);
+      if (index < 0) {
+        error = "impulse response for an unknown listener";
+        break;
       }
+      if (seen[(int64_t)sourceIndex*header.nListeners + index]) {
+        error = "duplicate impulse response for a listener";
+        break;
+      }
+      seen[(int64_t)sourceIndex*header.nListeners + index] = true;
+
+      IRSSource* source = &irsFile->sources[sourceIndex];
+      int j = filled[sourceIndex]++;
+      IRSListener* listener = &irsFile->sourceListeners[sourceIndex*header.nListeners + j];
+      *listener = irsFile->listeners[index];
+      listener->source = source;
+      listener->raw = (const float*)(map->data + offset);
+      source->listeners[j] = listener;
+      offset = chunkStart + dataHeaderChunk.size;
+    }
+    free(seen);
+    free(filled);
+    if (error != NULL) {
+      return error;
+    }
+    buildSourceIndexes(irsFile);
+  }
+  {
+    int fileRate = header.samplingRate > 0 ? header.samplingRate : IRS_DEFAULT_FILE_RATE;
+    irsFile->sampleRate = getIRSOutputRate(&header, options);
+    int nRecords = header.nSources*header.nListeners;
+    int nThreads = options->numThreads > 0 ? options->numThreads : threadPool_cpuCount();
+    LoadJob job;
+    job.irsFile = irsFile;
+    job.options = options;
+    job.resampler = NULL;
+    job.dataLen = irsFile->rawLen;
+    job.nRecords = nRecords;
+    // a few chunks per thread so uneven ones still balance
+    job.nChunks = nRecords < 4*nThreads ? nRecords : 4*nThreads;
+    job.peaks = malloc(nRecords*sizeof(double));
+    if (job.peaks == NULL) {
+      return "out of memory";
     }
-    {
-      IRSListenerHeaderChunk listenerHeaderChunk;
-      fread(&listenerHeaderChunk, sizeof(IRSListenerHeaderChunk), 1, file);
-
-      irsFile->listeners = malloc(listenerHeaderChunk.nEntries*sizeof(IRSListener));
-      irsFile->nListeners = listenerHeaderChunk.nEntries;
-      for (int i = 0; i < listenerHeaderChunk.nEntries; i++) {
-        IRSListenerDataChunk listenerDataChunk;
-        int r = fread(&listenerDataChunk, sizeof(IRSListenerDataChunk), 1, file);
-        irsFile->listeners[i].id = listenerDataChunk.id;
-        irsFile->listeners[i].x = (float)listenerDataChunk.xPos/header.scale;
-        irsFile->listeners[i].y = (float)listenerDataChunk.yPos/header.scale;
-        irsFile->listeners[i].z = (float)listenerDataChunk.zPos/header.scale;
+    if (fileRate != irsFile->sampleRate) {
+      // converted once here, so nothing downstream ever resamples
+      job.resampler = resampler_init(fileRate, irsFile->sampleRate);
+      job.dataLen = resampler_outputLength(job.resampler, irsFile->rawLen);
+      irsFile->resampled = malloc((size_t)nRecords*job.dataLen*sizeof(float));
+    }
+    if (options->trimMode != IRS_TRIM_NONE) {
+      irsFile->fadeLen = (int)(irsFile->sampleRate*IRS_TRIM_FADE_SECONDS);
+      irsFile->fade = malloc(irsFile->fadeLen*sizeof(float));
+    }
+    if ((job.resampler != NULL && irsFile->resampled == NULL) || (options->trimMode != IRS_TRIM_NONE && irsFile->fade == NULL)) {
+      if (job.resampler != NULL) {
+        resampler_destroy(job.resampler);
+      }
+      free(job.peaks);
+      return "out of memory";
+    }
+    if (irsFile->fade != NULL) {
+      for (int k = 0; k < irsFile->fadeLen; k++) {
+        irsFile->fade[k] = 0.5 + 0.5*cos(M_PI*(k + 0.5)/irsFile->fadeLen);
       }
     }
-    {
-      for (int i =0; i < header.nSources; i++) {
-        float* buffer = malloc(irsFile->sources[i].dataLen*sizeof(float));
-        irsFile->sources[i].listeners = malloc(irsFile->sources[i].nListeners*sizeof(IRSListener*));
-
-        for (int j = 0; j < irsFile->sources[i].nListeners; j++) {
-          IRSListener* listener = NULL;
-
-          IRSDataHeaderChunk dataHeaderChunk;
-          fread(&dataHeaderChunk, sizeof(IRSDataHeaderChunk), 1, file);
-
-          for (int k = 0; k < irsFile->nListeners; k++) {
-            if (irsFile->listeners[k].id == dataHeaderChunk.listenerId) {
-              listener = &irsFile->listeners[k];
-            }
-          }
-          irsFile->sources[i].listeners[j] = listener;
-
-
-          listener->source = &irsFile->sources[i];
-          listener->data = malloc(irsFile->sources[i].dataLen*2*sizeof(double));
-          fread(buffer, sizeof(float), irsFile->sources[i].dataLen, file);
-          float* resampled = resample_22050_to_44100(buffer, irsFile->sources[i].dataLen);
-          for (int k = 0; k < irsFile->sources[i].dataLen*2; k++) {
-            if (fabs(resampled[k]) > maxSample) {
-              maxSample = resampled[k];
-            }
-            listener->data[k] = resampled[k];
-          }
-          free(resampled);
+
+    // the listeners point at their samples in the file, the heavy work on them is spread over the threads
+    ThreadPool* pool = threadPool_init(nThreads);
+    threadPool_parallelFor(pool, job.nChunks, resampleTask, &job);
+    if (job.resampler != NULL) {
+      resampler_destroy(job.resampler);
+    }
+
+    // reduced in record order, so the result doesn't depend on the threads
+    double maxSample = 0;
+    for (int i = 0; i < nRecords; i++) {
+      if (job.peaks[i] > maxSample) {
+        maxSample = job.peaks[i];
+      }
+    }
+    free(job.peaks);
+    if (maxSample == 0) {
+      threadPool_destroy(pool);
+      return "impulse responses are silent";
+    }
+    irsFile->maxSample = maxSample;
+
+    // a source's buffers only need to hold its longest response
+    for (int i = 0; i < header.nSources; i++) {
+      IRSSource* source = &irsFile->sources[i];
+      source->dataLen = 1;
+      for (int j = 0; j < source->nListeners; j++) {
+        if (source->listeners[j]->length > source->dataLen) {
+          source->dataLen = source->listeners[j]->length;
         }
+      }
+    }
 
-        irsFile->sources[i].dataLen *= 2;
-        free(buffer);
+    irsFile->storage = options->storage;
+    if (options->storage != SAMPLE_PACK_NONE) {
+      // every record starts on a cache line
+      job.packOffsets = malloc(nRecords*sizeof(size_t));
+      if (job.packOffsets == NULL) {
+        threadPool_destroy(pool);
+        return "out of memory";
+      }
+      size_t packedBytes = 0;
+      for (int i = 0; i < nRecords; i++) {
+        job.packOffsets[i] = packedBytes;
+        packedBytes += (samplePack_size(options->storage, irsFile->sourceListeners[i].length) + 63) & ~(size_t)63;
+      }
+      irsFile->packed = FFTW(malloc)(packedBytes);
+      job.packMaxErrors = malloc(nRecords*sizeof(double));
+      job.packSquaredErrors = malloc(nRecords*sizeof(double));
+      if (irsFile->packed == NULL || job.packMaxErrors == NULL || job.packSquaredErrors == NULL) {
+        free(job.packOffsets);
+        free(job.packMaxErrors);
+        free(job.packSquaredErrors);
+        threadPool_destroy(pool);
+        return "out of memory";
       }
+      threadPool_parallelFor(pool, job.nChunks, packTask, &job);
 
-      for (int i =0; i < header.nSources; i++) {
-        for (int j = 0; j < irsFile->sources[i].nListeners; j++) {
-          IRSListener* listener = irsFile->sources[i].listeners[j];
-          for (int k = 0; k < irsFile->sources[i].dataLen; k++) {
-            listener->data[k] /= maxSample;
-          }
+      double squares = 0;
+      long samples = 0;
+      for (int i = 0; i < nRecords; i++) {
+        if (job.packMaxErrors[i] > irsFile->packMaxError) {
+          irsFile->packMaxError = job.packMaxErrors[i];
         }
+        squares += job.packSquaredErrors[i];
+        samples += irsFile->sourceListeners[i].length;
+        irsFile->sourceListeners[i].raw = NULL;
       }
-      printf("Max: %f\n", maxSample);
+      irsFile->packRmsError = sqrt(squares/samples);
+      free(job.packOffsets);
+      free(job.packMaxErrors);
+      free(job.packSquaredErrors);
+      // the packed samples are all that's left of the responses
+      free(irsFile->resampled);
+      irsFile->resampled = NULL;
+    }
 
+    if (options->spectrumPartitionSize > 0) {
+      for (int i = 0; i < header.nSources; i++) {
+        irsFile->sources[i].spectraLen = convolver_spectraLength(options->spectrumPartitionSize, irsFile->sources[i].dataLen);
+      }
+      threadPool_parallelFor(pool, job.nChunks, spectraTask, &job);
     }
-  } else {
-    free(irsFile);
+    threadPool_destroy(pool);
+  }
+
+  return NULL;
+}
+
+IRSFile* loadIRSFileWithOptions(char* filename, IRSLoadOptions* options) {
+  MappedFile* map = mappedFile_open(filename);
+  if (map == NULL) {
     return NULL;
-  }fclose(file);
+  }
+
+  IRSFile* irsFile = calloc(1, sizeof(IRSFile));
+  irsFile->map = map;
+
+  const char* error = parseIRSFile(irsFile, options);
+  if (error != NULL) {
+    printf("Invalid IRS file %s: %s\n", filename, error);
+    freeIRSFile(irsFile);
+    return NULL;
+  }
 
   return irsFile;
 }
 
+void freeIRSFile(IRSFile* irsFile) {
+  // data in a mapped scene cache goes away with the mapping
+  if (irsFile->sourceListeners != NULL && !irsFile->dataMapped) {
+    for (int i = 0; i < irsFile->nSources*irsFile->nListeners; i++) {
+      IRSListener* listener = &irsFile->sourceListeners[i];
+      if (listener->data != NULL) {
+        free(listener->data);
+      }
+      if (listener->spectra != NULL) {
+        FFTW(free)(listener->spectra);
+      }
+    }
+  }
+  free(irsFile->sourceListeners);
+  if (irsFile->sources != NULL) {
+    for (int i = 0; i < irsFile->nSources; i++) {
+      free(irsFile->sources[i].listeners);
+      if (irsFile->sources[i].index != NULL) {
+        spatialIndex_destroy(irsFile->sources[i].index);
+      }
+    }
+    free(irsFile->sources);
+  }
+  free(irsFile->listeners);
+  free(irsFile->idTable);
+  free(irsFile->resampled);
+  free(irsFile->fade);
+  if (irsFile->packed != NULL) {
+    FFTW(free)(irsFile->packed);
+  }
+  mappedFile_close(irsFile->map);
+  free(irsFile);
+}
+
 IRSSource* getClosestSource(IRSFile* irsFile, float x, float y, float z) {
-  return &irsFile->sources[0];
+  IRSSource* closest = &irsFile->sources[0];
+  float closestDist = INFINITY;
+  for (int i = 0; i < irsFile->nSources; i++) {
+    IRSSource* source = &irsFile->sources[i];
+    float dist = (source->x - x)*(source->x - x) + (source->y - y)*(source->y - y) + (source->z - z)*(source->z - z);
+    if (dist < closestDist) {
+      closest = source;
+      closestDist = dist;
+    }
+  }
+  return closest;
 }
 
 IRSListener* getClosestListener(IRSSource* source, float x, float y, float z) {
-  return source->listeners[267];
+  return source->listeners[spatialIndex_nearest(source->index, x, y, z)];
 }
 
-void getInterpolatedData(IRSSource* source, float x, float y, float z, double** dst, int* dstLen) {
-  int numSignals = 1;
-
-  IRSListener** listeners = malloc(4*sizeof(IRSListener*));
+// Picks the listeners around the position and their weights, returns how many were picked
+static int findInterpolationListeners(IRSSource* source, float x, float y, float z, IRSListener** listeners, float* weights) {
+  int points[SPATIALINDEX_MAX_NEIGHBOURS];
+  int numSignals = spatialIndex_interpolate(source->index, x, y, z, points, weights);
+  for (int i = 0; i < numSignals; i++) {
+    listeners[i] = source->listeners[points[i]];
+  }
+  return numSignals;
+}
 
-  bool offXNeg = x < -0.5*source->file->header.sizeX/source->file->header.scale;
-  bool offXPos = x > 0.5*source->file->header.sizeX/source->file->header.scale;
-  bool offYNeg = y < -0.5*source->file->header.sizeY/source->file->header.scale;
-  bool offYPos = y > 0.5*source->file->header.sizeY/source->file->header.scale;
+void getInterpolatedData(IRSSource* source, float x, float y, float z, Sample** dst, int* dstLen) {
+  *dst = malloc(source->dataLen*sizeof(Sample));
+  getInterpolatedDataInto(source, x, y, z, *dst, dstLen);
+}
 
-  if (offXNeg || offXPos) {
-    int xIndex = 0;
-    if (offXPos) {
-      xIndex = source->listenerAxisSize-1;
+/* dst = the weighted sum of the count sources over n samples, where each source only has its first
+ * lengths[i] samples and is zero after them. Done by runs of samples over which the same sources
+ * are present, longest first, so sources of equal length are still summed in the order given.
+ */
+static void blendSources(const Sample** src, const int* lengths, const Sample* weights, int count, Sample* dst, int n) {
+  const Sample* sorted[SPATIALINDEX_MAX_NEIGHBOURS];
+  int sortedLengths[SPATIALINDEX_MAX_NEIGHBOURS];
+  Sample sortedWeights[SPATIALINDEX_MAX_NEIGHBOURS];
+  for (int i = 0; i < count; i++) {
+    int k = i;
+    for (; k > 0 && sortedLengths[k - 1] < lengths[i]; k--) {
+      sorted[k] = sorted[k - 1];
+      sortedLengths[k] = sortedLengths[k - 1];
+      sortedWeights[k] = sortedWeights[k - 1];
     }
-    if (offYNeg || offYPos) {
-      // only grab appropriate corner
-      int yIndex = 0;
-      if (offYPos) {
-        yIndex = source->listenerAxisSize-1;
-      }
-      numSignals = 1;
-      listeners[0] = source->listeners[xIndex*source->listenerAxisSize+yIndex];
-    } else {
-      // grab two closest searching along y
-      int yUpper;
-      for (yUpper = 0; yUpper < source->listenerAxisSize; yUpper++) {
-        if (source->listeners[yUpper]->y > y) {
-          break;
-        }
-      }
-      numSignals = 2;
-      listeners[0] = source->listeners[xIndex*source->listenerAxisSize+yUpper-1];
-      listeners[1] = source->listeners[xIndex*source->listenerAxisSize+yUpper];
-    }
-  } else if (offYNeg || offYPos) {
-    int yIndex = 0;
-    if (offYPos) {
-      yIndex = source->listenerAxisSize-1;
-    }
-    // grab two closest searching along x
-    int xUpper;
-    for (xUpper = 0; xUpper < source->listenerAxisSize; xUpper++) {
-      if (source->listeners[xUpper*source->listenerAxisSize]->x > x) {
-        break;
-      }
-    }
-    numSignals = 2;
-    listeners[0] = source->listeners[(xUpper-1)*source->listenerAxisSize+yIndex];
-    listeners[1] = source->listeners[xUpper*source->listenerAxisSize+yIndex];
-  } else {
-    // grab four closest searching both x and y
-    numSignals = 4;
-    int xUpper;
-    for (xUpper = 0; xUpper < source->listenerAxisSize; xUpper++) {
-      if (source->listeners[xUpper*source->listenerAxisSize]->x > x) {
-        break;
-      }
+    sorted[k] = src[i];
+    sortedLengths[k] = lengths[i];
+    sortedWeights[k] = weights[i];
+  }
+  for (int i = 0; i < count; i++) {
+    if (sortedLengths[i] > n) {
+      sortedLengths[i] = n;
     }
-    int yUpper;
-    for (yUpper = 0; yUpper < source->listenerAxisSize; yUpper++) {
-      if (source->listeners[yUpper]->y > y) {
-        break;
+  }
+  int end = count > 0 ? sortedLengths[0] : 0;
+  memset(dst + end, 0, (n - end)*sizeof(Sample));
+  const Kernels* kernels = kernels_get();
+  // the first active sources cover the run from where the next one ends to where the last of them ends
+  for (int active = 1; active <= count; active++) {
+    int start = active < count ? sortedLengths[active] : 0;
+    int stop = sortedLengths[active - 1];
+    if (start < stop) {
+      const Sample* offset[SPATIALINDEX_MAX_NEIGHBOURS];
+      for (int i = 0; i < active; i++) {
+        offset[i] = sorted[i] + start;
       }
+      kernels->weightedSum(dst + start, offset, sortedWeights, active, stop - start);
     }
-    listeners[0] = source->listeners[(xUpper-1)*source->listenerAxisSize+yUpper-1];
-    listeners[1] = source->listeners[xUpper*source->listenerAxisSize+yUpper-1];
-    listeners[2] = source->listeners[(xUpper-1)*source->listenerAxisSize+yUpper];
-    listeners[3] = source->listeners[xUpper*source->listenerAxisSize+yUpper];
   }
+}
+
+void getInterpolatedDataInto(IRSSource* source, float x, float y, float z, Sample* dst, int* dstLen) {
+  IRSListener* listeners[SPATIALINDEX_MAX_NEIGHBOURS];
+  float weights[SPATIALINDEX_MAX_NEIGHBOURS];
 
-  double** signals = malloc(numSignals*sizeof(double*));
-  int* lengths = malloc(numSignals*sizeof(int*));
-  float* weights = malloc(numSignals*sizeof(float*));
+  int numSignals = findInterpolationListeners(source, x, y, z, listeners, weights);
 
+  // with every response decoded they are blended in one pass, otherwise one at a time from their storage
+  const Sample* src[SPATIALINDEX_MAX_NEIGHBOURS];
+  int lengths[SPATIALINDEX_MAX_NEIGHBOURS];
+  Sample blendWeights[SPATIALINDEX_MAX_NEIGHBOURS];
+  int count = 0;
+  bool decoded = true;
+  int len = 0;
   for (int i = 0; i < numSignals; i++) {
-    getListenerData(listeners[i], &signals[i], &lengths[i]);
+    if (weights[i] == 0) {
+      continue;
+    }
+    listeners[count] = listeners[i];
+    src[count] = listeners[i]->data;
+    lengths[count] = listeners[i]->length;
+    blendWeights[count] = weights[i];
+    decoded = decoded && src[count] != NULL;
+    if (lengths[count] > len) {
+      len = lengths[count];
+    }
+    count++;
+  }
+  *dstLen = len;
+  if (decoded) {
+    blendSources(src, lengths, blendWeights, count, dst, source->dataLen);
+    return;
   }
 
-  weights[0] = 1.0;
-  if (numSignals == 2) {
-    float interp;
-    if (offXNeg || offYNeg) {
-      interp = (y - listeners[0]->y) / (listeners[1]->y - listeners[0]->y);
+  memset(dst, 0, source->dataLen*sizeof(Sample));
+  for (int i = 0; i < count; i++) {
+    IRSListener* listener = listeners[i];
+    if (src[i] != NULL) {
+      for (int j = 0; j < listener->length; j++) {
+        dst[j] += blendWeights[i]*src[i][j];
+      }
+    } else if (listener->packed != NULL) {
+      samplePack_accumulate(source->file->storage, listener->packed, listener->length, blendWeights[i], dst);
     } else {
-      interp = (x - listeners[0]->x) / (listeners[1]->x - listeners[0]->x);
+      // scaling on the fly costs the same as reading decoded data, and needs no memory
+      accumulateRaw(listener, blendWeights[i]/source->file->maxSample, dst);
     }
-    weights[0] = 1.0 - interp;
-    weights[1] = interp;
-  } else if (numSignals == 4) {
-    float xInterp = (x - listeners[0]->x) / (listeners[1]->x - listeners[0]->x);
-    float yInterp = (y - listeners[0]->y) / (listeners[2]->y - listeners[0]->y);
-    weights[0] = (1-xInterp)*(1-yInterp);
-    weights[1] = xInterp*(1-yInterp);
-    weights[2] = (1-xInterp)*yInterp;
-    weights[3] = xInterp * yInterp;
   }
+}
 
-  free(listeners);
-
-  {
-    int maxLen = 0;
-    for (int i = 0; i < numSignals; i++) {
-      if (lengths[i] > maxLen) {
-        maxLen = lengths[i];
-      }
+void getIRSStorageStats(IRSFile* irsFile, IRSStorageStats* stats) {
+  stats->bytes = 0;
+  stats->decodedBytes = 0;
+  for (int i = 0; i < irsFile->nSources*irsFile->nListeners; i++) {
+    IRSListener* listener = &irsFile->sourceListeners[i];
+    if (listener->packed != NULL) {
+      stats->bytes += samplePack_size(irsFile->storage, listener->length);
+    } else if (listener->raw != NULL) {
+      stats->bytes += listener->length*sizeof(float);
+    } else {
+      // decoded in a scene cache
+      stats->bytes += listener->length*sizeof(Sample);
     }
+    stats->decodedBytes += listener->length*sizeof(Sample);
+  }
+  stats->maxError = irsFile->packMaxError;
+  stats->rmsError = irsFile->packRmsError;
+}
 
-    *dstLen = maxLen;
-    double* newBuf = malloc((*dstLen)*sizeof(double));
-    memset(newBuf, 0, (*dstLen)*sizeof(double));
-    for (int i = 0; i < numSignals; i++) {
-      for (int j = 0; j < lengths[i]; j++) {
-        newBuf[j] += weights[i]*signals[i][j];
-      }
+int getDataLength(IRSSource* source) {
+  return source->dataLen;
+}
+
+int getMaxDataLength(IRSFile* irsFile) {
+  int len = 0;
+  for (int i = 0; i < irsFile->nSources; i++) {
+    if (irsFile->sources[i].dataLen > len) {
+      len = irsFile->sources[i].dataLen;
     }
-    *dst = newBuf;
   }
+  return len;
+}
 
-  free(signals);
-  free(lengths);
-  free(weights);
+int getSpectraLength(IRSSource* source) {
+  return source->spectraLen;
 }
 
-void getListenerData(IRSListener* listener, double** data, int* dataLen) {
-  *dataLen = listener->source->dataLen;
-  *data = listener->data;
+void getInterpolatedSpectra(IRSSource* source, float x, float y, float z, ComplexNum* dst, int* dstLen) {
+  IRSListener* listeners[SPATIALINDEX_MAX_NEIGHBOURS];
+  float weights[SPATIALINDEX_MAX_NEIGHBOURS];
+
+  int numSignals = findInterpolationListeners(source, x, y, z, listeners, weights);
+
+  // the transform is linear, so blending spectra is the same as transforming the blended response
+  // shorter responses have fewer partitions, laid out like the first ones of longer responses
+  const Sample* src[SPATIALINDEX_MAX_NEIGHBOURS];
+  int lengths[SPATIALINDEX_MAX_NEIGHBOURS];
+  Sample blendWeights[SPATIALINDEX_MAX_NEIGHBOURS];
+  int count = 0;
+  int len = 0;
+  for (int i = 0; i < numSignals; i++) {
+    if (weights[i] == 0) {
+      continue;
+    }
+    IRSListener* listener = listeners[i];
+    // blended as interleaved real and imaginary parts
+    src[count] = (const Sample*)listener->spectra;
+    lengths[count] = 2*listener->spectraLen;
+    blendWeights[count] = weights[i];
+    count++;
+    if (listener->length > len) {
+      len = listener->length;
+    }
+  }
+  blendSources(src, lengths, blendWeights, count, (Sample*)dst, 2*source->spectraLen);
+  *dstLen = len;
 }
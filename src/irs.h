@@ -1,14 +1,91 @@
 #ifndef IRS_H
 #define IRS_H
 
+#include "convolve.h"
+#include "samplepack.h"
+
 typedef struct IRSFile_s IRSFile;
 typedef struct IRSListener_s IRSListener;
 typedef struct IRSSource_s IRSSource;
 
+/* How the quiet end of each impulse response is cut off at load
+ */
+typedef enum {
+  IRS_TRIM_NONE,
+  // Cut after the last sample within trimThreshold dB of the response's peak
+  IRS_TRIM_LEVEL,
+  // Cut where the energy still to come is trimThreshold dB below the response's total
+  IRS_TRIM_ENERGY
+} IRSTrimMode;
+
+typedef struct {
+  // When > 0, each listener's impulse response is also stored as convolver partition spectra of this size
+  int spectrumPartitionSize;
+  // Used to compute the spectra
+  FFTPlanCache* plans;
+  // Impulse responses are converted from the file's rate to this one at load, 0 to keep the file's
+  int sampleRate;
+  // Threads that resample and transform the impulse responses, 0 for one per processor
+  int numThreads;
+  // Trimmed responses fade out over a few milliseconds after the cut, sources are as long as their longest
+  IRSTrimMode trimMode;
+  float trimThreshold;
+  // Keep the responses packed in this format and expand them while blending, which takes half
+  // the memory of floats (a quarter of doubles) for an error getIRSStorageStats reports
+  SamplePackFormat storage;
+} IRSLoadOptions;
+
+void getDefaultIRSLoadOptions(IRSLoadOptions* options);
+
+/* The file is memory mapped and kept open until freeIRSFile
+ * Listener impulse responses are only decoded once they're requested
+ */
 IRSFile* loadIRSFile(char* filename);
+IRSFile* loadIRSFileWithOptions(char* filename, IRSLoadOptions* options);
+void freeIRSFile(IRSFile* irsFile);
+
+typedef struct {
+  // Memory the listeners' responses take as stored, and what they'd take decoded to Samples
+  size_t bytes;
+  size_t decodedBytes;
+  // Largest and rms difference packing made to the normalised responses, so relative to the loudest sample
+  double maxError;
+  double rmsError;
+} IRSStorageStats;
+
+void getIRSStorageStats(IRSFile* irsFile, IRSStorageStats* stats);
+
+/* Sources are picked by distance, listeners through the source's spatial index
+ */
 IRSSource* getClosestSource(IRSFile* irsFile, float x, float y, float z);
 IRSListener* getClosestListener(IRSSource* source, float x, float y, float z);
-void getInterpolatedData(IRSSource* source, float x, float y, float z, double** dst, int* dstLen);
-void getListenerData(IRSListener* listener, double** data, int* dataLen);
+
+/* Number of samples in the impulse responses of the source's listeners, the longest of them when trimmed
+ */
+int getDataLength(IRSSource* source);
+
+/* The longest getDataLength of the file's sources
+ */
+int getMaxDataLength(IRSFile* irsFile);
+
+/* Number of ComplexNum in the precomputed spectra of each of the source's listeners, 0 if there are none
+ */
+int getSpectraLength(IRSSource* source);
+
+/* Blends the impulse responses of the listeners around the position
+ * Listeners on a grid are interpolated trilinearly (up to 8 of them), scattered ones by distance
+ */
+void getInterpolatedData(IRSSource* source, float x, float y, float z, Sample** dst, int* dstLen);
+
+/* Same as getInterpolatedData, but writes to dst, which must hold getDataLength(source) samples
+ * dstLen is set to the longest trimmed length of the listeners blended, dst is silent after it
+ * Never allocates, so it's safe to call while processing audio
+ */
+void getInterpolatedDataInto(IRSSource* source, float x, float y, float z, Sample* dst, int* dstLen);
+
+/* Same as getInterpolatedData, but blends the precomputed spectra of the listeners instead
+ * dst must have room for getSpectraLength(source) bins, dstLen is set to the length of the impulse response
+ */
+void getInterpolatedSpectra(IRSSource* source, float x, float y, float z, ComplexNum* dst, int* dstLen);
 
 #endif
@@ -0,0 +1,172 @@
+#ifndef IRS_INTERNAL_H
+#define IRS_INTERNAL_H
+
+/* Layout of .irs files and of loaded scenes
+ * Only for the modules that build or persist scenes, everything else goes through irs.h
+ *
+ * A file is the header, a source section, a listener section and then one data chunk per source and
+ * listener pair, all little endian:
+ * - a section is its header chunk followed by nEntries data chunks, and its size covers the header chunk too
+ * - a data chunk is an IRSDataHeaderChunk followed by the samples as floats, again with size covering both
+ * - every size is a multiple of 4 bytes and may be larger than the contents, the rest is padding and skipped
+ * - data chunks can come in any order, but there has to be exactly one per source and listener pair
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "irs.h"
+#include "mappedfile.h"
+#include "spatialindex.h"
+
+#pragma pack(push,1)
+typedef struct {
+  // Should always contain the text "iSim"
+  char format[4];
+  // File format version
+  int32_t version;
+  // Total size of the header in bytes
+  int32_t headerSize;
+  // The length of the scene in voxels
+  int32_t sizeX;
+  // The height of the scene in voxels
+  int32_t sizeY;
+  // The depth of the scene in voxels
+  int32_t sizeZ;
+  // Number of samples per second
+  int32_t samplingRate;
+  // Speed of sound (voxels/sample)
+  float speedOfSound;
+  // Voxels per metre
+  float scale;
+  // The number of sources in the file
+  int32_t nSources;
+  // The number of listeners in the file
+  int32_t nListeners;
+} IRSHeader;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct {
+  int32_t id;
+  int32_t xPos;
+  int32_t yPos;
+  int32_t zPos;
+} IRSListenerDataChunk;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct {
+  int32_t size;
+  int32_t nEntries;
+} IRSListenerHeaderChunk;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct {
+  int32_t id;
+  int32_t xPos;
+  int32_t yPos;
+  int32_t zPos;
+  int32_t type;
+  int32_t nSamples;
+} IRSSourceDataChunk;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct {
+  int32_t size;
+  int32_t nEntries;
+} IRSSourceHeaderChunk;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct {
+  int32_t size;
+  int32_t sourceId;
+  int32_t listenerId;
+} IRSDataHeaderChunk;
+#pragma pack(pop)
+
+struct IRSListener_s {
+  int id;
+  IRSSource* source;
+  float x;
+  float y;
+  float z;
+  // Samples at the output rate, not normalised, in the mapped file when that's the file's rate
+  const float* raw;
+  // Normalised samples packed in the file's storage format, raw is NULL once they're made
+  const void* packed;
+  // Decoded samples, set at load from a scene cache, NULL otherwise
+  Sample* data;
+  // Partition spectra of data, NULL unless requested at load
+  ComplexNum* spectra;
+  // Samples up to the end of the trimmed response, the fade out starts at fadeStart
+  int length;
+  int fadeStart;
+  // Number of ComplexNum in spectra, which only cover length
+  int spectraLen;
+};
+
+struct IRSSource_s {
+  int id;
+  float x;
+  float y;
+  float z;
+  int nListeners;
+  int dataLen;
+  int spectraLen;
+  IRSListener** listeners;
+  // Neighbour lookup over the positions of listeners
+  SpatialIndex* index;
+  IRSFile* file;
+};
+
+struct IRSFile_s {
+  IRSHeader header;
+  int nSources;
+  int nListeners;
+  IRSSource* sources;
+  // Listener positions as listed in the file
+  IRSListener* listeners;
+  // Per source copies of the listeners that carry the impulse responses, nSources*nListeners
+  IRSListener* sourceListeners;
+  // Open addressing table from listener id to index+1 (0 is empty), idTableSize is a power of 2
+  int* idTable;
+  int idTableSize;
+  // Number of samples per impulse response in the file
+  int rawLen;
+  // Rate the impulse responses were converted to, sources' dataLen are at this rate
+  int sampleRate;
+  // The converted responses of every listener, NULL when the file is already at the output rate
+  float* resampled;
+  // Format of the listeners' packed samples, and the block holding them unless they're mapped
+  SamplePackFormat storage;
+  unsigned char* packed;
+  // Difference packing made, see IRSStorageStats
+  double packMaxError;
+  double packRmsError;
+  // Gains of the fade out at the end of trimmed responses, NULL when nothing is trimmed
+  float* fade;
+  int fadeLen;
+  // Largest absolute sample over all impulse responses, everything is divided by it
+  double maxSample;
+  // The .irs file, or the scene cache it was loaded from
+  MappedFile* map;
+  // Set when listener data and spectra point into the map instead of being allocated
+  bool dataMapped;
+};
+
+/* Rate a file with this header is converted to when loaded with options
+ */
+int getIRSOutputRate(const IRSHeader* header, const IRSLoadOptions* options);
+
+/* Writes the normalised samples of a listener to dst (source->dataLen samples), silent after its length
+ */
+void decodeListenerData(IRSListener* listener, Sample* dst);
+
+/* Builds the spatial index of every source once its listeners are filled in
+ */
+void buildSourceIndexes(IRSFile* irsFile);
+
+#endif
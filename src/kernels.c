@@ -0,0 +1,166 @@
+#include "kernels_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+static void scalar_complexMultiply(ComplexNum* dst, const ComplexNum* x, const ComplexNum* h, int n) {
+  for (int i = 0; i < n; i++) {
+    Sample re = x[i].re * h[i].re - x[i].im * h[i].im;
+    Sample im = x[i].im * h[i].re + x[i].re * h[i].im;
+    dst[i].re = re;
+    dst[i].im = im;
+  }
+}
+
+static void scalar_complexMultiplyAccumulate(ComplexNum* dst, const ComplexNum* x, const ComplexNum* h, int n) {
+  for (int i = 0; i < n; i++) {
+    dst[i].re += x[i].re * h[i].re - x[i].im * h[i].im;
+    dst[i].im += x[i].im * h[i].re + x[i].re * h[i].im;
+  }
+}
+
+static void scalar_weightedSum(Sample* dst, const Sample* const* src, const Sample* weights, int count, int n) {
+  if (count == 0) {
+    memset(dst, 0, n*sizeof(Sample));
+    return;
+  }
+  for (int j = 0; j < n; j++) {
+    dst[j] = weights[0]*src[0][j];
+  }
+  for (int i = 1; i < count; i++) {
+    for (int j = 0; j < n; j++) {
+      dst[j] += weights[i]*src[i][j];
+    }
+  }
+}
+
+static void scalar_scale(Sample* x, Sample gain, int n) {
+  for (int i = 0; i < n; i++) {
+    x[i] *= gain;
+  }
+}
+
+static Sample scalar_peak(const Sample* x, int n, Sample peak) {
+  for (int i = 0; i < n; i++) {
+    if (fabs(x[i]) > peak) {
+      peak = fabs(x[i]);
+    }
+  }
+  return peak;
+}
+
+static void scalar_accumulate(Sample* dst, const float* src, const float* fade, Sample weight, int n) {
+  if (fade == NULL) {
+    for (int i = 0; i < n; i++) {
+      dst[i] += weight*src[i];
+    }
+  } else {
+    for (int i = 0; i < n; i++) {
+      dst[i] += weight*fade[i]*src[i];
+    }
+  }
+}
+
+static void scalar_expandHalf(float* dst, const uint16_t* src, int n) {
+  for (int i = 0; i < n; i++) {
+    dst[i] = kernels_halfToFloat(src[i]);
+  }
+}
+
+static void scalar_expandInt16(float* dst, const int16_t* src, int n) {
+  for (int i = 0; i < n; i++) {
+    dst[i] = src[i];
+  }
+}
+
+static const Kernels scalarKernels = {
+  scalar_complexMultiply,
+  scalar_complexMultiplyAccumulate,
+  scalar_weightedSum,
+  scalar_scale,
+  scalar_peak,
+  scalar_accumulate,
+  scalar_expandHalf,
+  scalar_expandInt16
+};
+
+static const char* levelNames[KERNELS_LEVELS] = {"scalar", "sse2", "avx2", "avx512"};
+
+// The table of a level built into this binary, whether or not the processor supports it
+static const Kernels* levelKernels(KernelLevel level) {
+  switch (level) {
+    case KERNELS_SCALAR:
+      return &scalarKernels;
+#ifdef KERNELS_X86
+    case KERNELS_SSE2:
+      return &kernels_sse2;
+    case KERNELS_AVX2:
+      return &kernels_avx2;
+    case KERNELS_AVX512:
+      return &kernels_avx512;
+#endif
+    default:
+      return NULL;
+  }
+}
+
+static bool supported(KernelLevel level) {
+  switch (level) {
+    case KERNELS_SCALAR:
+      return true;
+#ifdef KERNELS_X86
+    case KERNELS_SSE2:
+      return __builtin_cpu_supports("sse2");
+    case KERNELS_AVX2:
+      return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+    case KERNELS_AVX512:
+      return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("f16c");
+#endif
+    default:
+      return false;
+  }
+}
+
+const Kernels* kernels_getLevel(KernelLevel level) {
+  return supported(level) ? levelKernels(level) : NULL;
+}
+
+const char* kernels_levelName(KernelLevel level) {
+  return level >= 0 && level < KERNELS_LEVELS ? levelNames[level] : "unknown";
+}
+
+// Picked once, racing threads all pick the same level so whichever store lands is fine
+static _Atomic int selectedLevel = -1;
+
+static KernelLevel selectLevel(void) {
+  KernelLevel limit = KERNELS_LEVELS - 1;
+  const char* name = getenv("AUDIOSIM_KERNELS");
+  if (name != NULL) {
+    for (int l = 0; l < KERNELS_LEVELS; l++) {
+      if (strcmp(name, levelNames[l]) == 0) {
+        limit = l;
+      }
+    }
+  }
+  KernelLevel level = limit;
+  while (level > KERNELS_SCALAR && !supported(level)) {
+    level--;
+  }
+  return level;
+}
+
+KernelLevel kernels_level(void) {
+  int level = atomic_load_explicit(&selectedLevel, memory_order_relaxed);
+  if (level < 0) {
+    level = selectLevel();
+    atomic_store_explicit(&selectedLevel, level, memory_order_relaxed);
+  }
+  return level;
+}
+
+const Kernels* kernels_get(void) {
+  return levelKernels(kernels_level());
+}
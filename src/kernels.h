@@ -0,0 +1,51 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdint.h>
+#include "sample.h"
+#include "convolve.h"
+
+/* The inner loops of the processing, with versions for each x86 vector extension
+ * The best version the processor supports is picked the first time they're used, the environment
+ * variable AUDIOSIM_KERNELS (scalar, sse2, avx2 or avx512) picks a lower one instead. The AVX2 and
+ * AVX-512 versions use fused multiply-adds, so they can differ from the scalar ones in the last bit.
+ */
+typedef enum {
+  KERNELS_SCALAR,
+  KERNELS_SSE2,
+  // AVX2 with FMA
+  KERNELS_AVX2,
+  KERNELS_AVX512,
+  KERNELS_LEVELS
+} KernelLevel;
+
+typedef struct {
+  // dst = x*h, dst may be x
+  void (*complexMultiply)(ComplexNum* dst, const ComplexNum* x, const ComplexNum* h, int n);
+  // dst += x*h
+  void (*complexMultiplyAccumulate)(ComplexNum* dst, const ComplexNum* x, const ComplexNum* h, int n);
+  // dst[j] = sum of weights[i]*src[i][j] over the count sources, summed in order
+  void (*weightedSum)(Sample* dst, const Sample* const* src, const Sample* weights, int count, int n);
+  // x *= gain
+  void (*scale)(Sample* x, Sample gain, int n);
+  // The larger of peak and the largest absolute value of x
+  Sample (*peak)(const Sample* x, int n, Sample peak);
+  // dst += weight*src, also times fade when it isn't NULL
+  void (*accumulate)(Sample* dst, const float* src, const float* fade, Sample weight, int n);
+  // dst = the IEEE half floats in src, the AVX2 and AVX-512 versions convert them with F16C
+  void (*expandHalf)(float* dst, const uint16_t* src, int n);
+  // dst = the 16 bit integers in src
+  void (*expandInt16)(float* dst, const int16_t* src, int n);
+} Kernels;
+
+/* The kernels in use
+ */
+const Kernels* kernels_get(void);
+KernelLevel kernels_level(void);
+
+/* The kernels of a level, NULL if the processor or the compiler doesn't support it
+ */
+const Kernels* kernels_getLevel(KernelLevel level);
+const char* kernels_levelName(KernelLevel level);
+
+#endif
@@ -0,0 +1,52 @@
+#include "kernels_internal.h"
+
+#ifdef KERNELS_X86
+#pragma GCC target("avx2,fma,f16c")
+#include <math.h>
+#include <immintrin.h>
+
+#define KERNEL(name) avx2_##name
+#define KERNELS_TABLE kernels_avx2
+#define KERNELS_F16C
+
+#ifdef AUDIOSIM_FLOAT
+#define VEC __m256
+#define VLANES 8
+#define VLOAD _mm256_loadu_ps
+#define VSTORE _mm256_storeu_ps
+#define VSET1 _mm256_set1_ps
+#define VADD _mm256_add_ps
+#define VMUL _mm256_mul_ps
+#define VMAX _mm256_max_ps
+#define VABS(a) _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a)
+#define VFMADD _mm256_fmadd_ps
+#define VLOADF VLOAD
+
+// re = xr*hr - xi*hi, im = xi*hr + xr*hi, fmaddsub subtracts in the even (real) lanes and adds in the odd
+static inline __m256 complexMultiply(__m256 x, __m256 h) {
+  __m256 swapped = _mm256_permute_ps(x, 0xb1);
+  return _mm256_fmaddsub_ps(x, _mm256_moveldup_ps(h), _mm256_mul_ps(swapped, _mm256_movehdup_ps(h)));
+}
+#else
+#define VEC __m256d
+#define VLANES 4
+#define VLOAD _mm256_loadu_pd
+#define VSTORE _mm256_storeu_pd
+#define VSET1 _mm256_set1_pd
+#define VADD _mm256_add_pd
+#define VMUL _mm256_mul_pd
+#define VMAX _mm256_max_pd
+#define VABS(a) _mm256_andnot_pd(_mm256_set1_pd(-0.0), a)
+#define VFMADD _mm256_fmadd_pd
+#define VLOADF(p) _mm256_cvtps_pd(_mm_loadu_ps(p))
+
+// re = xr*hr - xi*hi, im = xi*hr + xr*hi, fmaddsub subtracts in the even (real) lanes and adds in the odd
+static inline __m256d complexMultiply(__m256d x, __m256d h) {
+  __m256d swapped = _mm256_permute_pd(x, 0x5);
+  return _mm256_fmaddsub_pd(x, _mm256_movedup_pd(h), _mm256_mul_pd(swapped, _mm256_permute_pd(h, 0xf)));
+}
+#endif
+#define VCMUL complexMultiply
+
+#include "kernels_template.h"
+#endif
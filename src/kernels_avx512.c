@@ -0,0 +1,52 @@
+#include "kernels_internal.h"
+
+#ifdef KERNELS_X86
+#pragma GCC target("avx512f,f16c")
+#include <math.h>
+#include <immintrin.h>
+
+#define KERNEL(name) avx512_##name
+#define KERNELS_TABLE kernels_avx512
+#define KERNELS_F16C
+
+#ifdef AUDIOSIM_FLOAT
+#define VEC __m512
+#define VLANES 16
+#define VLOAD _mm512_loadu_ps
+#define VSTORE _mm512_storeu_ps
+#define VSET1 _mm512_set1_ps
+#define VADD _mm512_add_ps
+#define VMUL _mm512_mul_ps
+#define VMAX _mm512_max_ps
+#define VABS _mm512_abs_ps
+#define VFMADD _mm512_fmadd_ps
+#define VLOADF VLOAD
+
+// re = xr*hr - xi*hi, im = xi*hr + xr*hi, fmaddsub subtracts in the even (real) lanes and adds in the odd
+static inline __m512 complexMultiply(__m512 x, __m512 h) {
+  __m512 swapped = _mm512_permute_ps(x, 0xb1);
+  return _mm512_fmaddsub_ps(x, _mm512_moveldup_ps(h), _mm512_mul_ps(swapped, _mm512_movehdup_ps(h)));
+}
+#else
+#define VEC __m512d
+#define VLANES 8
+#define VLOAD _mm512_loadu_pd
+#define VSTORE _mm512_storeu_pd
+#define VSET1 _mm512_set1_pd
+#define VADD _mm512_add_pd
+#define VMUL _mm512_mul_pd
+#define VMAX _mm512_max_pd
+#define VABS _mm512_abs_pd
+#define VFMADD _mm512_fmadd_pd
+#define VLOADF(p) _mm512_cvtps_pd(_mm256_loadu_ps(p))
+
+// re = xr*hr - xi*hi, im = xi*hr + xr*hi, fmaddsub subtracts in the even (real) lanes and adds in the odd
+static inline __m512d complexMultiply(__m512d x, __m512d h) {
+  __m512d swapped = _mm512_permute_pd(x, 0x55);
+  return _mm512_fmaddsub_pd(x, _mm512_movedup_pd(h), _mm512_mul_pd(swapped, _mm512_permute_pd(h, 0xff)));
+}
+#endif
+#define VCMUL complexMultiply
+
+#include "kernels_template.h"
+#endif
@@ -0,0 +1,36 @@
+#ifndef KERNELS_INTERNAL_H
+#define KERNELS_INTERNAL_H
+
+#include <stdint.h>
+#include <string.h>
+#include "kernels.h"
+
+/* Vector versions are built with GCC compatible compilers for x86, each file compiles its own
+ * instruction set through a target pragma, so nothing needs special flags
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86 1
+
+extern const Kernels kernels_sse2;
+extern const Kernels kernels_avx2;
+extern const Kernels kernels_avx512;
+#endif
+
+// Selects with masks rather than branches, which tails of small samples of random sign would mispredict
+// Infinities and NaNs come out as large numbers, normalised samples are never either
+static inline float kernels_halfToFloat(uint16_t h) {
+  uint32_t magnitude = h & 0x7fff;
+  // shifted into place, the exponent only needs rebiasing from 15 to 127
+  uint32_t normal = (magnitude << 13) + (112 << 23);
+  // subnormals count steps of 2^-24
+  float subnormalValue = (int32_t)magnitude*(1.0f/16777216.0f);
+  uint32_t subnormal;
+  memcpy(&subnormal, &subnormalValue, sizeof(subnormal));
+  uint32_t isNormal = -(uint32_t)(magnitude >= 0x400);
+  uint32_t bits = ((uint32_t)(h & 0x8000) << 16) | (normal & isNormal) | (subnormal & ~isNormal);
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+#endif
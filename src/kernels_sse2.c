@@ -0,0 +1,57 @@
+#include "kernels_internal.h"
+
+#ifdef KERNELS_X86
+#pragma GCC target("sse2")
+#include <math.h>
+#include <immintrin.h>
+
+#define KERNEL(name) sse2_##name
+#define KERNELS_TABLE kernels_sse2
+
+#ifdef AUDIOSIM_FLOAT
+#define VEC __m128
+#define VLANES 4
+#define VLOAD _mm_loadu_ps
+#define VSTORE _mm_storeu_ps
+#define VSET1 _mm_set1_ps
+#define VADD _mm_add_ps
+#define VMUL _mm_mul_ps
+#define VMAX _mm_max_ps
+#define VABS(a) _mm_andnot_ps(_mm_set1_ps(-0.0f), a)
+#define VFMADD(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#define VLOADF VLOAD
+
+// Without addsub the cross terms get their signs from a mask, re = xr*hr - xi*hi, im = xi*hr + xr*hi
+static inline __m128 complexMultiply(__m128 x, __m128 h) {
+  __m128 hr = _mm_shuffle_ps(h, h, _MM_SHUFFLE(2, 2, 0, 0));
+  __m128 hi = _mm_shuffle_ps(h, h, _MM_SHUFFLE(3, 3, 1, 1));
+  __m128 swapped = _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1));
+  __m128 cross = _mm_xor_ps(_mm_mul_ps(swapped, hi), _mm_set_ps(0.0f, -0.0f, 0.0f, -0.0f));
+  return _mm_add_ps(_mm_mul_ps(x, hr), cross);
+}
+#else
+#define VEC __m128d
+#define VLANES 2
+#define VLOAD _mm_loadu_pd
+#define VSTORE _mm_storeu_pd
+#define VSET1 _mm_set1_pd
+#define VADD _mm_add_pd
+#define VMUL _mm_mul_pd
+#define VMAX _mm_max_pd
+#define VABS(a) _mm_andnot_pd(_mm_set1_pd(-0.0), a)
+#define VFMADD(a, b, c) _mm_add_pd(_mm_mul_pd(a, b), c)
+#define VLOADF(p) _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(p))))
+
+// Without addsub the cross terms get their signs from a mask, re = xr*hr - xi*hi, im = xi*hr + xr*hi
+static inline __m128d complexMultiply(__m128d x, __m128d h) {
+  __m128d hr = _mm_unpacklo_pd(h, h);
+  __m128d hi = _mm_unpackhi_pd(h, h);
+  __m128d swapped = _mm_shuffle_pd(x, x, 1);
+  __m128d cross = _mm_xor_pd(_mm_mul_pd(swapped, hi), _mm_set_pd(0.0, -0.0));
+  return _mm_add_pd(_mm_mul_pd(x, hr), cross);
+}
+#endif
+#define VCMUL complexMultiply
+
+#include "kernels_template.h"
+#endif
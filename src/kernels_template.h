@@ -0,0 +1,170 @@
+/* Body of the vector kernels, included once by each instruction set's file after it defines:
+ *   KERNEL(name)          the name of this version of kernel name
+ *   VEC, VLANES           the vector type and how many Samples it holds
+ *   VLOAD(p), VSTORE(p, v), VSET1(x), VADD(a, b), VMUL(a, b), VMAX(a, b), VABS(a)
+ *   VLOADF(p)             VLANES floats from p converted to Samples
+ *   VFMADD(a, b, c)       a*b + c
+ *   VCMUL(x, h)           the complex products of interleaved x and h
+ *   KERNELS_TABLE         the name of the Kernels table to define
+ *   KERNELS_F16C          defined when half floats can be converted with F16C
+ * Tails shorter than a vector are done one at a time. The expansions of packed samples are the same
+ * 128 bit code at every level, SSE2 is always there and F16C where the level has it.
+ */
+
+#include <string.h>
+
+static void KERNEL(complexMultiply)(ComplexNum* dst, const ComplexNum* x, const ComplexNum* h, int n) {
+  int i = 0;
+  for (; i + VLANES/2 <= n; i += VLANES/2) {
+    VSTORE((Sample*)(dst + i), VCMUL(VLOAD((const Sample*)(x + i)), VLOAD((const Sample*)(h + i))));
+  }
+  for (; i < n; i++) {
+    Sample re = x[i].re * h[i].re - x[i].im * h[i].im;
+    Sample im = x[i].im * h[i].re + x[i].re * h[i].im;
+    dst[i].re = re;
+    dst[i].im = im;
+  }
+}
+
+static void KERNEL(complexMultiplyAccumulate)(ComplexNum* dst, const ComplexNum* x, const ComplexNum* h, int n) {
+  int i = 0;
+  for (; i + VLANES/2 <= n; i += VLANES/2) {
+    Sample* d = (Sample*)(dst + i);
+    VSTORE(d, VADD(VLOAD(d), VCMUL(VLOAD((const Sample*)(x + i)), VLOAD((const Sample*)(h + i)))));
+  }
+  for (; i < n; i++) {
+    dst[i].re += x[i].re * h[i].re - x[i].im * h[i].im;
+    dst[i].im += x[i].im * h[i].re + x[i].re * h[i].im;
+  }
+}
+
+static void KERNEL(weightedSum)(Sample* dst, const Sample* const* src, const Sample* weights, int count, int n) {
+  if (count == 0) {
+    memset(dst, 0, n*sizeof(Sample));
+    return;
+  }
+  int j = 0;
+  for (; j + VLANES <= n; j += VLANES) {
+    VEC sum = VMUL(VSET1(weights[0]), VLOAD(src[0] + j));
+    for (int i = 1; i < count; i++) {
+      sum = VFMADD(VSET1(weights[i]), VLOAD(src[i] + j), sum);
+    }
+    VSTORE(dst + j, sum);
+  }
+  for (; j < n; j++) {
+    Sample sum = weights[0]*src[0][j];
+    for (int i = 1; i < count; i++) {
+      sum += weights[i]*src[i][j];
+    }
+    dst[j] = sum;
+  }
+}
+
+static void KERNEL(scale)(Sample* x, Sample gain, int n) {
+  VEC g = VSET1(gain);
+  int i = 0;
+  for (; i + VLANES <= n; i += VLANES) {
+    VSTORE(x + i, VMUL(VLOAD(x + i), g));
+  }
+  for (; i < n; i++) {
+    x[i] *= gain;
+  }
+}
+
+static Sample KERNEL(peak)(const Sample* x, int n, Sample peak) {
+  VEC m = VSET1(peak);
+  int i = 0;
+  for (; i + VLANES <= n; i += VLANES) {
+    // m second, so NaNs are skipped like the scalar comparison does
+    m = VMAX(VABS(VLOAD(x + i)), m);
+  }
+  Sample lanes[VLANES];
+  VSTORE(lanes, m);
+  for (int k = 0; k < VLANES; k++) {
+    if (lanes[k] > peak) {
+      peak = lanes[k];
+    }
+  }
+  for (; i < n; i++) {
+    if (fabs(x[i]) > peak) {
+      peak = fabs(x[i]);
+    }
+  }
+  return peak;
+}
+
+static void KERNEL(accumulate)(Sample* dst, const float* src, const float* fade, Sample weight, int n) {
+  VEC w = VSET1(weight);
+  int i = 0;
+  if (fade == NULL) {
+    for (; i + VLANES <= n; i += VLANES) {
+      VSTORE(dst + i, VFMADD(w, VLOADF(src + i), VLOAD(dst + i)));
+    }
+    for (; i < n; i++) {
+      dst[i] += weight*src[i];
+    }
+  } else {
+    for (; i + VLANES <= n; i += VLANES) {
+      VSTORE(dst + i, VFMADD(VMUL(w, VLOADF(fade + i)), VLOADF(src + i), VLOAD(dst + i)));
+    }
+    for (; i < n; i++) {
+      dst[i] += weight*fade[i]*src[i];
+    }
+  }
+}
+
+#ifndef KERNELS_F16C
+// kernels_halfToFloat on four halves zero extended to 32 bits
+static inline __m128 KERNEL(halfToFloat4)(__m128i h) {
+  __m128i magnitude = _mm_and_si128(h, _mm_set1_epi32(0x7fff));
+  __m128i normal = _mm_add_epi32(_mm_slli_epi32(magnitude, 13), _mm_set1_epi32(112 << 23));
+  __m128i subnormal = _mm_castps_si128(_mm_mul_ps(_mm_cvtepi32_ps(magnitude), _mm_set1_ps(1.0f/16777216.0f)));
+  __m128i isNormal = _mm_cmpgt_epi32(magnitude, _mm_set1_epi32(0x3ff));
+  __m128i sign = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16);
+  __m128i bits = _mm_or_si128(_mm_and_si128(isNormal, normal), _mm_andnot_si128(isNormal, subnormal));
+  return _mm_castsi128_ps(_mm_or_si128(sign, bits));
+}
+#endif
+
+static void KERNEL(expandHalf)(float* dst, const uint16_t* src, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+#ifdef KERNELS_F16C
+    _mm_storeu_ps(dst + i, _mm_cvtph_ps(v));
+    _mm_storeu_ps(dst + i + 4, _mm_cvtph_ps(_mm_unpackhi_epi64(v, v)));
+#else
+    _mm_storeu_ps(dst + i, KERNEL(halfToFloat4)(_mm_unpacklo_epi16(v, _mm_setzero_si128())));
+    _mm_storeu_ps(dst + i + 4, KERNEL(halfToFloat4)(_mm_unpackhi_epi16(v, _mm_setzero_si128())));
+#endif
+  }
+  for (; i < n; i++) {
+    dst[i] = kernels_halfToFloat(src[i]);
+  }
+}
+
+static void KERNEL(expandInt16)(float* dst, const int16_t* src, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    // each 16 bit value into the top of a 32 bit lane, shifted down with its sign
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(lo));
+    _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(hi));
+  }
+  for (; i < n; i++) {
+    dst[i] = src[i];
+  }
+}
+
+const Kernels KERNELS_TABLE = {
+  KERNEL(complexMultiply),
+  KERNEL(complexMultiplyAccumulate),
+  KERNEL(weightedSum),
+  KERNEL(scale),
+  KERNEL(peak),
+  KERNEL(accumulate),
+  KERNEL(expandHalf),
+  KERNEL(expandInt16)
+};
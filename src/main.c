@@ -2,122 +2,507 @@
 #include <stdio.h>
 #include <sndfile.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <stdbool.h>
 #include "convolve.h"
 #include "AudioSim.h"
+#include "threadpool.h"
 
+#ifdef AUDIOSIM_FLOAT
+#define sf_readf_sample sf_readf_float
+#define sf_writef_sample sf_writef_float
+#else
+#define sf_readf_sample sf_readf_double
+#define sf_writef_sample sf_writef_double
+#endif
+
+// Frames read, convolved and written at a time, memory use doesn't depend on the length of the input
+#define BLOCK_FRAMES 4096
+// Frames a moving emitter stays at one position for, positions are taken at the middle of each run
+#define TRAJECTORY_FRAMES 256
+// Longest line of a batch script
+#define SCRIPT_LINE 1024
+
+double wallTime() {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Running comparison with a reference render of the same input, eg. one made by a double precision build
 typedef struct {
   SNDFILE* sf;
   SF_INFO info;
-  ComplexNum* data;
-} SoundFile;
+  Sample* buf;
+  double peak;
+  double maxErr;
+  double sumSqErr;
+  long count;
+} Reference;
 
-SoundFile* myLoadSound(char* fileName) {
-  SoundFile* file = malloc(sizeof(SoundFile));
-  file->info.format = 0;
-  file->sf = sf_open(fileName,SFM_READ,&(file->info));
-  if (file->sf == NULL) {
-    printf("Failed to open the file.\n");
-    exit(-1);
+Reference* openReference(char* referenceName) {
+  Reference* ref = malloc(sizeof(Reference));
+  ref->info.format = 0;
+  ref->sf = sf_open(referenceName, SFM_READ, &ref->info);
+  if (ref->sf == NULL) {
+    printf("Failed to open the reference %s.\n", referenceName);
+    free(ref);
+    return NULL;
   }
+  ref->buf = malloc(BLOCK_FRAMES*ref->info.channels*sizeof(Sample));
+  ref->peak = 0;
+  ref->maxErr = 0;
+  ref->sumSqErr = 0;
+  ref->count = 0;
+  return ref;
+}
 
-  file->data = malloc(file->info.frames*sizeof(ComplexNum));
+// Compares the channels both have of the next frames of the render
+void compareBlock(Reference* ref, Sample* rendered, int frames, int channels) {
+  int n = (int)sf_readf_sample(ref->sf, ref->buf, frames);
+  int shared = channels < ref->info.channels ? channels : ref->info.channels;
+  for (int i = 0; i < n; i++) {
+    for (int c = 0; c < shared; c++) {
+      double expected = ref->buf[i*ref->info.channels + c];
+      double err = fabs((double)rendered[i*channels + c] - expected);
+      if (err > ref->maxErr) {
+        ref->maxErr = err;
+      }
+      if (fabs(expected) > ref->peak) {
+        ref->peak = fabs(expected);
+      }
+      ref->sumSqErr += err*err;
+      ref->count++;
+    }
+  }
+}
 
-  int totalFrames = file->info.frames*file->info.channels;
-  double* buf = malloc(totalFrames*sizeof(double));
-  sf_readf_double(file->sf, buf, totalFrames);
+void closeReference(Reference* ref, char* referenceName) {
+  double rmsErr = ref->count > 0 ? sqrt(ref->sumSqErr/ref->count) : 0;
+  printf("Error vs %s: max %g (%.1f dB below peak), rms %g\n", referenceName, ref->maxErr, 20*log10(ref->peak/(ref->maxErr+1e-300)), rmsErr);
+  sf_close(ref->sf);
+  free(ref->buf);
+  free(ref);
+}
 
-  for (int i = 0; i < file->info.frames; i++) {
-    if (file->info.channels > 0) {
-      file->data[i].re = buf[i*file->info.channels];
-    }
-    file->data[i].im = 0;
+// Where an emitter is at a time, positions between keyframes are interpolated linearly
+typedef struct {
+  double time;
+  float x;
+  float y;
+  float z;
+} Keyframe;
+
+// Position at time t of the nKeys keyframes in time order, held before the first and after the last
+void trajectoryPosition(const Keyframe* keys, int nKeys, double t, float* x, float* y, float* z) {
+  int i = 0;
+  while (i + 1 < nKeys && keys[i + 1].time <= t) {
+    i++;
+  }
+  if (i + 1 == nKeys || t <= keys[i].time) {
+    *x = keys[i].x;
+    *y = keys[i].y;
+    *z = keys[i].z;
+    return;
+  }
+  float f = (float)((t - keys[i].time)/(keys[i + 1].time - keys[i].time));
+  *x = keys[i].x + f*(keys[i + 1].x - keys[i].x);
+  *y = keys[i].y + f*(keys[i + 1].y - keys[i].y);
+  *z = keys[i].z + f*(keys[i + 1].z - keys[i].z);
+}
+
+/* Convolves every channel of the input with the response along the trajectory of nKeys keyframes and
+ * writes them to outName as they're done
+ * The output goes on past the end of the input until the response's tail has died out
+ * Returns the seconds of audio written, or -1 if a file couldn't be opened
+ */
+double renderFile(AudioSim* sim, char* inName, char* outName, const Keyframe* keys, int nKeys, char* referenceName) {
+  SF_INFO info;
+  info.format = 0;
+  SNDFILE* in = sf_open(inName, SFM_READ, &info);
+  if (in == NULL) {
+    printf("Failed to open %s.\n", inName);
+    return -1;
   }
+  printf("Loaded %s: channels: %d, sRate: %d, frames: %d\n", inName, info.channels, info.samplerate, (int)info.frames);
 
-  printf("Loaded %s: channels: %d, sRate: %d, frames: %d\n", fileName, file->info.channels, file->info.samplerate, file->info.frames);
+  SF_INFO outInfo = info;
+  SNDFILE* out = sf_open(outName, SFM_WRITE, &outInfo);
+  if (out == NULL) {
+    printf("Failed to open %s for writing.\n", outName);
+    sf_close(in);
+    return -1;
+  }
 
-  free(buf);
+  Reference* ref = NULL;
+  if (referenceName != NULL) {
+    ref = openReference(referenceName);
+  }
 
-  sf_close(file->sf);
+  // every channel is its own stream at the same position, normalised together by one peak so the
+  // balance between them stays as it was
+  int channels = info.channels;
+  double peak = 1.0;
+  float x, y, z;
+  trajectoryPosition(keys, nKeys, 0, &x, &y, &z);
+  AudioStream** streams = malloc(channels*sizeof(AudioStream*));
+  for (int c = 0; c < channels; c++) {
+    streams[c] = audioSim_initStream(sim, x, y, z);
+  }
+  // a fixed emitter is convolved a whole block at a time
+  int step = nKeys > 1 ? TRAJECTORY_FRAMES : BLOCK_FRAMES;
+  Sample* frames = malloc(BLOCK_FRAMES*channels*sizeof(Sample));
+  Sample* src = malloc(BLOCK_FRAMES*sizeof(Sample));
+  Sample* dst = malloc(BLOCK_FRAMES*sizeof(Sample));
 
-  return file;
+  long written = 0;
+  long tailLeft = audioSim_getStreamTailLength(streams[0]);
+  bool inputDone = false;
+  while (!inputDone || tailLeft > 0) {
+    int len = 0;
+    if (!inputDone) {
+      len = (int)sf_readf_sample(in, frames, BLOCK_FRAMES);
+      inputDone = len < BLOCK_FRAMES;
+    }
+    // once the input has ended the rest of the block is silence, fed in until the tail has played
+    if (inputDone) {
+      int pad = BLOCK_FRAMES - len;
+      if (pad > tailLeft) {
+        pad = tailLeft;
+      }
+      memset(frames + len*channels, 0, pad*channels*sizeof(Sample));
+      len += pad;
+      tailLeft -= pad;
+    }
+
+    for (int start = 0; start < len; start += step) {
+      int n = len - start < step ? len - start : step;
+      trajectoryPosition(keys, nKeys, (written + start + 0.5*n)/info.samplerate, &x, &y, &z);
+      Sample* stepFrames = frames + start*channels;
+      for (int c = 0; c < channels; c++) {
+        for (int i = 0; i < n; i++) {
+          src[i] = stepFrames[i*channels + c];
+        }
+        audioSim_processStream(streams[c], x, y, z, dst, src, n);
+        for (int i = 0; i < n; i++) {
+          stepFrames[i*channels + c] = dst[i];
+        }
+      }
+      audioSim_normalise(stepFrames, n*channels, &peak);
+    }
+
+    sf_writef_sample(out, frames, len);
+    if (ref != NULL) {
+      compareBlock(ref, frames, len, channels);
+    }
+    written += len;
+  }
+
+  if (ref != NULL) {
+    closeReference(ref, referenceName);
+  }
+  for (int c = 0; c < channels; c++) {
+    audioSim_destroyStream(streams[c]);
+  }
+  free(streams);
+  free(frames);
+  free(src);
+  free(dst);
+  sf_close(out);
+  sf_close(in);
+
+  printf("Wrote %s: %ld frames\n", outName, written);
+  return (double)written/info.samplerate;
 }
 
-void myFreeSound(SoundFile* s) {
-  if (s->data != NULL) {
-    free(s->data);
+// Where the processing time went
+void printStats(AudioSim* sim) {
+  AudioSimStats stats;
+  audioSim_getStats(sim, &stats);
+  double total = 0;
+  for (int i = 0; i < AUDIOSIM_STAGE_COUNT; i++) {
+    total += stats.stages[i].seconds;
+  }
+  for (int i = 0; i < AUDIOSIM_STAGE_COUNT; i++) {
+    printf("  %-12s %8.3fs %5.1f%%\n", audioSim_stageName(i), stats.stages[i].seconds, total > 0 ? 100*stats.stages[i].seconds/total : 0);
+  }
+  AudioSimBlockStats* blocks = &stats.streamBlocks;
+  printf("  %ld blocks, %ld over the deadline, longest %.3fms, mean %.3fms\n", blocks->blocks, blocks->overruns,
+      blocks->maxSeconds*1e3, blocks->blocks > 0 ? blocks->totalSeconds*1e3/blocks->blocks : 0);
+  printf("  impulse responses %.1f MB (%.1f MB as samples)", stats.irBytes/1048576.0, stats.irDecodedBytes/1048576.0);
+  if (stats.irStorageMaxError > 0) {
+    printf(", storage error %.1f dB max, %.1f dB rms", 20*log10(stats.irStorageMaxError), 20*log10(stats.irStorageRmsError));
   }
-  free(s);
+  printf("\n");
 }
 
-void writeWav(char* wavName, SF_INFO info, double* left) {
-  int doubles = info.frames*info.channels;
-  double* buf = left;
-  SNDFILE* file = sf_open(wavName,SFM_WRITE,&(info));
-  printf("writing %p %d\n", file, doubles);
-  sf_writef_double(file, buf, doubles);
-  sf_close(file);
+// True when the whole argument is a number, which ends the list of input files
+bool isNumber(char* arg) {
+  char* end;
+  strtod(arg, &end);
+  return end != arg && *end == '\0';
 }
 
-int main(int argc, char** argv) {
-  SNDFILE *sf;
-  SF_INFO info;
-  int num_channels;
-  int num, num_items;
-  int *buf;
-  int f,sr,c;
-  int i,j;
-  FILE *out;
+// One render of a batch, reading inName and writing outName along its trajectory
+typedef struct {
+  // Index of its scene
+  int scene;
+  char* inName;
+  char* outName;
+  Keyframe* keys;
+  int nKeys;
+  int keyCapacity;
+  // Seconds of audio written, -1 if it failed
+  double seconds;
+} BatchJob;
 
-  int argCount = 1;
+// A scene loaded once for all the jobs that use it
+typedef struct {
+  char* irsName;
+  AudioSim* sim;
+} BatchScene;
 
-  AudioSim* sim = audioSim_init(argv[argCount]);
-  argCount += 1;
+typedef struct {
+  BatchJob* jobs;
+  int nJobs;
+  int jobCapacity;
+  BatchScene* scenes;
+  int nScenes;
+} Batch;
 
-  AudioStream* stream = audioSim_initStream(sim, 0, 0, 0);
+static char* copyString(const char* s) {
+  char* copy = malloc(strlen(s) + 1);
+  strcpy(copy, s);
+  return copy;
+}
 
-  SoundFile* speechFile = myLoadSound(argv[argCount]);
-  argCount += 1;
+static void freeBatch(Batch* batch) {
+  for (int i = 0; i < batch->nJobs; i++) {
+    free(batch->jobs[i].inName);
+    free(batch->jobs[i].outName);
+    free(batch->jobs[i].keys);
+  }
+  for (int i = 0; i < batch->nScenes; i++) {
+    if (batch->scenes[i].sim != NULL) {
+      audioSim_destroy(batch->scenes[i].sim);
+    }
+    free(batch->scenes[i].irsName);
+  }
+  free(batch->jobs);
+  free(batch->scenes);
+}
 
-  {
-    const int BUFSIZE = 44100;
-    // I'm setting this as 2x the speech file so that you can hear the echo
-    // In a real-time scenario, you would just feed 0s to the modify function
-    const int amountToModify = 2*speechFile->info.frames;
-    double* buf = malloc(amountToModify*sizeof(double));
-    int count = 0;
-    double* dstTmp = malloc(BUFSIZE*sizeof(double));
-    double* srcTmp = malloc(BUFSIZE*sizeof(double));
-
-    while (count < amountToModify) {
-      int samples = BUFSIZE;
-      if (count > amountToModify - BUFSIZE) {
-        samples = amountToModify - count;
+// The index of the scene irsName, added if it's new
+static int batchScene(Batch* batch, const char* irsName) {
+  for (int i = 0; i < batch->nScenes; i++) {
+    if (strcmp(batch->scenes[i].irsName, irsName) == 0) {
+      return i;
+    }
+  }
+  batch->scenes = realloc(batch->scenes, (batch->nScenes + 1)*sizeof(BatchScene));
+  batch->scenes[batch->nScenes].irsName = copyString(irsName);
+  batch->scenes[batch->nScenes].sim = NULL;
+  return batch->nScenes++;
+}
+
+/* Reads a batch script, a job line starts each job and the keyframe lines after it give its trajectory
+ *   job scene.irs input.wav output.wav
+ *   at seconds x y z
+ * Keyframes must be in time order, blank lines and lines starting with # are skipped, and names
+ * can't contain spaces. Returns false after printing where the script is wrong.
+ */
+static bool readBatchScript(char* scriptName, Batch* batch) {
+  FILE* f = fopen(scriptName, "r");
+  if (f == NULL) {
+    printf("Failed to open %s.\n", scriptName);
+    return false;
+  }
+  char line[SCRIPT_LINE];
+  int lineNumber = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f) != NULL) {
+    lineNumber++;
+    char word[16];
+    if (sscanf(line, "%15s", word) != 1 || word[0] == '#') {
+      continue;
+    }
+    if (strcmp(word, "job") == 0) {
+      char irsName[SCRIPT_LINE], inName[SCRIPT_LINE], outName[SCRIPT_LINE];
+      if (sscanf(line, "%*s %s %s %s", irsName, inName, outName) != 3) {
+        printf("%s:%d: expected job scene.irs input.wav output.wav\n", scriptName, lineNumber);
+        ok = false;
+        break;
       }
-      for (int i = 0; i < BUFSIZE; i++) {
-        if (count + i < speechFile->info.frames) {
-          srcTmp[i] = speechFile->data[count+i].re;
+      if (batch->nJobs == batch->jobCapacity) {
+        batch->jobCapacity = batch->jobCapacity > 0 ? 2*batch->jobCapacity : 16;
+        batch->jobs = realloc(batch->jobs, batch->jobCapacity*sizeof(BatchJob));
+      }
+      BatchJob* job = &batch->jobs[batch->nJobs];
+      job->scene = batchScene(batch, irsName);
+      job->inName = copyString(inName);
+      job->outName = copyString(outName);
+      job->keys = NULL;
+      job->nKeys = 0;
+      job->keyCapacity = 0;
+      job->seconds = -1;
+      batch->nJobs++;
+    } else if (strcmp(word, "at") == 0) {
+      Keyframe key;
+      if (sscanf(line, "%*s %lf %f %f %f", &key.time, &key.x, &key.y, &key.z) != 4) {
+        printf("%s:%d: expected at seconds x y z\n", scriptName, lineNumber);
+        ok = false;
+      } else if (batch->nJobs == 0) {
+        printf("%s:%d: keyframe before any job\n", scriptName, lineNumber);
+        ok = false;
+      } else {
+        BatchJob* job = &batch->jobs[batch->nJobs - 1];
+        if (job->nKeys > 0 && key.time < job->keys[job->nKeys - 1].time) {
+          printf("%s:%d: keyframes must be in time order\n", scriptName, lineNumber);
+          ok = false;
         } else {
-          srcTmp[i] = 0;
+          if (job->nKeys == job->keyCapacity) {
+            job->keyCapacity = job->keyCapacity > 0 ? 2*job->keyCapacity : 4;
+            job->keys = realloc(job->keys, job->keyCapacity*sizeof(Keyframe));
+          }
+          job->keys[job->nKeys++] = key;
         }
       }
-      audioSim_modifyStream(stream, atof(argv[argCount]), atof(argv[argCount+1]), atof(argv[argCount+2]), buf+count, srcTmp, samples);
+    } else {
+      printf("%s:%d: unknown line %s\n", scriptName, lineNumber, word);
+      ok = false;
+    }
+  }
+  fclose(f);
+  for (int i = 0; ok && i < batch->nJobs; i++) {
+    if (batch->jobs[i].nKeys == 0) {
+      printf("%s: job %d (%s) has no keyframes\n", scriptName, i + 1, batch->jobs[i].outName);
+      ok = false;
+    }
+  }
+  return ok;
+}
 
-      count += BUFSIZE;
+static void batchJobTask(void* context, int index) {
+  Batch* batch = context;
+  BatchJob* job = &batch->jobs[index];
+  // jobs of a scene that failed to load keep seconds at -1, failed
+  if (batch->scenes[job->scene].sim == NULL) {
+    return;
+  }
+  job->seconds = renderFile(batch->scenes[job->scene].sim, job->inName, job->outName, job->keys, job->nKeys, NULL);
+}
+
+/* Renders every job of the script, each scene loaded once and shared by its jobs, the jobs spread
+ * over nThreads threads (every processor with 0)
+ */
+int renderBatch(char* scriptName, int nThreads) {
+  Batch batch = {0};
+  if (!readBatchScript(scriptName, &batch)) {
+    freeBatch(&batch);
+    return -1;
+  }
+
+  double loadStart = wallTime();
+  int loaded = 0;
+  for (int i = 0; i < batch.nScenes; i++) {
+    batch.scenes[i].sim = audioSim_init(batch.scenes[i].irsName);
+    if (batch.scenes[i].sim != NULL) {
+      loaded++;
+    } else {
+      printf("Failed to load %s, skipping its jobs.\n", batch.scenes[i].irsName);
     }
+  }
+  double loadSeconds = wallTime() - loadStart;
 
-    free(srcTmp);
-    free(dstTmp);
+  ThreadPool* pool = threadPool_init(nThreads > 0 ? nThreads : threadPool_cpuCount());
+  double startTime = wallTime();
+  threadPool_parallelFor(pool, batch.nJobs, batchJobTask, &batch);
+  double elapsed = wallTime() - startTime;
 
-    SF_INFO info = speechFile->info;
-    info.frames = amountToModify;
-    writeWav("output.wav", info, buf);
-    free(buf);
+  double seconds = 0;
+  int failed = 0;
+  for (int i = 0; i < batch.nJobs; i++) {
+    if (batch.jobs[i].seconds < 0) {
+      printf("Failed: %s\n", batch.jobs[i].outName);
+      failed++;
+    } else {
+      seconds += batch.jobs[i].seconds;
+    }
+  }
+  printf("Loaded %d of %d scenes in %.3fs\n", loaded, batch.nScenes, loadSeconds);
+  printf("Rendered %d of %d jobs, %.2fs of audio in %.3fs on %d threads (%.1f audio seconds per second, %d-bit samples)\n",
+      batch.nJobs - failed, batch.nJobs, seconds, elapsed, threadPool_size(pool), elapsed > 0 ? seconds/elapsed : 0, (int)(8*sizeof(Sample)));
+  for (int i = 0; i < batch.nScenes; i++) {
+    if (batch.scenes[i].sim != NULL) {
+      printf("%s:\n", batch.scenes[i].irsName);
+      printStats(batch.scenes[i].sim);
+    }
   }
 
-  audioSim_destroyStream(stream);
-  audioSim_destroy(sim);
+  threadPool_destroy(pool);
+  freeBatch(&batch);
+  return failed > 0 ? -1 : 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc >= 3 && strcmp(argv[1], "--batch") == 0) {
+    return renderBatch(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+  }
+
+  int argCount = 1;
+  int nInputs = 0;
+  while (1 + nInputs + 1 < argc && !isNumber(argv[2 + nInputs])) {
+    nInputs++;
+  }
+  if (nInputs == 0 || argc < 2 + nInputs + 3) {
+    printf("Usage: %s scene.irs input.wav [input2.wav ...] x y z [reference.wav]\n", argv[0]);
+    printf("       %s --batch script.txt [threads]\n", argv[0]);
+    printf("A single input is written to output.wav, several to output_1.wav, output_2.wav, ...\n");
+    printf("A batch script lists jobs, each a job line followed by the keyframes of the emitter's path:\n");
+    printf("  job scene.irs input.wav output.wav\n");
+    printf("  at seconds x y z\n");
+    return -1;
+  }
 
-  myFreeSound(speechFile);
+  AudioSim* sim = audioSim_init(argv[argCount]);
+  if (sim == NULL) {
+    return -1;
+  }
+  argCount += 1;
+
+  char** inputs = argv + argCount;
+  argCount += nInputs;
+  float x = atof(argv[argCount]);
+  float y = atof(argv[argCount+1]);
+  float z = atof(argv[argCount+2]);
+  // an optional reference render to measure the error against, only for a single input
+  char* referenceName = argc > argCount+3 && nInputs == 1 ? argv[argCount+3] : NULL;
+
+  double startTime = wallTime();
+  double seconds = 0;
+  int failed = 0;
+  for (int i = 0; i < nInputs; i++) {
+    char outName[32];
+    if (nInputs == 1) {
+      strcpy(outName, "output.wav");
+    } else {
+      snprintf(outName, sizeof(outName), "output_%d.wav", i + 1);
+    }
+    Keyframe key = {0, x, y, z};
+    double fileSeconds = renderFile(sim, inputs[i], outName, &key, 1, referenceName);
+    if (fileSeconds < 0) {
+      failed++;
+    } else {
+      seconds += fileSeconds;
+    }
+  }
+
+  double elapsed = wallTime() - startTime;
+  printf("Rendered %.2fs of audio in %.3fs (%.1fx real time, %d-bit samples)\n", seconds, elapsed, seconds/elapsed, (int)(8*sizeof(Sample)));
+  printStats(sim);
+
+  audioSim_destroy(sim);
 
-  return 0;
+  return failed > 0 ? -1 : 0;
 }
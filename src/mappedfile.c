@@ -0,0 +1,89 @@
+#include "mappedfile.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include "alloccount.h"
+
+MappedFile* mappedFile_open(const char* filename) {
+  HANDLE fileHandle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (fileHandle == INVALID_HANDLE_VALUE) {
+    return NULL;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(fileHandle, &size) || size.QuadPart == 0) {
+    CloseHandle(fileHandle);
+    return NULL;
+  }
+
+  HANDLE mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mappingHandle == NULL) {
+    CloseHandle(fileHandle);
+    return NULL;
+  }
+
+  void* data = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+  if (data == NULL) {
+    CloseHandle(mappingHandle);
+    CloseHandle(fileHandle);
+    return NULL;
+  }
+
+  MappedFile* file = malloc(sizeof(MappedFile));
+  file->data = data;
+  file->size = (size_t)size.QuadPart;
+  file->fileHandle = fileHandle;
+  file->mappingHandle = mappingHandle;
+  return file;
+}
+
+void mappedFile_close(MappedFile* file) {
+  UnmapViewOfFile((void*)file->data);
+  CloseHandle(file->mappingHandle);
+  CloseHandle(file->fileHandle);
+  free(file);
+}
+
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "alloccount.h"
+
+MappedFile* mappedFile_open(const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping stays valid after the descriptor is closed
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  MappedFile* file = malloc(sizeof(MappedFile));
+  file->data = data;
+  file->size = st.st_size;
+  file->fileHandle = NULL;
+  file->mappingHandle = NULL;
+  return file;
+}
+
+void mappedFile_close(MappedFile* file) {
+  munmap((void*)file->data, file->size);
+  free(file);
+}
+
+#endif
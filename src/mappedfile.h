@@ -0,0 +1,22 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <stddef.h>
+
+/* A whole file mapped read-only into memory
+ * Pages are only read from disk when touched, so large files cost nothing until used
+ */
+typedef struct {
+  const unsigned char* data;
+  size_t size;
+  // platform handles needed to undo the mapping
+  void* fileHandle;
+  void* mappingHandle;
+} MappedFile;
+
+/* Returns NULL if the file can't be opened or mapped
+ */
+MappedFile* mappedFile_open(const char* filename);
+void mappedFile_close(MappedFile* file);
+
+#endif
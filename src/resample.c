@@ -0,0 +1,146 @@
+#include "resample.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include "alloccount.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Zero crossings of the sinc on each side of the centre, more is a sharper cutoff
+#define RESAMPLE_ZERO_CROSSINGS 16
+// The passband ends this far below the lower of the two Nyquist frequencies, so the transition band aliases nothing
+#define RESAMPLE_ROLLOFF 0.95
+// Kaiser window shape, about 90 dB of stopband attenuation
+#define RESAMPLE_KAISER_BETA 9.0
+// Ratios with more phases than this interpolate between neighbouring rows of the table
+#define RESAMPLE_MAX_PHASES 1024
+
+struct Resampler_s {
+  // Every down input samples make up output samples
+  int up;
+  int down;
+  // Input samples the filter reaches on each side of an output sample
+  int halfTaps;
+  // Rows of the table, up of them when every phase has its own, the last row repeats the first shifted by a sample
+  int phases;
+  bool exact;
+  // (phases + 1) rows of 2*halfTaps coefficients
+  double* table;
+};
+
+static int gcd(int a, int b) {
+  while (b != 0) {
+    int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Modified Bessel function of the first kind, order 0
+static double besselI0(double x) {
+  double sum = 1;
+  double term = 1;
+  for (int k = 1; k < 50; k++) {
+    term *= (x/(2*k))*(x/(2*k));
+    sum += term;
+    if (term < sum*1e-17) {
+      break;
+    }
+  }
+  return sum;
+}
+
+Resampler* resampler_init(int inRate, int outRate) {
+  Resampler* r = malloc(sizeof(Resampler));
+  int g = gcd(inRate, outRate);
+  r->up = outRate/g;
+  r->down = inRate/g;
+
+  // downsampling moves the cutoff down to the output's Nyquist frequency, which widens the filter
+  double cutoff = RESAMPLE_ROLLOFF*(r->up < r->down ? (double)r->up/r->down : 1.0);
+  r->halfTaps = (int)ceil(RESAMPLE_ZERO_CROSSINGS/cutoff);
+  r->exact = r->up <= RESAMPLE_MAX_PHASES;
+  r->phases = r->exact ? r->up : RESAMPLE_MAX_PHASES;
+
+  int taps = 2*r->halfTaps;
+  r->table = malloc((r->phases + 1)*taps*sizeof(double));
+  double windowNorm = besselI0(RESAMPLE_KAISER_BETA);
+  for (int row = 0; row <= r->phases; row++) {
+    // the output sample sits frac input samples after input sample i, tap k reads input i - halfTaps + 1 + k
+    double frac = (double)row/r->phases;
+    for (int k = 0; k < taps; k++) {
+      double d = frac + r->halfTaps - 1 - k;
+      double x = d/r->halfTaps;
+      double h = 0;
+      if (fabs(x) < 1) {
+        double sinc = d == 0 ? 1 : sin(M_PI*cutoff*d)/(M_PI*cutoff*d);
+        h = cutoff*sinc*besselI0(RESAMPLE_KAISER_BETA*sqrt(1 - x*x))/windowNorm;
+      }
+      r->table[row*taps + k] = h;
+    }
+  }
+  return r;
+}
+
+void resampler_destroy(Resampler* r) {
+  free(r->table);
+  free(r);
+}
+
+int resampler_outputLength(Resampler* r, int inLen) {
+  return (int)(((long long)inLen*r->up + r->down - 1)/r->down);
+}
+
+// Filter taps h applied around input sample i
+static double filterAt(Resampler* r, const float* in, int inLen, int i, const double* h) {
+  int taps = 2*r->halfTaps;
+  int start = i - r->halfTaps + 1;
+  double sum = 0;
+  if (start >= 0 && start + taps <= inLen) {
+    const float* x = in + start;
+    for (int k = 0; k < taps; k++) {
+      sum += x[k]*h[k];
+    }
+  } else {
+    int first = start < 0 ? -start : 0;
+    int last = start + taps > inLen ? inLen - start : taps;
+    for (int k = first; k < last; k++) {
+      sum += in[start + k]*h[k];
+    }
+  }
+  return sum;
+}
+
+void resampler_process(Resampler* r, const float* in, int inLen, float* out, int outLen) {
+  if (r->up == r->down) {
+    int n = outLen < inLen ? outLen : inLen;
+    memcpy(out, in, n*sizeof(float));
+    memset(out + n, 0, (outLen - n)*sizeof(float));
+    return;
+  }
+
+  int taps = 2*r->halfTaps;
+  // output sample n lies at input position i + phase/up
+  int i = 0;
+  int phase = 0;
+  for (int n = 0; n < outLen; n++) {
+    if (r->exact) {
+      out[n] = (float)filterAt(r, in, inLen, i, r->table + phase*taps);
+    } else {
+      double pos = (double)phase*r->phases/r->up;
+      int row = (int)pos;
+      double a = pos - row;
+      double lo = filterAt(r, in, inLen, i, r->table + row*taps);
+      double hi = filterAt(r, in, inLen, i, r->table + (row + 1)*taps);
+      out[n] = (float)((1 - a)*lo + a*hi);
+    }
+    phase += r->down;
+    i += phase/r->up;
+    phase %= r->up;
+  }
+}
@@ -0,0 +1,22 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+/* Sample rate conversion by any rational ratio with a windowed sinc filter
+ * The ratio is reduced to up/down and the filter is tabulated once per phase, so converting is a
+ * dot product per output sample. Made for whole buffers like impulse responses, samples before
+ * the start and after the end of the input count as silence.
+ */
+typedef struct Resampler_s Resampler;
+
+Resampler* resampler_init(int inRate, int outRate);
+void resampler_destroy(Resampler* r);
+
+/* Samples the conversion of inLen input samples has, ceil(inLen*outRate/inRate)
+ */
+int resampler_outputLength(Resampler* r, int inLen);
+
+/* Writes outLen samples of the converted input to out
+ */
+void resampler_process(Resampler* r, const float* in, int inLen, float* out, int outLen);
+
+#endif
@@ -0,0 +1,76 @@
+#include "ringbuffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "alloccount.h"
+
+struct RingBuffer_s {
+  Sample* data;
+  size_t mask;
+  // Total samples ever written and read, the writer only stores head and the reader only stores tail
+  atomic_size_t head;
+  atomic_size_t tail;
+};
+
+RingBuffer* ringBuffer_init(int capacity) {
+  size_t size = 1;
+  while (size < (size_t)capacity) {
+    size *= 2;
+  }
+
+  RingBuffer* r = malloc(sizeof(RingBuffer));
+  r->data = malloc(size*sizeof(Sample));
+  r->mask = size - 1;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  return r;
+}
+
+void ringBuffer_destroy(RingBuffer* r) {
+  free(r->data);
+  free(r);
+}
+
+int ringBuffer_readAvailable(RingBuffer* r) {
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  return (int)(head - tail);
+}
+
+int ringBuffer_writeAvailable(RingBuffer* r) {
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  return (int)(r->mask + 1 - (head - tail));
+}
+
+int ringBuffer_write(RingBuffer* r, const Sample* src, int len) {
+  size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  size_t space = r->mask + 1 - (head - tail);
+  size_t n = (size_t)len < space ? (size_t)len : space;
+
+  // the free region can wrap around the end of the array
+  size_t start = head & r->mask;
+  size_t first = n < r->mask + 1 - start ? n : r->mask + 1 - start;
+  memcpy(r->data + start, src, first*sizeof(Sample));
+  memcpy(r->data, src + first, (n - first)*sizeof(Sample));
+
+  atomic_store_explicit(&r->head, head + n, memory_order_release);
+  return (int)n;
+}
+
+int ringBuffer_read(RingBuffer* r, Sample* dst, int len) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  size_t available = head - tail;
+  size_t n = (size_t)len < available ? (size_t)len : available;
+
+  size_t start = tail & r->mask;
+  size_t first = n < r->mask + 1 - start ? n : r->mask + 1 - start;
+  memcpy(dst, r->data + start, first*sizeof(Sample));
+  memcpy(dst + first, r->data, (n - first)*sizeof(Sample));
+
+  atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+  return (int)n;
+}
@@ -0,0 +1,27 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include "sample.h"
+
+/* Lock free single producer, single consumer queue of samples
+ * One thread writes and one other thread reads, neither ever blocks or allocates,
+ * so both ends are safe to use from a real time audio callback.
+ */
+typedef struct RingBuffer_s RingBuffer;
+
+/* capacity is rounded up to a power of 2
+ */
+RingBuffer* ringBuffer_init(int capacity);
+void ringBuffer_destroy(RingBuffer* r);
+
+/* Samples that can be read / written right now
+ */
+int ringBuffer_readAvailable(RingBuffer* r);
+int ringBuffer_writeAvailable(RingBuffer* r);
+
+/* Copy up to len samples and return how many were copied
+ */
+int ringBuffer_write(RingBuffer* r, const Sample* src, int len);
+int ringBuffer_read(RingBuffer* r, Sample* dst, int len);
+
+#endif
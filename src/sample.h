@@ -0,0 +1,17 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+/* Precision used for audio, impulse responses and spectra throughout the simulation
+ * Building everything with -DAUDIOSIM_FLOAT switches to single precision and fftwf,
+ * which halves memory traffic and doubles the SIMD width of the FFTs
+ * FFTW(name) expands to the FFTW function or type of the matching precision
+ */
+#ifdef AUDIOSIM_FLOAT
+typedef float Sample;
+#define FFTW(name) fftwf_##name
+#else
+typedef double Sample;
+#define FFTW(name) fftw_##name
+#endif
+
+#endif
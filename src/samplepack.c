@@ -0,0 +1,104 @@
+#include "samplepack.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "kernels.h"
+
+static int blockCount(int len) {
+  return (len + SAMPLE_PACK_BLOCK - 1)/SAMPLE_PACK_BLOCK;
+}
+
+size_t samplePack_size(SamplePackFormat format, int len) {
+  // 16 bit samples are padded to a whole number of pairs
+  size_t samples = (size_t)(len + 1)/2*4;
+  switch (format) {
+    case SAMPLE_PACK_HALF:
+      return samples;
+    case SAMPLE_PACK_INT16:
+      return blockCount(len)*sizeof(float) + samples;
+    default:
+      return (size_t)len*sizeof(float);
+  }
+}
+
+// Rounds to the nearest half, ties to even like the hardware conversion
+static uint16_t floatToHalf(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  uint16_t sign = (bits >> 16) & 0x8000;
+  float a = fabsf(f);
+  if (a >= 65504.0f) {
+    return sign | 0x7bff;
+  }
+  if (a < 6.103515625e-05f) {
+    // below the smallest normal half the steps are 2^-24, rounding up to it gives its encoding
+    return sign | (uint16_t)lrintf(a*16777216.0f);
+  }
+  uint32_t abits;
+  memcpy(&abits, &a, sizeof(abits));
+  abits += 0x0fff + ((abits >> 13) & 1);
+  // rebias the exponent from 127 to 15, a carry out of the mantissa moves it up by one as it should
+  return sign | (uint16_t)((abits >> 13) - (112 << 10));
+}
+
+void samplePack_encode(SamplePackFormat format, const Sample* src, int len, void* dst) {
+  if (format == SAMPLE_PACK_HALF) {
+    uint16_t* h = dst;
+    for (int i = 0; i < len; i++) {
+      h[i] = floatToHalf((float)src[i]);
+    }
+    if (len % 2 != 0) {
+      h[len] = 0;
+    }
+  } else if (format == SAMPLE_PACK_INT16) {
+    float* scales = dst;
+    int16_t* q = (int16_t*)(scales + blockCount(len));
+    for (int b = 0; b*SAMPLE_PACK_BLOCK < len; b++) {
+      int start = b*SAMPLE_PACK_BLOCK;
+      int end = start + SAMPLE_PACK_BLOCK < len ? start + SAMPLE_PACK_BLOCK : len;
+      double peak = 0;
+      for (int i = start; i < end; i++) {
+        if (fabs(src[i]) > peak) {
+          peak = fabs(src[i]);
+        }
+      }
+      // samples are quantised against the scale as stored, so decoding reproduces the rounding
+      scales[b] = (float)(peak/32767);
+      for (int i = start; i < end; i++) {
+        long v = scales[b] > 0 ? lrint(src[i]/scales[b]) : 0;
+        q[i] = (int16_t)(v > 32767 ? 32767 : v < -32767 ? -32767 : v);
+      }
+    }
+    if (len % 2 != 0) {
+      q[len] = 0;
+    }
+  } else {
+    float* f = dst;
+    for (int i = 0; i < len; i++) {
+      f[i] = (float)src[i];
+    }
+  }
+}
+
+void samplePack_accumulate(SamplePackFormat format, const void* src, int len, Sample weight, Sample* dst) {
+  const Kernels* kernels = kernels_get();
+  if (format == SAMPLE_PACK_NONE) {
+    kernels->accumulate(dst, src, NULL, weight, len);
+    return;
+  }
+  float block[SAMPLE_PACK_BLOCK];
+  const float* scales = src;
+  const int16_t* q = (const int16_t*)(scales + blockCount(len));
+  for (int start = 0; start < len; start += SAMPLE_PACK_BLOCK) {
+    int n = len - start < SAMPLE_PACK_BLOCK ? len - start : SAMPLE_PACK_BLOCK;
+    Sample gain = weight;
+    if (format == SAMPLE_PACK_HALF) {
+      kernels->expandHalf(block, (const uint16_t*)src + start, n);
+    } else {
+      kernels->expandInt16(block, q + start, n);
+      gain = weight*scales[start/SAMPLE_PACK_BLOCK];
+    }
+    kernels->accumulate(dst + start, block, NULL, gain, n);
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef SAMPLEPACK_H
+#define SAMPLEPACK_H
+
+#include <stddef.h>
+#include "sample.h"
+
+/* Compact encodings of normalised samples (within -1..1), for impulse responses that are kept in
+ * memory and only ever read by blending them into a Sample buffer
+ * Blending expands a block at a time into floats on the stack and adds them, with the kernels the
+ * processor supports.
+ */
+typedef enum {
+  // Not packed, the samples stay floats
+  SAMPLE_PACK_NONE,
+  // IEEE half precision, 11 significant bits at any level
+  SAMPLE_PACK_HALF,
+  // 16 bit integers with a scale per SAMPLE_PACK_BLOCK samples, 15 bits relative to the block's peak
+  SAMPLE_PACK_INT16
+} SamplePackFormat;
+
+#define SAMPLE_PACK_BLOCK 64
+
+/* Bytes len packed samples take, a multiple of 4
+ */
+size_t samplePack_size(SamplePackFormat format, int len);
+
+/* Packs len samples into dst, which must hold samplePack_size bytes and be 4 byte aligned
+ */
+void samplePack_encode(SamplePackFormat format, const Sample* src, int len, void* dst);
+
+/* dst[i] += weight*src[i] for the first len packed samples
+ */
+void samplePack_accumulate(SamplePackFormat format, const void* src, int len, Sample weight, Sample* dst);
+
+#endif
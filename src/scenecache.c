@@ -0,0 +1,350 @@
+#include "scenecache.h"
+#include "irs_internal.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fftw3.h>
+#include "alloccount.h"
+
+#define SCENE_CACHE_VERSION 6
+// Every data block starts on a cache line, which is also enough for FFTW's SIMD alignment
+#define SCENE_CACHE_ALIGNMENT 64
+
+typedef struct {
+  // Always "iSimCach"
+  char magic[8];
+  int32_t version;
+  // sizeof(Sample) of the build that wrote it
+  int32_t sampleBytes;
+  // Identifies the .irs file the cache was made from
+  int64_t sourceSize;
+  uint64_t sourceHash;
+  IRSHeader irsHeader;
+  int32_t nSources;
+  int32_t nListeners;
+  int32_t rawLen;
+  // Longest response of any source, the data blocks are this long
+  int32_t dataLen;
+  // Rate the responses were converted to
+  int32_t sampleRate;
+  // Trimming the responses were cut with
+  int32_t trimMode;
+  float trimThreshold;
+  // Format of the data blocks, SAMPLE_PACK_NONE for decoded Samples
+  int32_t storage;
+  // 0 if no spectra are stored
+  int32_t spectrumPartitionSize;
+  int32_t spectraLen;
+  double maxSample;
+  double packMaxError;
+  double packRmsError;
+  // Byte offsets of the tables and of the aligned data blocks
+  int64_t sourcesOffset;
+  int64_t listenersOffset;
+  int64_t sourceListenersOffset;
+  int64_t dataOffset;
+  int64_t dataStride;
+  int64_t spectraOffset;
+  int64_t spectraStride;
+  int64_t totalSize;
+} SceneCacheHeader;
+
+typedef struct {
+  int32_t id;
+  float x;
+  float y;
+  float z;
+} CachedPoint;
+
+// A listener's copy for one source, with the length of its trimmed response
+typedef struct {
+  CachedPoint point;
+  int32_t length;
+} CachedRecord;
+
+static int64_t alignUp(int64_t n) {
+  return (n + SCENE_CACHE_ALIGNMENT - 1) & ~(int64_t)(SCENE_CACHE_ALIGNMENT - 1);
+}
+
+// FNV-1a over the whole .irs file, a word at a time, with its size
+// The contents decide, so a file regenerated within the same second or copied with its old mtime is still told apart
+static bool identifySource(const char* irsFile, int64_t* size, uint64_t* hash) {
+  MappedFile* map = mappedFile_open(irsFile);
+  if (map == NULL) {
+    return false;
+  }
+  *size = map->size;
+  uint64_t h = 14695981039346656037ull;
+  size_t words = map->size/sizeof(uint64_t);
+  for (size_t i = 0; i < words; i++) {
+    uint64_t w;
+    memcpy(&w, map->data + i*sizeof(uint64_t), sizeof(w));
+    h = (h ^ w) * 1099511628211ull;
+  }
+  for (size_t i = words*sizeof(uint64_t); i < map->size; i++) {
+    h = (h ^ map->data[i]) * 1099511628211ull;
+  }
+  *hash = h;
+  mappedFile_close(map);
+  return true;
+}
+
+static bool writePadding(FILE* file, int64_t* pos, int64_t target) {
+  static const char zeros[SCENE_CACHE_ALIGNMENT] = {0};
+  while (*pos < target) {
+    int64_t n = target - *pos;
+    if (n > SCENE_CACHE_ALIGNMENT) {
+      n = SCENE_CACHE_ALIGNMENT;
+    }
+    if (fwrite(zeros, 1, n, file) != (size_t)n) {
+      return false;
+    }
+    *pos += n;
+  }
+  return true;
+}
+
+static bool writeBytes(FILE* file, int64_t* pos, const void* data, int64_t n) {
+  if (fwrite(data, 1, n, file) != (size_t)n) {
+    return false;
+  }
+  *pos += n;
+  return true;
+}
+
+bool sceneCache_save(const char* cacheFile, const char* irsFile, IRSFile* scene, IRSLoadOptions* options) {
+  SceneCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "iSimCach", 8);
+  header.version = SCENE_CACHE_VERSION;
+  header.sampleBytes = sizeof(Sample);
+  if (!identifySource(irsFile, &header.sourceSize, &header.sourceHash)) {
+    return false;
+  }
+  header.irsHeader = scene->header;
+  header.nSources = scene->nSources;
+  header.nListeners = scene->nListeners;
+  header.rawLen = scene->rawLen;
+  header.sampleRate = scene->sampleRate;
+  header.trimMode = options->trimMode;
+  header.trimThreshold = options->trimThreshold;
+  header.storage = scene->storage;
+  header.spectrumPartitionSize = options->spectrumPartitionSize;
+  for (int i = 0; i < scene->nSources; i++) {
+    if (scene->sources[i].dataLen > header.dataLen) {
+      header.dataLen = scene->sources[i].dataLen;
+      header.spectraLen = scene->sources[i].spectraLen;
+    }
+  }
+  header.maxSample = scene->maxSample;
+  header.packMaxError = scene->packMaxError;
+  header.packRmsError = scene->packRmsError;
+
+  int nRecords = scene->nSources*scene->nListeners;
+  header.sourcesOffset = sizeof(SceneCacheHeader);
+  header.listenersOffset = header.sourcesOffset + scene->nSources*sizeof(CachedPoint);
+  header.sourceListenersOffset = header.listenersOffset + scene->nListeners*sizeof(CachedPoint);
+  if (scene->storage != SAMPLE_PACK_NONE) {
+    header.dataStride = alignUp(samplePack_size(scene->storage, header.dataLen));
+  } else {
+    header.dataStride = alignUp(header.dataLen*sizeof(Sample));
+  }
+  header.dataOffset = alignUp(header.sourceListenersOffset + nRecords*sizeof(CachedRecord));
+  header.spectraStride = alignUp(header.spectraLen*sizeof(ComplexNum));
+  header.spectraOffset = header.dataOffset + nRecords*header.dataStride;
+  header.totalSize = header.spectraOffset + (header.spectraLen > 0 ? nRecords*header.spectraStride : 0);
+
+  // written next to the target and renamed so a half written cache is never picked up
+  char* tmpFile = malloc(strlen(cacheFile) + 5);
+  sprintf(tmpFile, "%s.tmp", cacheFile);
+  FILE* file = fopen(tmpFile, "wb");
+  if (file == NULL) {
+    free(tmpFile);
+    return false;
+  }
+
+  int64_t pos = 0;
+  bool ok = writeBytes(file, &pos, &header, sizeof(header));
+  for (int i = 0; ok && i < scene->nSources; i++) {
+    CachedPoint p = {scene->sources[i].id, scene->sources[i].x, scene->sources[i].y, scene->sources[i].z};
+    ok = writeBytes(file, &pos, &p, sizeof(p));
+  }
+  for (int i = 0; ok && i < scene->nListeners; i++) {
+    CachedPoint p = {scene->listeners[i].id, scene->listeners[i].x, scene->listeners[i].y, scene->listeners[i].z};
+    ok = writeBytes(file, &pos, &p, sizeof(p));
+  }
+  for (int i = 0; ok && i < nRecords; i++) {
+    IRSListener* l = &scene->sourceListeners[i];
+    CachedRecord r = {{l->id, l->x, l->y, l->z}, l->length};
+    ok = writeBytes(file, &pos, &r, sizeof(r));
+  }
+
+  // responses shorter than the blocks are padded with silence
+  Sample* scratch = malloc(header.dataLen*sizeof(Sample));
+  for (int i = 0; ok && i < nRecords; i++) {
+    IRSListener* l = &scene->sourceListeners[i];
+    ok = writePadding(file, &pos, header.dataOffset + i*header.dataStride);
+    if (scene->storage != SAMPLE_PACK_NONE) {
+      ok = ok && writeBytes(file, &pos, l->packed, samplePack_size(scene->storage, l->length));
+      continue;
+    }
+    Sample* data = l->data;
+    if (data == NULL) {
+      decodeListenerData(l, scratch);
+      data = scratch;
+    }
+    ok = ok && writeBytes(file, &pos, data, l->source->dataLen*sizeof(Sample));
+  }
+  free(scratch);
+  for (int i = 0; ok && header.spectraLen > 0 && i < nRecords; i++) {
+    ok = writePadding(file, &pos, header.spectraOffset + i*header.spectraStride)
+      && writeBytes(file, &pos, scene->sourceListeners[i].spectra, scene->sourceListeners[i].spectraLen*sizeof(ComplexNum));
+  }
+  ok = ok && writePadding(file, &pos, header.totalSize);
+
+  if (fclose(file) != 0) {
+    ok = false;
+  }
+  if (ok) {
+    remove(cacheFile);
+    ok = rename(tmpFile, cacheFile) == 0;
+  }
+  if (!ok) {
+    remove(tmpFile);
+  }
+  free(tmpFile);
+  return ok;
+}
+
+// Whether count items of itemBytes from offset lie within a mapping of size bytes
+static bool fitsIn(size_t size, int64_t offset, int64_t count, int64_t itemBytes) {
+  return offset >= 0 && count >= 0 && itemBytes >= 0 && offset <= (int64_t)size
+    && (itemBytes == 0 || count <= ((int64_t)size - offset)/itemBytes);
+}
+
+// Whether the header's tables and data blocks lie within the mapping, and every record fits its block
+static bool layoutValid(MappedFile* map, SceneCacheHeader* header) {
+  int64_t nRecords = (int64_t)header->nSources*header->nListeners;
+  int64_t dataBytes = header->storage != SAMPLE_PACK_NONE
+    ? (int64_t)samplePack_size(header->storage, header->dataLen) : (int64_t)header->dataLen*(int64_t)sizeof(Sample);
+  bool valid = header->dataLen > 0
+    && fitsIn(map->size, header->sourcesOffset, header->nSources, sizeof(CachedPoint))
+    && fitsIn(map->size, header->listenersOffset, header->nListeners, sizeof(CachedPoint))
+    && fitsIn(map->size, header->sourceListenersOffset, nRecords, sizeof(CachedRecord))
+    && header->dataStride >= dataBytes && fitsIn(map->size, header->dataOffset, nRecords, header->dataStride)
+    && (header->spectraLen == 0 || (header->spectrumPartitionSize > 0
+      && header->spectraLen >= convolver_spectraLength(header->spectrumPartitionSize, header->dataLen)
+      && header->spectraStride >= header->spectraLen*(int64_t)sizeof(ComplexNum)
+      && fitsIn(map->size, header->spectraOffset, nRecords, header->spectraStride)));
+  if (valid) {
+    const CachedRecord* records = (const CachedRecord*)(map->data + header->sourceListenersOffset);
+    for (int64_t i = 0; i < nRecords && valid; i++) {
+      valid = records[i].length >= 0 && records[i].length <= header->dataLen;
+    }
+  }
+  return valid;
+}
+
+IRSFile* sceneCache_load(const char* cacheFile, const char* irsFile, IRSLoadOptions* options) {
+  MappedFile* map = mappedFile_open(cacheFile);
+  if (map == NULL) {
+    return NULL;
+  }
+
+  SceneCacheHeader header;
+  int64_t sourceSize;
+  uint64_t sourceHash;
+  bool valid = map->size >= sizeof(SceneCacheHeader);
+  if (valid) {
+    memcpy(&header, map->data, sizeof(SceneCacheHeader));
+    valid = memcmp(header.magic, "iSimCach", 8) == 0
+      && header.version == SCENE_CACHE_VERSION
+      && header.sampleBytes == sizeof(Sample)
+      && header.totalSize == (int64_t)map->size
+      && header.spectrumPartitionSize == options->spectrumPartitionSize
+      && header.sampleRate == getIRSOutputRate(&header.irsHeader, options)
+      && header.trimMode == (int32_t)options->trimMode
+      && (options->trimMode == IRS_TRIM_NONE || header.trimThreshold == options->trimThreshold)
+      && header.storage == (int32_t)options->storage
+      && header.nSources > 0 && header.nListeners > 0
+      && layoutValid(map, &header)
+      && identifySource(irsFile, &sourceSize, &sourceHash)
+      && sourceSize == header.sourceSize && sourceHash == header.sourceHash;
+  }
+  if (!valid) {
+    mappedFile_close(map);
+    return NULL;
+  }
+
+  IRSFile* scene = calloc(1, sizeof(IRSFile));
+  scene->map = map;
+  scene->dataMapped = true;
+  scene->header = header.irsHeader;
+  scene->nSources = header.nSources;
+  scene->nListeners = header.nListeners;
+  scene->rawLen = header.rawLen;
+  scene->sampleRate = header.sampleRate;
+  scene->maxSample = header.maxSample;
+  scene->storage = header.storage;
+  scene->packMaxError = header.packMaxError;
+  scene->packRmsError = header.packRmsError;
+
+  const CachedPoint* sources = (const CachedPoint*)(map->data + header.sourcesOffset);
+  const CachedPoint* listeners = (const CachedPoint*)(map->data + header.listenersOffset);
+  const CachedRecord* records = (const CachedRecord*)(map->data + header.sourceListenersOffset);
+
+  scene->listeners = calloc(header.nListeners, sizeof(IRSListener));
+  for (int i = 0; i < header.nListeners; i++) {
+    scene->listeners[i].id = listeners[i].id;
+    scene->listeners[i].x = listeners[i].x;
+    scene->listeners[i].y = listeners[i].y;
+    scene->listeners[i].z = listeners[i].z;
+  }
+
+  scene->sources = calloc(header.nSources, sizeof(IRSSource));
+  scene->sourceListeners = calloc(header.nSources*header.nListeners, sizeof(IRSListener));
+  for (int i = 0; i < header.nSources; i++) {
+    IRSSource* source = &scene->sources[i];
+    source->id = sources[i].id;
+    source->x = sources[i].x;
+    source->y = sources[i].y;
+    source->z = sources[i].z;
+    source->nListeners = header.nListeners;
+    source->dataLen = 1;
+    source->file = scene;
+    source->listeners = malloc(header.nListeners*sizeof(IRSListener*));
+    for (int j = 0; j < header.nListeners; j++) {
+      int record = i*header.nListeners + j;
+      IRSListener* listener = &scene->sourceListeners[record];
+      listener->id = records[record].point.id;
+      listener->x = records[record].point.x;
+      listener->y = records[record].point.y;
+      listener->z = records[record].point.z;
+      listener->source = source;
+      // the data is decoded, so the fade out is already in it
+      listener->length = records[record].length;
+      listener->fadeStart = listener->length;
+      if (listener->length > source->dataLen) {
+        source->dataLen = listener->length;
+      }
+      const unsigned char* data = map->data + header.dataOffset + record*header.dataStride;
+      if (header.storage != SAMPLE_PACK_NONE) {
+        listener->packed = data;
+      } else {
+        listener->data = (Sample*)data;
+      }
+      if (header.spectraLen > 0) {
+        listener->spectraLen = convolver_spectraLength(header.spectrumPartitionSize, listener->length);
+        listener->spectra = (ComplexNum*)(map->data + header.spectraOffset + record*header.spectraStride);
+      }
+      source->listeners[j] = listener;
+    }
+    if (header.spectraLen > 0) {
+      source->spectraLen = convolver_spectraLength(header.spectrumPartitionSize, source->dataLen);
+    }
+  }
+  buildSourceIndexes(scene);
+
+  return scene;
+}
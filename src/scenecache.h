@@ -0,0 +1,22 @@
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+#include <stdbool.h>
+#include "irs.h"
+
+/* Binary cache of a fully processed IRS scene
+ * Holds the resampled and normalised impulse responses (plus their spectra when they were requested)
+ * and the listener positions, laid out so that loading is a single mmap with no decoding.
+ * A cache is only used if it was written for the same .irs file (its size and a hash of all of its
+ * contents), the same sample precision and the same load options.
+ */
+
+/* Returns NULL if the cache is missing, stale or made with different options
+ */
+IRSFile* sceneCache_load(const char* cacheFile, const char* irsFile, IRSLoadOptions* options);
+
+/* Writes scene (loaded from irsFile with options) to cacheFile
+ */
+bool sceneCache_save(const char* cacheFile, const char* irsFile, IRSFile* scene, IRSLoadOptions* options);
+
+#endif
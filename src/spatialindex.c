@@ -0,0 +1,324 @@
+#include "spatialindex.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include "alloccount.h"
+
+// How many of the closest points the k-d tree fallback blends
+#define KD_NEIGHBOURS 4
+
+typedef struct {
+  // Smallest coordinate, distance between grid lines and number of lines
+  float origin;
+  float spacing;
+  int size;
+} GridAxis;
+
+typedef struct {
+  int point;
+  int axis;
+  // Children are indices into the node array, -1 if missing
+  int left;
+  int right;
+} KDNode;
+
+struct SpatialIndex_s {
+  int n;
+  float* positions;
+  // Box around the points, queries are clamped to it grown by its size plus one on every side
+  float lower[3];
+  float upper[3];
+  bool isGrid;
+  GridAxis axes[3];
+  // Point at each grid cell, x major
+  int* cells;
+  KDNode* nodes;
+  int root;
+};
+
+static int compareFloats(const void* a, const void* b) {
+  float fa = *(const float*)a;
+  float fb = *(const float*)b;
+  return (fa > fb) - (fa < fb);
+}
+
+// Works out the grid lines along one axis, false if the coordinates aren't evenly spaced
+static bool findGridAxis(const float* positions, int n, int axis, GridAxis* out) {
+  float* values = malloc(n*sizeof(float));
+  for (int i = 0; i < n; i++) {
+    values[i] = positions[3*i + axis];
+  }
+  qsort(values, n, sizeof(float), compareFloats);
+
+  float range = values[n-1] - values[0];
+  float eps = 1e-4f * (range > 1 ? range : 1);
+  int unique = 1;
+  for (int i = 1; i < n; i++) {
+    if (values[i] - values[unique-1] > eps) {
+      values[unique++] = values[i];
+    }
+  }
+
+  out->origin = values[0];
+  out->size = unique;
+  out->spacing = unique > 1 ? range / (unique - 1) : 1;
+  bool even = true;
+  for (int i = 1; i < unique; i++) {
+    if (fabsf(values[i] - (out->origin + i*out->spacing)) > 0.01f*out->spacing) {
+      even = false;
+    }
+  }
+  free(values);
+  return even;
+}
+
+static int gridLine(GridAxis* axis, float v) {
+  // clamped before the conversion, which isn't defined for floats out of the int range
+  float f = floorf((v - axis->origin) / axis->spacing + 0.5f);
+  if (!(f > 0)) {
+    return 0;
+  } else if (f >= axis->size - 1) {
+    return axis->size - 1;
+  }
+  return (int)f;
+}
+
+static bool buildGrid(SpatialIndex* index) {
+  for (int a = 0; a < 3; a++) {
+    if (!findGridAxis(index->positions, index->n, a, &index->axes[a])) {
+      return false;
+    }
+  }
+  int nCells = index->axes[0].size * index->axes[1].size * index->axes[2].size;
+  if (nCells != index->n) {
+    return false;
+  }
+
+  index->cells = malloc(nCells*sizeof(int));
+  for (int i = 0; i < nCells; i++) {
+    index->cells[i] = -1;
+  }
+  for (int i = 0; i < index->n; i++) {
+    int cell = 0;
+    for (int a = 0; a < 3; a++) {
+      cell = cell*index->axes[a].size + gridLine(&index->axes[a], index->positions[3*i + a]);
+    }
+    if (index->cells[cell] != -1) {
+      // two points in one cell, so it's not really a grid
+      free(index->cells);
+      index->cells = NULL;
+      return false;
+    }
+    index->cells[cell] = i;
+  }
+  return true;
+}
+
+typedef struct {
+  float v;
+  int point;
+} SortKey;
+
+static int compareSortKeys(const void* a, const void* b) {
+  return compareFloats(&((const SortKey*)a)->v, &((const SortKey*)b)->v);
+}
+
+// Builds a balanced subtree over points, splitting on the axis with the largest extent
+static int buildKDTree(SpatialIndex* index, SortKey* points, int n, int* nextNode) {
+  if (n == 0) {
+    return -1;
+  }
+
+  int axis = 0;
+  float bestExtent = -1;
+  for (int a = 0; a < 3; a++) {
+    float lo = INFINITY;
+    float hi = -INFINITY;
+    for (int i = 0; i < n; i++) {
+      float v = index->positions[3*points[i].point + a];
+      lo = v < lo ? v : lo;
+      hi = v > hi ? v : hi;
+    }
+    if (hi - lo > bestExtent) {
+      bestExtent = hi - lo;
+      axis = a;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    points[i].v = index->positions[3*points[i].point + axis];
+  }
+  qsort(points, n, sizeof(SortKey), compareSortKeys);
+
+  int mid = n/2;
+  int node = (*nextNode)++;
+  index->nodes[node].point = points[mid].point;
+  index->nodes[node].axis = axis;
+  index->nodes[node].left = buildKDTree(index, points, mid, nextNode);
+  index->nodes[node].right = buildKDTree(index, points + mid + 1, n - mid - 1, nextNode);
+  return node;
+}
+
+SpatialIndex* spatialIndex_build(const float* positions, int n) {
+  SpatialIndex* index = calloc(1, sizeof(SpatialIndex));
+  index->n = n;
+  index->positions = malloc(3*n*sizeof(float));
+  memcpy(index->positions, positions, 3*n*sizeof(float));
+  for (int a = 0; a < 3; a++) {
+    index->lower[a] = INFINITY;
+    index->upper[a] = -INFINITY;
+    for (int i = 0; i < n; i++) {
+      index->lower[a] = fminf(index->lower[a], positions[3*i + a]);
+      index->upper[a] = fmaxf(index->upper[a], positions[3*i + a]);
+    }
+  }
+
+  index->isGrid = buildGrid(index);
+  if (!index->isGrid) {
+    SortKey* points = malloc(n*sizeof(SortKey));
+    for (int i = 0; i < n; i++) {
+      points[i].point = i;
+    }
+    index->nodes = malloc(n*sizeof(KDNode));
+    int nextNode = 0;
+    index->root = buildKDTree(index, points, n, &nextNode);
+    free(points);
+  }
+  return index;
+}
+
+void spatialIndex_destroy(SpatialIndex* index) {
+  free(index->positions);
+  free(index->cells);
+  free(index->nodes);
+  free(index);
+}
+
+static float distanceSq(SpatialIndex* index, int point, float x, float y, float z) {
+  float dx = index->positions[3*point] - x;
+  float dy = index->positions[3*point + 1] - y;
+  float dz = index->positions[3*point + 2] - z;
+  return dx*dx + dy*dy + dz*dz;
+}
+
+// Keeps the k closest points seen so far, sorted by distance
+static void kdSearch(SpatialIndex* index, int node, const float* target, int k, int* best, float* bestDist, int* nBest) {
+  if (node < 0) {
+    return;
+  }
+  KDNode* kd = &index->nodes[node];
+  float d = distanceSq(index, kd->point, target[0], target[1], target[2]);
+  if (*nBest < k || d < bestDist[*nBest - 1]) {
+    int i = *nBest < k ? (*nBest)++ : k - 1;
+    while (i > 0 && bestDist[i-1] > d) {
+      best[i] = best[i-1];
+      bestDist[i] = bestDist[i-1];
+      i--;
+    }
+    best[i] = kd->point;
+    bestDist[i] = d;
+  }
+
+  float diff = target[kd->axis] - index->positions[3*kd->point + kd->axis];
+  int nearSide = diff < 0 ? kd->left : kd->right;
+  int farSide = diff < 0 ? kd->right : kd->left;
+  kdSearch(index, nearSide, target, k, best, bestDist, nBest);
+  if (*nBest < k || diff*diff < bestDist[*nBest - 1]) {
+    kdSearch(index, farSide, target, k, best, bestDist, nBest);
+  }
+}
+
+// Keeps distances finite and grid lines within int range, NaNs go to the low side
+// That far out every point is about as far away, so moving the position hardly changes the answer
+static void clampPosition(SpatialIndex* index, float* p) {
+  for (int a = 0; a < 3; a++) {
+    float margin = index->upper[a] - index->lower[a] + 1;
+    if (!(p[a] >= index->lower[a] - margin)) {
+      p[a] = index->lower[a] - margin;
+    } else if (p[a] > index->upper[a] + margin) {
+      p[a] = index->upper[a] + margin;
+    }
+  }
+}
+
+int spatialIndex_nearest(SpatialIndex* index, float x, float y, float z) {
+  float p[3] = {x, y, z};
+  clampPosition(index, p);
+  if (index->isGrid) {
+    int cell = 0;
+    for (int a = 0; a < 3; a++) {
+      cell = cell*index->axes[a].size + gridLine(&index->axes[a], p[a]);
+    }
+    return index->cells[cell];
+  }
+
+  int best;
+  float bestDist;
+  int nBest = 0;
+  kdSearch(index, index->root, p, 1, &best, &bestDist, &nBest);
+  return best;
+}
+
+int spatialIndex_interpolate(SpatialIndex* index, float x, float y, float z, int* points, float* weights) {
+  float p[3] = {x, y, z};
+  clampPosition(index, p);
+  if (!index->isGrid) {
+    int best[KD_NEIGHBOURS];
+    float bestDist[KD_NEIGHBOURS];
+    int nBest = 0;
+    kdSearch(index, index->root, p, KD_NEIGHBOURS, best, bestDist, &nBest);
+
+    if (bestDist[0] < 1e-12f) {
+      points[0] = best[0];
+      weights[0] = 1;
+      return 1;
+    }
+    float total = 0;
+    for (int i = 0; i < nBest; i++) {
+      points[i] = best[i];
+      weights[i] = 1 / bestDist[i];
+      total += weights[i];
+    }
+    for (int i = 0; i < nBest; i++) {
+      weights[i] /= total;
+    }
+    return nBest;
+  }
+
+  // lower grid line and fraction towards the next one along each axis, clamped to the grid
+  int lower[3];
+  float frac[3];
+  for (int a = 0; a < 3; a++) {
+    GridAxis* axis = &index->axes[a];
+    float f = (p[a] - axis->origin) / axis->spacing;
+    if (axis->size == 1 || f <= 0) {
+      lower[a] = 0;
+      frac[a] = 0;
+    } else if (f >= axis->size - 1) {
+      lower[a] = axis->size - 2;
+      frac[a] = 1;
+    } else {
+      lower[a] = (int)f;
+      frac[a] = f - lower[a];
+    }
+  }
+
+  int count = 0;
+  for (int corner = 0; corner < 8; corner++) {
+    float w = 1;
+    int cell = 0;
+    for (int a = 0; a < 3; a++) {
+      int upper = (corner >> (2 - a)) & 1;
+      w *= upper ? frac[a] : 1 - frac[a];
+      cell = cell*index->axes[a].size + lower[a] + upper;
+    }
+    if (w > 0) {
+      points[count] = index->cells[cell];
+      weights[count] = w;
+      count++;
+    }
+  }
+  return count;
+}
@@ -0,0 +1,32 @@
+#ifndef SPATIALINDEX_H
+#define SPATIALINDEX_H
+
+/* Most points an interpolation can blend (the corners of a grid cell)
+ */
+#define SPATIALINDEX_MAX_NEIGHBOURS 8
+
+/* Neighbour lookup over a fixed set of 3D points
+ * Points on a regular grid (evenly spaced along each axis, any of which may have a single value)
+ * are indexed directly, giving O(1) lookups and trilinear weights. Anything else falls back to
+ * a k-d tree with inverse distance weights over the closest points.
+ * Positions further outside the box around the points than its size plus one are moved back to that
+ * distance, and NaN coordinates to its low side, so any position gives finite weights.
+ */
+typedef struct SpatialIndex_s SpatialIndex;
+
+/* positions holds x, y, z for each of the n points
+ */
+SpatialIndex* spatialIndex_build(const float* positions, int n);
+void spatialIndex_destroy(SpatialIndex* index);
+
+/* Returns the index of the point closest to the position
+ */
+int spatialIndex_nearest(SpatialIndex* index, float x, float y, float z);
+
+/* Finds the points to blend for the position and their weights, which sum to 1
+ * Positions outside a grid are clamped to its faces. Returns how many points were written,
+ * at most SPATIALINDEX_MAX_NEIGHBOURS, all with non-zero weights
+ */
+int spatialIndex_interpolate(SpatialIndex* index, float x, float y, float z, int* points, float* weights);
+
+#endif
@@ -0,0 +1,137 @@
+#include "stats.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "alloccount.h"
+
+// Counters of one thread, only that thread writes them
+typedef struct ThreadStats_s {
+  atomic_llong ns[STATS_STAGES];
+  atomic_long count[STATS_STAGES];
+  struct ThreadStats_s* prev;
+  struct ThreadStats_s* next;
+} ThreadStats;
+
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t threadKey;
+// Guards the list of threads and the totals of threads that have exited
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadStats* threads;
+static long long exitedNs[STATS_STAGES];
+static long exitedCount[STATS_STAGES];
+static _Thread_local ThreadStats* local;
+
+// Every counter has a single writer, so a relaxed load and store does instead of an atomic add
+#define BUMP(counter, amount) atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (amount), memory_order_relaxed)
+
+long long stats_now(void) {
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (long long)((double)counter.QuadPart*1e9/frequency.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000LL + ts.tv_nsec;
+#endif
+}
+
+#ifndef AUDIOSIM_NO_STATS
+// Folds the counters of an exiting thread into the totals
+static void threadExit(void* arg) {
+  ThreadStats* t = arg;
+  pthread_mutex_lock(&registryLock);
+  for (int s = 0; s < STATS_STAGES; s++) {
+    exitedNs[s] += atomic_load(&t->ns[s]);
+    exitedCount[s] += atomic_load(&t->count[s]);
+  }
+  if (t->prev != NULL) {
+    t->prev->next = t->next;
+  } else {
+    threads = t->next;
+  }
+  if (t->next != NULL) {
+    t->next->prev = t->prev;
+  }
+  pthread_mutex_unlock(&registryLock);
+  free(t);
+}
+
+static void createKey(void) {
+  pthread_key_create(&threadKey, threadExit);
+}
+
+// The calling thread's counters, registered the first time it adds to them
+static ThreadStats* threadStats(void) {
+  if (local == NULL) {
+    pthread_once(&keyOnce, createKey);
+    ThreadStats* t = calloc(1, sizeof(ThreadStats));
+    pthread_setspecific(threadKey, t);
+    pthread_mutex_lock(&registryLock);
+    t->prev = NULL;
+    t->next = threads;
+    if (threads != NULL) {
+      threads->prev = t;
+    }
+    threads = t;
+    pthread_mutex_unlock(&registryLock);
+    local = t;
+  }
+  return local;
+}
+
+long long stats_lap(StatsStage stage, long long start) {
+  long long now = stats_now();
+  ThreadStats* t = threadStats();
+  BUMP(t->ns[stage], now - start);
+  BUMP(t->count[stage], 1);
+  return now;
+}
+#endif
+
+void stats_read(long long ns[STATS_STAGES], long count[STATS_STAGES]) {
+  pthread_mutex_lock(&registryLock);
+  for (int s = 0; s < STATS_STAGES; s++) {
+    ns[s] = exitedNs[s];
+    count[s] = exitedCount[s];
+  }
+  for (ThreadStats* t = threads; t != NULL; t = t->next) {
+    for (int s = 0; s < STATS_STAGES; s++) {
+      ns[s] += atomic_load_explicit(&t->ns[s], memory_order_relaxed);
+      count[s] += atomic_load_explicit(&t->count[s], memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock(&registryLock);
+}
+
+void blockTimes_init(BlockTimes* t) {
+  atomic_init(&t->blocks, 0);
+  atomic_init(&t->overruns, 0);
+  atomic_init(&t->totalNs, 0);
+  atomic_init(&t->maxNs, 0);
+  for (int b = 0; b < STATS_HISTOGRAM_BUCKETS; b++) {
+    atomic_init(&t->histogram[b], 0);
+  }
+}
+
+void blockTimes_add(BlockTimes* t, long long ns, long long deadlineNs) {
+  BUMP(t->blocks, 1);
+  BUMP(t->totalNs, ns);
+  if (ns > atomic_load_explicit(&t->maxNs, memory_order_relaxed)) {
+    atomic_store_explicit(&t->maxNs, ns, memory_order_relaxed);
+  }
+  if (deadlineNs > 0 && ns > deadlineNs) {
+    BUMP(t->overruns, 1);
+  }
+  int bucket = 0;
+  for (long long us = ns/1000; us > 0 && bucket < STATS_HISTOGRAM_BUCKETS - 1; us >>= 1) {
+    bucket++;
+  }
+  BUMP(t->histogram[bucket], 1);
+}
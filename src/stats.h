@@ -0,0 +1,65 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+
+/* Cheap always-on timing of the processing stages
+ * Every thread adds to its own counters, which nothing else writes, so adding is two relaxed stores
+ * and a clock read. Reading sums the counters of every thread that ever added to them.
+ * Building with -DAUDIOSIM_NO_STATS turns the timing into nothing.
+ */
+typedef enum {
+  STATS_INTERPOLATE,
+  STATS_FORWARD_FFT,
+  STATS_MULTIPLY,
+  STATS_INVERSE_FFT,
+  STATS_OVERLAP_ADD,
+  STATS_NORMALISE,
+  STATS_STAGES
+} StatsStage;
+
+/* Monotonic time in nanoseconds
+ */
+long long stats_now(void);
+
+#ifdef AUDIOSIM_NO_STATS
+static inline long long stats_lap(StatsStage stage, long long start) {
+  (void)stage;
+  return start;
+}
+#define stats_begin() 0LL
+#else
+/* Adds the time since start to the stage and returns the current time, so consecutive stages can
+ * be timed with one clock read each
+ */
+long long stats_lap(StatsStage stage, long long start);
+#define stats_begin() stats_now()
+#endif
+
+/* Totals of every thread, count is the number of laps of each stage
+ */
+void stats_read(long long ns[STATS_STAGES], long count[STATS_STAGES]);
+
+/* Block times are histogrammed in powers of 2 microseconds, bucket b holds blocks that took less than
+ * 2^b us and at least 2^(b-1), the last bucket everything longer
+ */
+#define STATS_HISTOGRAM_BUCKETS 20
+
+/* Processing times of one series of blocks, eg. a stream's
+ * Written by one thread at a time, any thread may read it
+ */
+typedef struct {
+  atomic_long blocks;
+  atomic_long overruns;
+  atomic_llong totalNs;
+  atomic_llong maxNs;
+  atomic_long histogram[STATS_HISTOGRAM_BUCKETS];
+} BlockTimes;
+
+void blockTimes_init(BlockTimes* t);
+
+/* Records a block that took ns, which overran if deadlineNs > 0 and it took longer
+ */
+void blockTimes_add(BlockTimes* t, long long ns, long long deadlineNs);
+
+#endif
@@ -0,0 +1,143 @@
+#include "threadpool.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "alloccount.h"
+
+struct ThreadPool_s {
+  int nWorkers;
+  pthread_t* workers;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+
+  // The batch being run, a new generation is started for every batch
+  ThreadPoolTask task;
+  void* context;
+  int nTasks;
+  atomic_int nextTask;
+  unsigned generation;
+  int finishedWorkers;
+  bool stopping;
+};
+
+static void runTasks(ThreadPool* pool) {
+  int i;
+  while ((i = atomic_fetch_add(&pool->nextTask, 1)) < pool->nTasks) {
+    pool->task(pool->context, i);
+  }
+}
+
+static void* workerMain(void* arg) {
+  ThreadPool* pool = arg;
+  unsigned seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stopping && pool->generation == seen) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->stopping) {
+      break;
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    runTasks(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->finishedWorkers++;
+    if (pool->finishedWorkers == pool->nWorkers) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+ThreadPool* threadPool_init(int nThreads) {
+  ThreadPool* pool = malloc(sizeof(ThreadPool));
+  pool->nWorkers = nThreads > 1 ? nThreads - 1 : 0;
+  pool->workers = malloc((pool->nWorkers > 0 ? pool->nWorkers : 1)*sizeof(pthread_t));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->task = NULL;
+  pool->context = NULL;
+  pool->nTasks = 0;
+  atomic_init(&pool->nextTask, 0);
+  pool->generation = 0;
+  pool->finishedWorkers = 0;
+  pool->stopping = false;
+
+  for (int i = 0; i < pool->nWorkers; i++) {
+    pthread_create(&pool->workers[i], NULL, workerMain, pool);
+  }
+  return pool;
+}
+
+void threadPool_destroy(ThreadPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->nWorkers; i++) {
+    pthread_join(pool->workers[i], NULL);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+  free(pool->workers);
+  free(pool);
+}
+
+int threadPool_size(ThreadPool* pool) {
+  return pool->nWorkers + 1;
+}
+
+void threadPool_parallelFor(ThreadPool* pool, int nTasks, ThreadPoolTask task, void* context) {
+  if (pool->nWorkers == 0 || nTasks <= 1) {
+    for (int i = 0; i < nTasks; i++) {
+      task(context, i);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->context = context;
+  pool->nTasks = nTasks;
+  atomic_store(&pool->nextTask, 0);
+  pool->finishedWorkers = 0;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  runTasks(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->finishedWorkers < pool->nWorkers) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int threadPool_cpuCount(void) {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+#endif
+}
@@ -0,0 +1,26 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/* Fixed set of worker threads that run batches of independent tasks
+ * Tasks are handed out one index at a time, so uneven tasks still balance across workers.
+ */
+typedef struct ThreadPool_s ThreadPool;
+
+typedef void (*ThreadPoolTask)(void* context, int index);
+
+/* nThreads counts the calling thread, which works on every batch too, so 1 means no extra threads
+ */
+ThreadPool* threadPool_init(int nThreads);
+void threadPool_destroy(ThreadPool* pool);
+int threadPool_size(ThreadPool* pool);
+
+/* Runs task(context, i) for every i in [0, nTasks) and returns once all of them are done
+ * Only one thread may start batches on a pool at a time
+ */
+void threadPool_parallelFor(ThreadPool* pool, int nTasks, ThreadPoolTask task, void* context);
+
+/* Number of processors available to the process
+ */
+int threadPool_cpuCount(void);
+
+#endif